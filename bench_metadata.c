@@ -0,0 +1,523 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Benchmark for the metadata functions in symlink.c.
+
+   gcc -O2 bench_metadata.c symlink.c reparse.c winerrno.c diag.c symstats.c
+       fault.c metacache.c -o bench_metadata -Wall
+
+   bench_metadata <dir> [-t threads] [-n ops] [-j results.json] [-c cache]
+
+   Builds trees under 'dir' (flat, deep, symlink-heavy, a junction chain,
+   and paths near MAX_PATH), then times lstat, readlink, realpath and
+   isSymLink on each, with one thread and with 'threads' threads (default:
+   the number of processors).  Each thread does 'ops' calls (default
+   20000).  Prints ops/sec, latency percentiles and file system calls per
+   op, and writes them as JSON with -j so runs can be compared.  With -c,
+   realpath and lstat go through the persistent cache in 'cache'.  The
+   trees are removed at exit.
+ */
+#define _WIN32_WINNT 0x0600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <windows.h>
+#include "symlink.h"
+#include "symstats.h"
+#include "metacache.h"
+
+#define API_LSTAT           0
+#define API_READLINK        1
+#define API_REALPATH        2
+#define API_REALPATH_ALLOC  3
+#define API_ISSYMLINK       4
+#define NAPIS               5
+
+#define ALL_APIS            ((1 << NAPIS) - 1)
+#define NO_READLINK         (ALL_APIS & ~(1 << API_READLINK))
+
+static const char *apiNames[NAPIS] = {
+    "lstat", "readlink", "realpath", "realpath_alloc", "isSymLink",
+};
+
+// what symstats counts each API as; isSymLink isn't counted
+static const int apiOps[NAPIS] = {
+    SYMSTATS_LSTAT, SYMSTATS_READLINK, SYMSTATS_REALPATH_BUF,
+    SYMSTATS_REALPATH_ALLOC, -1,
+};
+
+struct tree {
+    const char *name;
+    unsigned apis;          // APIs that apply to its paths
+    char **paths;           // what's timed
+    size_t nPaths, pathCap;
+    char **made;            // what was created, in order
+    bool *madeDir;
+    size_t nMade, madeCap;
+};
+
+struct job {
+    const struct tree *t;
+    int api;
+    size_t ops;
+    size_t first;           // where in t->paths this thread starts
+    unsigned long long *lat;
+    size_t errors;
+    LONGLONG ticks;
+    HANDLE go;
+};
+
+struct result {
+    const char *tree;
+    int api;
+    int threads;
+    size_t ops, errors;
+    double opsPerSec;
+    unsigned long long p50, p90, p99, p999, max;
+    double fsPerOp;         // -1 if not counted
+};
+
+static LARGE_INTEGER freq;
+
+static char *append(char ***list, size_t *n, size_t *cap, const char *s)
+{
+    if (*n == *cap) {
+        *cap = *cap ? *cap*2 : 64;
+        *list = realloc(*list, *cap * sizeof(char*));
+        if (!*list) { perror("realloc"); exit(1); }
+    }
+    return (*list)[(*n)++] = strdup(s);
+}
+
+static void made(struct tree *t, const char *path, bool isDir)
+{
+    size_t cap = t->madeCap;
+    append(&t->made, &t->nMade, &t->madeCap, path);
+    if (t->madeCap != cap) {
+        t->madeDir = realloc(t->madeDir, t->madeCap * sizeof(bool));
+        if (!t->madeDir) { perror("realloc"); exit(1); }
+    }
+    t->madeDir[t->nMade-1] = isDir;
+}
+
+static void timed(struct tree *t, const char *path)
+{
+    append(&t->paths, &t->nPaths, &t->pathCap, path);
+}
+
+static int mkDir(struct tree *t, const char *path)
+{
+    if (!CreateDirectoryA(path, 0)) {
+        fprintf(stderr, "can't create %s: error %lu\n", path, GetLastError());
+        return -1;
+    }
+    made(t, path, true);
+    return 0;
+}
+
+static int mkFile(struct tree *t, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) { perror(path); return -1; }
+    fputs("bench_metadata\n", fp);
+    fclose(fp);
+    made(t, path, false);
+    return 0;
+}
+
+static int mkSymlink(struct tree *t, const char *target, const char *path)
+{
+    if (symlink(target, path)) { perror(path); return -1; }
+    DWORD attr = GetFileAttributesA(path);
+    made(t, path, attr != INVALID_FILE_ATTRIBUTES
+                  && (attr & FILE_ATTRIBUTE_DIRECTORY));
+    return 0;
+}
+
+static int mkJunction(struct tree *t, const char *target, const char *path)
+{
+    if (junction_create(target, path)) { perror(path); return -1; }
+    made(t, path, true);
+    return 0;
+}
+
+// 1000 files in one directory
+static int buildFlat(struct tree *t, const char *root)
+{
+    char p[MAX_PATH];
+
+    t->apis = NO_READLINK;
+    snprintf(p, sizeof(p), "%s\\flat", root);
+    if (mkDir(t, p)) return -1;
+    for (int i=0; i < 1000; i++) {
+        snprintf(p, sizeof(p), "%s\\flat\\f%d", root, i);
+        if (mkFile(t, p)) return -1;
+        timed(t, p);
+    }
+    return 0;
+}
+
+// one file under 32 levels of directories
+static int buildDeep(struct tree *t, const char *root)
+{
+    char p[MAX_PATH];
+    int len = snprintf(p, sizeof(p), "%s\\deep", root);
+
+    t->apis = NO_READLINK;
+    if (mkDir(t, p)) return -1;
+    for (int i=0; i < 32; i++) {
+        len += snprintf(p+len, sizeof(p)-len, "\\d%d", i);
+        if (mkDir(t, p)) return -1;
+    }
+    snprintf(p+len, sizeof(p)-len, "\\f");
+    if (mkFile(t, p)) return -1;
+    timed(t, p);
+    return 0;
+}
+
+// 1000 symbolic links to 100 files
+static int buildSymlinks(struct tree *t, const char *root)
+{
+    char p[MAX_PATH], target[MAX_PATH];
+
+    t->apis = ALL_APIS;
+    snprintf(p, sizeof(p), "%s\\links", root);
+    if (mkDir(t, p)) return -1;
+    for (int i=0; i < 100; i++) {
+        snprintf(p, sizeof(p), "%s\\links\\t%d", root, i);
+        if (mkFile(t, p)) return -1;
+    }
+    for (int i=0; i < 1000; i++) {
+        snprintf(target, sizeof(target), "%s\\links\\t%d", root, i % 100);
+        snprintf(p, sizeof(p), "%s\\links\\l%d", root, i);
+        if (mkSymlink(t, target, p)) return -1;
+        timed(t, p);
+    }
+    return 0;
+}
+
+// a chain of 8 junctions, each pointing to the one before
+static int buildJunctions(struct tree *t, const char *root)
+{
+    char p[MAX_PATH], target[MAX_PATH];
+
+    t->apis = ALL_APIS;
+    snprintf(p, sizeof(p), "%s\\junctions", root);
+    if (mkDir(t, p)) return -1;
+    snprintf(target, sizeof(target), "%s\\junctions\\base", root);
+    if (mkDir(t, target)) return -1;
+    for (int i=0; i < 8; i++) {
+        snprintf(p, sizeof(p), "%s\\junctions\\j%d", root, i);
+        if (mkJunction(t, target, p)) return -1;
+        timed(t, p);
+        strcpy(target, p);
+    }
+    return 0;
+}
+
+// a file whose path is just under MAX_PATH
+static int buildLong(struct tree *t, const char *root)
+{
+    char p[MAX_PATH];
+    int len = snprintf(p, sizeof(p), "%s\\long", root);
+
+    t->apis = NO_READLINK;
+    if (mkDir(t, p)) return -1;
+    while (len + 1 + 24 + 3 < MAX_PATH - 12) {
+        len += snprintf(p+len, sizeof(p)-len, "\\%024d", len);
+        if (mkDir(t, p)) return -1;
+    }
+    snprintf(p+len, sizeof(p)-len, "\\f");
+    if (mkFile(t, p)) return -1;
+    timed(t, p);
+    return 0;
+}
+
+static void removeTree(struct tree *t)
+{
+    for (size_t i=t->nMade; i-- > 0; ) {
+        if (t->madeDir[i])
+            RemoveDirectoryA(t->made[i]);
+        else
+            DeleteFileA(t->made[i]);
+        free(t->made[i]);
+    }
+    for (size_t i=0; i < t->nPaths; i++) free(t->paths[i]);
+    free(t->made);
+    free(t->madeDir);
+    free(t->paths);
+}
+
+static int runOp(int api, const char *path)
+{
+    struct stat st;
+    char buf[MAX_PATH];
+
+    switch (api) {
+      case API_LSTAT:
+        return lstat(path, &st);
+      case API_READLINK:
+        return readlink(path, buf, sizeof(buf)) < 0 ? -1 : 0;
+      case API_REALPATH:
+        return realpath(path, buf) ? 0 : -1;
+      case API_REALPATH_ALLOC: {
+        char *p = realpath(path, 0);
+        free(p);
+        return p ? 0 : -1;
+      }
+      default:
+        return isSymLink(path) < 0 ? -1 : 0;
+    }
+}
+
+static DWORD WINAPI worker(LPVOID arg)
+{
+    struct job *j = arg;
+    const struct tree *t = j->t;
+    size_t k = j->first;
+    LARGE_INTEGER start, then, now;
+
+    WaitForSingleObject(j->go, INFINITE);
+
+    QueryPerformanceCounter(&start);
+    then = start;
+    for (size_t i=0; i < j->ops; i++) {
+        if (runOp(j->api, t->paths[k])) j->errors++;
+        if (++k == t->nPaths) k = 0;
+
+        QueryPerformanceCounter(&now);
+        j->lat[i] = (now.QuadPart - then.QuadPart) * 1000000000
+            / freq.QuadPart;
+        then = now;
+    }
+    j->ticks = now.QuadPart - start.QuadPart;
+    return 0;
+}
+
+static int compareLat(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long percentile(const unsigned long long *lat,
+                                     size_t n, double pct)
+{
+    size_t i = n * pct / 100;
+    return lat[i < n ? i : n-1];
+}
+
+static void runBench(const struct tree *t, int api, int nthreads,
+                     size_t ops, struct result *r)
+{
+    struct job *jobs = calloc(nthreads, sizeof(*jobs));
+    HANDLE *threads = calloc(nthreads, sizeof(*threads));
+    unsigned long long *lat = malloc(nthreads * ops * sizeof(*lat));
+    HANDLE go = CreateEvent(0, TRUE, FALSE, 0);
+    if (!jobs || !threads || !lat || !go) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    struct symstats before, after;
+    symstats_snapshot(&before);
+
+    int started = 0;
+    for (int i=0; i < nthreads; i++) {
+        struct job *j = &jobs[started];
+        j->t = t;
+        j->api = api;
+        j->ops = ops;
+        j->first = t->nPaths * i / nthreads;
+        j->lat = lat + started*ops;
+        j->go = go;
+        threads[started] = CreateThread(0, 0, worker, j, 0, 0);
+        if (threads[started]) started++;
+    }
+    SetEvent(go);
+    WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    symstats_snapshot(&after);
+
+    LONGLONG ticks = 0;
+    size_t errors = 0;
+    for (int i=0; i < started; i++) {
+        CloseHandle(threads[i]);
+        if (jobs[i].ticks > ticks) ticks = jobs[i].ticks;
+        errors += jobs[i].errors;
+    }
+
+    size_t n = started * ops;
+    qsort(lat, n, sizeof(*lat), compareLat);
+
+    r->tree = t->name;
+    r->api = api;
+    r->threads = started;
+    r->ops = n;
+    r->errors = errors;
+    r->opsPerSec = ticks ? n * (double)freq.QuadPart / ticks : 0;
+    r->p50 = percentile(lat, n, 50);
+    r->p90 = percentile(lat, n, 90);
+    r->p99 = percentile(lat, n, 99);
+    r->p999 = percentile(lat, n, 99.9);
+    r->max = n ? lat[n-1] : 0;
+    r->fsPerOp = -1;
+    if (apiOps[api] >= 0) {
+        const struct symstats_op *a = &before.op[apiOps[api]];
+        const struct symstats_op *b = &after.op[apiOps[api]];
+        if (b->calls > a->calls)
+            r->fsPerOp = (b->fs_calls - a->fs_calls)
+                / (double)(b->calls - a->calls);
+    }
+
+    CloseHandle(go);
+    free(lat);
+    free(threads);
+    free(jobs);
+}
+
+static void writeJson(FILE *fp, const struct result *r, size_t n,
+                      int nthreads, size_t ops)
+{
+    fprintf(fp, "{\n  \"threads\": %d,\n  \"ops_per_thread\": %zu,\n"
+            "  \"results\": [\n", nthreads, ops);
+    for (size_t i=0; i < n; i++) {
+        fprintf(fp, "    {\"tree\": \"%s\", \"api\": \"%s\", "
+                "\"threads\": %d, \"ops\": %zu, \"errors\": %zu, "
+                "\"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+                "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, "
+                "\"fs_calls_per_op\": %.2f}%s\n",
+                r[i].tree, apiNames[r[i].api], r[i].threads, r[i].ops,
+                r[i].errors, r[i].opsPerSec, r[i].p50, r[i].p90, r[i].p99,
+                r[i].p999, r[i].max, r[i].fsPerOp, i+1 < n ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int ac, char **av)
+{
+    const char *json = 0, *cache = 0;
+    int nthreads = 0;
+    size_t ops = 20000;
+    char root[MAX_PATH] = "";
+
+    for (int i=1; i < ac; i++) {
+        if (!strcmp(av[i], "-t") && i+1 < ac)
+            nthreads = atoi(av[++i]);
+        else if (!strcmp(av[i], "-n") && i+1 < ac)
+            ops = strtoul(av[++i], 0, 0);
+        else if (!strcmp(av[i], "-j") && i+1 < ac)
+            json = av[++i];
+        else if (!strcmp(av[i], "-c") && i+1 < ac)
+            cache = av[++i];
+        else if (!root[0] && av[i][0] != '-')
+            GetFullPathNameA(av[i], sizeof(root), root, 0);
+        else
+            ops = 0;    // show usage
+    }
+    if (!root[0] || !ops) {
+        fprintf(stderr, "usage: %s dir [-t threads] [-n ops] "
+                "[-j results.json] [-c cache]\n", av[0]);
+        return 1;
+    }
+    if (cache && !metacache_active && metacache_open(cache, 0)) {
+        perror(cache);
+        return 1;
+    }
+    if (nthreads <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        nthreads = si.dwNumberOfProcessors;
+    }
+
+    QueryPerformanceFrequency(&freq);
+    CreateDirectoryA(root, 0);
+
+    static const struct {
+        const char *name;
+        int (*build)(struct tree*, const char*);
+    } builders[] = {
+        { "flat",       buildFlat },
+        { "deep",       buildDeep },
+        { "symlinks",   buildSymlinks },
+        { "junctions",  buildJunctions },
+        { "long",       buildLong },
+    };
+    const int nTrees = sizeof(builders)/sizeof(builders[0]);
+    const int threadCounts[] = { 1, nthreads };
+    const int nCounts = nthreads > 1 ? 2 : 1;
+
+    struct result *results = calloc(nTrees * NAPIS * nCounts,
+                                    sizeof(*results));
+    size_t nResults = 0;
+
+    printf("%-10s %-15s %7s %12s %9s %9s %9s %9s %6s\n", "tree", "api",
+           "threads", "ops/sec", "p50 us", "p90 us", "p99 us", "max us",
+           "fs/op");
+
+    for (int i=0; i < nTrees; i++) {
+        struct tree t = { .name = builders[i].name };
+
+        if (builders[i].build(&t, root)) {
+            fprintf(stderr, "skipping %s\n", t.name);
+            removeTree(&t);
+            continue;
+        }
+
+        for (int api=0; api < NAPIS; api++) {
+            if (!(t.apis & (1 << api))) continue;
+
+            for (int c=0; c < nCounts; c++) {
+                struct result *r = &results[nResults++];
+                runBench(&t, api, threadCounts[c], ops, r);
+
+                char fs[16] = "-";
+                if (r->fsPerOp >= 0)
+                    snprintf(fs, sizeof(fs), "%.2f", r->fsPerOp);
+                printf("%-10s %-15s %7d %12.0f %9.1f %9.1f %9.1f %9.1f "
+                       "%6s%s\n",
+                       r->tree, apiNames[api], r->threads, r->opsPerSec,
+                       r->p50/1e3, r->p90/1e3, r->p99/1e3, r->max/1e3, fs,
+                       r->errors ? "  (errors)" : "");
+            }
+        }
+
+        removeTree(&t);
+    }
+
+    if (json) {
+        FILE *fp = fopen(json, "w");
+        if (!fp) {
+            perror(json);
+            return 1;
+        }
+        writeJson(fp, results, nResults, nthreads, ops);
+        fclose(fp);
+    }
+
+    free(results);
+    return 0;
+}
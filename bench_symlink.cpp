@@ -0,0 +1,135 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Microbenchmark: symlink.hpp against the std::filesystem equivalents.
+
+   Linux:   g++ -std=c++17 -O2 bench_symlink.cpp -o bench_symlink
+   MinGW:   gcc -c -O2 symlink.c reparse.c winerrno.c diag.c symstats.c fault.c
+                metacache.c
+            g++ -std=c++17 -O2 bench_symlink.cpp *.o -o bench_symlink
+
+   bench_symlink [dir] [iterations]
+
+   Creates a file and a link to it in 'dir' (default: the temp
+   directory), then reports ns/call and heap allocations per call for
+   each pair.  The allocation count comes from replacing the global
+   operator new.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <string>
+#include "symlink.hpp"
+
+namespace fs = std::filesystem;
+namespace mc = mingw_compat;
+
+static std::atomic<unsigned long> allocations;
+
+void *operator new(std::size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+static volatile std::size_t sink;
+
+template <class F>
+static void bench(const char *name, long iterations, F f)
+{
+    f();    // warm up
+    unsigned long a0 = allocations.load();
+    auto t0 = std::chrono::steady_clock::now();
+
+    for (long i=0; i < iterations; i++) f();
+
+    auto t1 = std::chrono::steady_clock::now();
+    unsigned long a1 = allocations.load();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+
+    std::printf("%-36s %10.0f ns %8.2f allocs\n", name, ns / iterations,
+                (double)(a1 - a0) / iterations);
+}
+
+int main(int ac, char **av)
+{
+    fs::path dir = ac > 1 ? fs::path(av[1]) : fs::temp_directory_path();
+    long iterations = ac > 2 ? std::atol(av[2]) : 100000;
+
+    fs::path file = dir / "bench_symlink_file";
+    fs::path link = dir / "bench_symlink_link";
+    std::string fileName = file.string(), linkName = link.string();
+
+    std::ofstream(file) << "bench_symlink\n";
+    std::error_code ec;
+    fs::remove(link, ec);
+    mc::symlink(fileName, linkName, ec);
+    if (ec) {
+        std::fprintf(stderr, "can't create %s: %s\n", linkName.c_str(),
+                     ec.message().c_str());
+        fs::remove(file, ec);
+        return 1;
+    }
+
+    bench("mingw_compat::realpath", iterations, [&] {
+        sink = mc::realpath(linkName, ec).size();
+    });
+    bench("std::filesystem::canonical", iterations, [&] {
+        sink = fs::canonical(linkName, ec).native().size();
+    });
+
+    bench("mingw_compat::readlink", iterations, [&] {
+        sink = mc::readlink(linkName, ec).size();
+    });
+    bench("std::filesystem::read_symlink", iterations, [&] {
+        sink = fs::read_symlink(linkName, ec).native().size();
+    });
+
+    bench("mingw_compat::lstat", iterations, [&] {
+        sink = mc::lstat(linkName, ec).st_size;
+    });
+    bench("std::filesystem::symlink_status", iterations, [&] {
+        sink = (std::size_t)fs::symlink_status(linkName, ec).type();
+    });
+
+    bench("mingw_compat::is_symlink", iterations, [&] {
+        sink = mc::is_symlink(linkName, ec);
+    });
+    bench("std::filesystem::is_symlink", iterations, [&] {
+        sink = fs::is_symlink(fs::symlink_status(linkName, ec));
+    });
+
+    fs::remove(link, ec);
+    fs::remove(file, ec);
+    return 0;
+}
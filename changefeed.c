@@ -0,0 +1,967 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Change feeds: the USN journal backend (Windows, NTFS), and the
+   snapshot backend, which diffs a saved scan of the tree against a new
+   one.  The snapshot backend needs only the primitives in the scan
+   section, so it runs on Linux too.
+ */
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0600
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#include "symlink.h"
+#include "winerrno.h"
+#define SEP         '\\'
+#define SEPSTR      "\\"
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#define SEP         '/'
+#define SEPSTR      "/"
+#endif
+
+#include "changefeed.h"
+#include "treesnap.h"
+
+#define BACKEND_SNAPSHOT    0
+#define BACKEND_USN         1
+
+#define PATH_BUF            4096
+
+struct change_feed {
+    int backend;
+    char *root;         // canonical, no trailing separator
+    size_t rootLen;
+    char *state;
+#ifdef _WIN32
+    HANDLE volume;
+    DWORDLONG journal;
+    USN next;
+    bool reset;         // no usable cursor: the next read starts one
+#endif
+};
+
+#ifdef _WIN32
+static int fail(void)
+{
+    win32_set_errno();
+    return -1;
+}
+#endif
+
+static int emit(change_callback cb, void *ctx, int type, const char *path,
+                const char *old)
+{
+    struct change_event e = { .type = type, .path = path, .old_path = old };
+    return cb(&e, ctx);
+}
+
+/* Snapshots */
+
+// an entry that went or came, kept to match renames
+struct moved {
+    char *path;
+    int type;
+    unsigned long long size;
+    long long mtime;
+    unsigned long long dev;
+    unsigned char id[16];
+    bool renamed;
+};
+
+struct movedList {
+    struct moved *m;
+    size_t n, cap;
+};
+
+struct snapshotDiff {
+    change_callback cb;
+    void *ctx;
+    bool stopped;           // by the callback
+    struct movedList gone, added;
+};
+
+static int report(struct snapshotDiff *d, int type, const char *path,
+                  const char *old)
+{
+    if (emit(d->cb, d->ctx, type, path, old)) d->stopped = true;
+    return d->stopped;
+}
+
+static int addMoved(struct movedList *l, const struct tree_entry *e)
+{
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap*2 : 64;
+        struct moved *m = realloc(l->m, cap * sizeof(*m));
+        if (!m) {
+            errno = ENOMEM;
+            return -1;
+        }
+        l->m = m;
+        l->cap = cap;
+    }
+
+    struct moved *m = &l->m[l->n];
+    if (!(m->path = strdup(e->path))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    m->type = e->type;
+    m->size = e->size;
+    m->mtime = e->mtime;
+    m->dev = e->dev;
+    memcpy(m->id, e->id, sizeof(m->id));
+    m->renamed = false;
+    l->n++;
+    return 0;
+}
+
+static void freeMoved(struct movedList *l)
+{
+    for (size_t i=0; i < l->n; i++) free(l->m[i].path);
+    free(l->m);
+}
+
+static int onDiff(const struct tree_entry *old, const struct tree_entry *cur,
+                  unsigned changed, void *ctx)
+{
+    struct snapshotDiff *d = ctx;
+
+    if (!cur) return addMoved(&d->gone, old);
+    if (!old) return addMoved(&d->added, cur);
+
+    if ((old->type == TREE_LINK || cur->type == TREE_LINK)
+        && (changed & (TREE_CHANGED_TYPE | TREE_CHANGED_TARGET)))
+        return report(d, CHANGE_REPARSE, cur->path, 0);
+    if ((changed & (TREE_CHANGED_TYPE | TREE_CHANGED_ID))
+        || (cur->type == TREE_FILE
+            && (changed & (TREE_CHANGED_SIZE | TREE_CHANGED_MTIME))))
+        return report(d, CHANGE_MODIFIED, cur->path, 0);
+    return 0;
+}
+
+static bool hasId(const struct moved *m)
+{
+    for (int k=0; k < 16; k++)
+        if (m->id[k]) return true;
+    return false;
+}
+
+/* Renames keep the type, size and times, which tells a renamed file
+   from a new one that happened to reuse a deleted file's inode.
+*/
+static bool sameFile(const struct moved *a, const struct moved *b)
+{
+    return hasId(a) && a->type == b->type
+        && (a->type != TREE_FILE
+            || (a->size == b->size && a->mtime == b->mtime));
+}
+
+static int compareIds(const void *a, const void *b)
+{
+    const struct moved *x = *(struct moved**)a, *y = *(struct moved**)b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    return memcmp(x->id, y->id, sizeof(x->id));
+}
+
+static struct moved **byId(const struct movedList *l)
+{
+    struct moved **p = malloc((l->n + 1) * sizeof(*p));
+    if (!p) return 0;
+    for (size_t i=0; i < l->n; i++) p[i] = &l->m[i];
+    qsort(p, l->n, sizeof(*p), compareIds);
+    return p;
+}
+
+// a rename found by reportMoves()
+struct renamed {
+    struct moved *from, *to;
+    bool done;              // reported, or implied by its directory's
+};
+
+static int compareNewPaths(const void *a, const void *b)
+{
+    const struct renamed *x = a, *y = b;
+    return strcmp(x->to->path, y->to->path);
+}
+
+static int compareOldPaths(const void *a, const void *b)
+{
+    const struct renamed *x = *(struct renamed**)a, *y = *(struct renamed**)b;
+    return strcmp(x->from->path, y->from->path);
+}
+
+// the rename of the directory path[0..len), in 'dirs' sorted by old path
+static struct renamed *findDir(const char *path, size_t len,
+                               struct renamed **dirs, size_t n)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        const char *s = dirs[mid]->from->path;
+        int c = strncmp(path, s, len);
+        if (!c && s[len]) c = -1;
+        if (!c) return dirs[mid];
+        if (c < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return 0;
+}
+
+/* The old 'path' as it is after the directory renames reported so far:
+   'path' itself if none of them moved it, a new string if one did, or
+   NULL if out of memory.
+*/
+static char *renamedPath(char *path, struct renamed **dirs, size_t n)
+{
+    for (size_t len = strlen(path); len-- > 0; ) {
+        if (path[len] != SEP) continue;
+        struct renamed *r = findDir(path, len, dirs, n);
+        if (!r || !r->done) continue;
+
+        size_t head = strlen(r->to->path), tail = strlen(path + len);
+        char *p = malloc(head + tail + 1);
+        if (!p) {
+            errno = ENOMEM;
+            return 0;
+        }
+        memcpy(p, r->to->path, head);
+        memcpy(p + head, path + len, tail + 1);
+        return p;
+    }
+    return path;
+}
+
+/* Reports what went from one path and came to another, with the same
+   file ID, as renamed; the rest, in path order, as deleted or created.
+   Renames go in order of new path, so a directory's comes before its
+   contents'; what moved with it isn't reported, and the other old paths
+   are given as they are after it.
+*/
+static int reportMoves(struct snapshotDiff *d)
+{
+    struct moved **gone = byId(&d->gone), **added = byId(&d->added);
+    size_t most = d->gone.n < d->added.n ? d->gone.n : d->added.n;
+    struct renamed *r = malloc((most + 1) * sizeof(*r));
+    struct renamed **dirs = malloc((most + 1) * sizeof(*dirs));
+    if (!gone || !added || !r || !dirs) {
+        free(gone);
+        free(added);
+        free(r);
+        free(dirs);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t i = 0, j = 0, n = 0, nDirs = 0;
+    while (i < d->gone.n && j < d->added.n) {
+        int c = compareIds(&gone[i], &added[j]);
+        if (c < 0) {
+            i++;
+        } else if (c > 0) {
+            j++;
+        } else {
+            if (sameFile(gone[i], added[j])) {
+                gone[i]->renamed = added[j]->renamed = true;
+                r[n++] = (struct renamed){ gone[i], added[j], false };
+            }
+            i++;
+            j++;
+        }
+    }
+    free(gone);
+    free(added);
+
+    qsort(r, n, sizeof(*r), compareNewPaths);
+    for (size_t k=0; k < n; k++)
+        if (r[k].from->type == TREE_DIR) dirs[nDirs++] = &r[k];
+    qsort(dirs, nDirs, sizeof(*dirs), compareOldPaths);
+
+    int s = 0;
+    for (size_t k=0; !d->stopped && k < n; k++) {
+        char *old = renamedPath(r[k].from->path, dirs, nDirs);
+        if (!old) {
+            s = -1;
+            break;
+        }
+        if (strcmp(old, r[k].to->path))
+            report(d, CHANGE_RENAMED, r[k].to->path, old);
+        r[k].done = true;
+        if (old != r[k].from->path) free(old);
+    }
+
+    for (i=0; !s && !d->stopped && i < d->gone.n; i++) {
+        if (d->gone.m[i].renamed) continue;
+        char *old = renamedPath(d->gone.m[i].path, dirs, nDirs);
+        if (!old) {
+            s = -1;
+            break;
+        }
+        report(d, CHANGE_DELETED, old, 0);
+        if (old != d->gone.m[i].path) free(old);
+    }
+    for (j=0; !s && !d->stopped && j < d->added.n; j++)
+        if (!d->added.m[j].renamed)
+            report(d, CHANGE_CREATED, d->added.m[j].path, 0);
+    free(r);
+    free(dirs);
+    return s ? s : d->stopped;
+}
+
+static int snapshotRead(struct change_feed *f, change_callback cb, void *ctx)
+{
+    struct tree_snap *old = tree_snap_open(f->state);
+    if (!old) {
+        // no cursor, or not one of ours: start now
+        if (errno != ENOENT && errno != EINVAL) return -1;
+        return tree_snap_save(f->root, f->state) ? -1 : CHANGE_FEED_RESCAN;
+    }
+
+    // scan, diff and write the new snapshot in one pass
+    struct tree_snap_writer *w = tree_snap_create(f->state);
+    struct snapshotDiff d = { .cb = cb, .ctx = ctx };
+    int s = w ? tree_diff_scan(old, f->root, w, onDiff, &d) : -1;
+    int err = errno;
+    tree_snap_close(old);       // before the new one replaces it
+    if (!s) s = reportMoves(&d);
+    else errno = err;
+    err = errno;
+    freeMoved(&d.gone);
+    freeMoved(&d.added);
+
+    if (s) {
+        tree_snap_abort(w);
+        if (d.stopped) return 0;    // the cursor stays
+        errno = err;
+        return -1;
+    }
+    return tree_snap_finish(w);
+}
+
+/* USN journal */
+
+#ifdef _WIN32
+
+#define USN_BUFSIZE     (64 << 10)
+#define USN_MODIFIED    (USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND \
+                         | USN_REASON_DATA_TRUNCATION                       \
+                         | USN_REASON_BASIC_INFO_CHANGE                     \
+                         | USN_REASON_NAMED_DATA_OVERWRITE                  \
+                         | USN_REASON_NAMED_DATA_EXTEND                     \
+                         | USN_REASON_NAMED_DATA_TRUNCATION)
+
+static int queryJournal(struct change_feed *f, USN_JOURNAL_DATA *jd)
+{
+    DWORD got;
+    if (!DeviceIoControl(f->volume, FSCTL_QUERY_USN_JOURNAL, 0, 0,
+                         jd, sizeof(*jd), &got, 0))
+        return fail();
+    return 0;
+}
+
+static int saveUsnState(struct change_feed *f)
+{
+    FILE *fp = fopen(f->state, "w");
+    if (!fp) return -1;
+    fprintf(fp, "usn %llu %lld\n", (unsigned long long)f->journal,
+            (long long)f->next);
+    return fclose(fp) ? -1 : 0;
+}
+
+static int loadUsnState(struct change_feed *f)
+{
+    FILE *fp = fopen(f->state, "r");
+    if (!fp) return -1;
+
+    unsigned long long journal;
+    long long next;
+    int n = fscanf(fp, "usn %llu %lld", &journal, &next);
+    fclose(fp);
+    if (n != 2) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->journal = journal;
+    f->next = next;
+    return 0;
+}
+
+// needs the privilege to open the volume, normally an administrator's
+static int usnOpen(struct change_feed *f)
+{
+    char mount[MAX_PATH], volume[MAX_PATH], fsName[16];
+
+    if (!GetVolumePathNameA(f->root, mount, sizeof(mount))
+        || !GetVolumeInformationA(mount, 0, 0, 0, 0, 0, fsName,
+                                  sizeof(fsName))
+        || !GetVolumeNameForVolumeMountPointA(mount, volume, sizeof(volume)))
+        return fail();
+    if (strcmp(fsName, "NTFS")) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    volume[strlen(volume)-1] = 0;   // the volume, not its root directory
+    f->volume = CreateFileA(volume, GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+                            OPEN_EXISTING, 0, 0);
+    if (f->volume == INVALID_HANDLE_VALUE) return fail();
+
+    USN_JOURNAL_DATA jd;
+    if (queryJournal(f, &jd)) {
+        int err = errno;
+        CloseHandle(f->volume);
+        errno = err;
+        return -1;
+    }
+
+    // usnRead() starts the cursor, and says to rescan
+    if (loadUsnState(f)) f->reset = true;
+    return 0;
+}
+
+struct usnRead {
+    struct change_feed *f;
+    change_callback cb;
+    void *ctx;
+    DWORDLONG parent;       // the last directory looked up
+    char parentPath[PATH_BUF];
+    bool parentOk;
+    struct {                // old names of renames in progress
+        DWORDLONG id;
+        char *path;         // NULL if outside the root
+    } renames[64];
+    int nRenames;
+    bool lost;              // an old name that can't be paired
+};
+
+static bool idPath(struct change_feed *f, DWORDLONG id, char *buf,
+                   size_t len)
+{
+    FILE_ID_DESCRIPTOR d = { .dwSize = sizeof(d), .Type = FileIdType };
+    d.FileId.QuadPart = id;
+
+    HANDLE h = OpenFileById(f->volume, &d, 0, FILE_SHARE_READ
+                            | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                            FILE_FLAG_BACKUP_SEMANTICS);
+    if (h == INVALID_HANDLE_VALUE) return false;
+
+    DWORD n = GetFinalPathNameByHandleA(h, buf, len, FILE_NAME_OPENED);
+    CloseHandle(h);
+    if (!n || n >= len) return false;
+
+    if (!memcmp(buf, "\\\\?\\", 4)) memmove(buf, buf+4, n-4+1);
+    return true;
+}
+
+/* The path of the record's file relative to the root, in 'rel';
+   false if it's outside the root or its directory is gone.
+*/
+static bool recordPath(struct usnRead *u, const USN_RECORD *r, char *rel,
+                       size_t len)
+{
+    struct change_feed *f = u->f;
+
+    if (!u->parentOk || u->parent != r->ParentFileReferenceNumber) {
+        u->parent = r->ParentFileReferenceNumber;
+        u->parentOk = idPath(f, u->parent, u->parentPath,
+                             sizeof(u->parentPath));
+    }
+    if (!u->parentOk) return false;
+
+    const char *p = u->parentPath;
+    if (_strnicmp(p, f->root, f->rootLen)
+        || (p[f->rootLen] && p[f->rootLen] != '\\'))
+        return false;
+    p += f->rootLen;
+    if (*p) p++;
+
+    char name[MAX_PATH*3];
+    int n = WideCharToMultiByte(CP_ACP, 0,
+                                (const WCHAR*)((const char*)r
+                                               + r->FileNameOffset),
+                                r->FileNameLength / sizeof(WCHAR),
+                                name, sizeof(name) - 1, 0, 0);
+    name[n] = 0;
+
+    return snprintf(rel, len, "%s%s%s", p, *p ? "\\" : "", name)
+        < (int)len;
+}
+
+static int usnRecord(struct usnRead *u, const USN_RECORD *r)
+{
+    DWORD why = r->Reason;
+    char rel[PATH_BUF];
+    bool inside = recordPath(u, r, rel, sizeof(rel));
+
+    // a directory's new name makes the cached path stale
+    if (why & (USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME))
+        u->parentOk = false;
+
+    // an old name to pair with the new (the close record repeats both)
+    if ((why & USN_REASON_RENAME_OLD_NAME) && !(why & USN_REASON_CLOSE)) {
+        if (u->nRenames == 64) {
+            u->lost = true;
+            return 1;
+        }
+        u->renames[u->nRenames].id = r->FileReferenceNumber;
+        u->renames[u->nRenames].path = inside ? strdup(rel) : 0;
+        u->nRenames++;
+        return 0;
+    }
+
+    if ((why & USN_REASON_RENAME_NEW_NAME) && !(why & USN_REASON_CLOSE)) {
+        char *old = 0;
+        for (int i=0; i < u->nRenames; i++) {
+            if (u->renames[i].id == r->FileReferenceNumber) {
+                old = u->renames[i].path;
+                u->renames[i] = u->renames[--u->nRenames];
+                break;
+            }
+        }
+
+        // moves into or out of the tree are creations and deletions
+        int s = 0;
+        if (old && inside)
+            s = emit(u->cb, u->ctx, CHANGE_RENAMED, rel, old);
+        else if (inside)
+            s = emit(u->cb, u->ctx, CHANGE_CREATED, rel, 0);
+        else if (old)
+            s = emit(u->cb, u->ctx, CHANGE_DELETED, old, 0);
+        free(old);
+        return s;
+    }
+
+    if (!(why & USN_REASON_CLOSE) || !inside) return 0;
+
+    if (why & USN_REASON_FILE_DELETE)
+        return emit(u->cb, u->ctx, CHANGE_DELETED, rel, 0);
+    if (why & USN_REASON_FILE_CREATE)
+        return emit(u->cb, u->ctx, CHANGE_CREATED, rel, 0);
+    if (why & USN_REASON_REPARSE_POINT_CHANGE)
+        return emit(u->cb, u->ctx, CHANGE_REPARSE, rel, 0);
+    if (why & USN_MODIFIED)
+        return emit(u->cb, u->ctx, CHANGE_MODIFIED, rel, 0);
+    return 0;
+}
+
+static int usnRead(struct change_feed *f, change_callback cb, void *ctx)
+{
+    USN_JOURNAL_DATA jd;
+    if (queryJournal(f, &jd)) return -1;
+
+    if (f->reset || jd.UsnJournalID != f->journal
+        || f->next < jd.LowestValidUsn) {
+        f->journal = jd.UsnJournalID;
+        f->next = jd.NextUsn;
+        if (saveUsnState(f)) return -1;
+        f->reset = false;
+        return CHANGE_FEED_RESCAN;
+    }
+
+    struct usnRead *u = calloc(1, sizeof(*u));
+    char *buf = malloc(USN_BUFSIZE);
+    if (!u || !buf) {
+        free(u);
+        free(buf);
+        errno = ENOMEM;
+        return -1;
+    }
+    u->f = f;
+    u->cb = cb;
+    u->ctx = ctx;
+
+    READ_USN_JOURNAL_DATA rd = {
+        .ReasonMask = 0xFFFFFFFF,
+        .UsnJournalID = f->journal,
+    };
+    USN next = f->next;
+    int retval = 0;
+    bool stopped = false;
+
+    /* A rename's new name comes right after its old one, but maybe past
+       jd.NextUsn; read on until it does, so that the cursor is never
+       saved between the two.
+    */
+    while (next < jd.NextUsn || u->nRenames) {
+        DWORD got;
+        rd.StartUsn = next;
+        if (!DeviceIoControl(f->volume, FSCTL_READ_USN_JOURNAL, &rd,
+                             sizeof(rd), buf, USN_BUFSIZE, &got, 0)) {
+            if (GetLastError() == ERROR_JOURNAL_ENTRY_DELETED)
+                retval = CHANGE_FEED_RESCAN;
+            else
+                retval = fail();
+            break;
+        }
+        if (got <= sizeof(USN)) {
+            u->lost = u->nRenames > 0;
+            break;
+        }
+
+        for (DWORD off = sizeof(USN); off < got; ) {
+            const USN_RECORD *r = (const USN_RECORD*)(buf + off);
+            if (r->MajorVersion == 2 && usnRecord(u, r)) {
+                stopped = true;
+                break;
+            }
+            off += r->RecordLength;
+        }
+        if (stopped) break;
+        next = *(USN*)buf;
+    }
+
+    // else the new name would be reported as created, the old not at all
+    if (u->lost) retval = CHANGE_FEED_RESCAN;
+
+    for (int i=0; i < u->nRenames; i++) free(u->renames[i].path);
+    free(u);
+    free(buf);
+
+    if (retval < 0) return -1;
+    if (retval == CHANGE_FEED_RESCAN) {
+        if (queryJournal(f, &jd)) return -1;
+        f->journal = jd.UsnJournalID;
+        next = jd.NextUsn;
+    } else if (stopped) {
+        return 0;               // the cursor stays
+    }
+
+    f->next = next;
+    if (saveUsnState(f)) return -1;
+    return retval;
+}
+
+#endif
+
+/* The feed */
+
+struct change_feed *change_feed_open(const char *root, const char *state,
+                                     unsigned flags)
+{
+    struct change_feed *f = calloc(1, sizeof(*f));
+    if (!f) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    f->root = realpath(root, 0);
+    f->state = strdup(state);
+    if (!f->root || !f->state) goto failed;
+
+    f->rootLen = strlen(f->root);
+    while (f->rootLen > 1 && f->root[f->rootLen-1] == SEP)
+        f->root[--f->rootLen] = 0;
+
+    /* Without a cursor in 'state', the first read makes one and returns
+       CHANGE_FEED_RESCAN, so that a caller that dies before it finds out
+       again next time.
+    */
+    f->backend = BACKEND_SNAPSHOT;
+#ifdef _WIN32
+    if (!(flags & CHANGE_FEED_SNAPSHOT) && !usnOpen(f))
+        f->backend = BACKEND_USN;
+#else
+    (void)flags;
+#endif
+    return f;
+
+ failed:
+    {
+        int err = errno;
+        free(f->root);
+        free(f->state);
+        free(f);
+        errno = err;
+    }
+    return 0;
+}
+
+int change_feed_read(struct change_feed *f, change_callback cb, void *ctx)
+{
+#ifdef _WIN32
+    if (f->backend == BACKEND_USN)
+        return usnRead(f, cb, ctx);
+#endif
+    return snapshotRead(f, cb, ctx);
+}
+
+void change_feed_close(struct change_feed *f)
+{
+    if (!f) return;
+#ifdef _WIN32
+    if (f->backend == BACKEND_USN) CloseHandle(f->volume);
+#endif
+    free(f->root);
+    free(f->state);
+    free(f);
+}
+
+#ifdef UNIT_TEST
+// Linux:   gcc -c -g -Wall treesnap.c &&
+//          gcc -DUNIT_TEST -g -Wall changefeed.c treesnap.o -o changefeed
+// Windows: gcc -c -g -Wall treesnap.c symlink.c reparse.c winerrno.c
+//              diag.c symstats.c fault.c metacache.c &&
+//          gcc -DUNIT_TEST -g -Wall changefeed.c treesnap.o symlink.o
+//              reparse.o winerrno.o diag.o symstats.o fault.o metacache.o
+//              -o changefeed
+//
+// changefeed [dir]           runs the tests in 'dir' (default: the current
+//                            one) on the snapshot backend
+// changefeed -p root state   prints the changes since the last run
+
+#ifdef _WIN32
+#include <direct.h>
+#define makeDir(p)  _mkdir(p)
+#else
+#define makeDir(p)  mkdir(p, 0777)
+#endif
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("FAILED line %d: %s\n", __LINE__, #cond); \
+                        failures++; } } while (0)
+
+static const char *typeName[] = {
+    "?", "created", "modified", "deleted", "renamed", "reparse"
+};
+
+static int printChange(const struct change_event *e, void *ctx)
+{
+    (void)ctx;
+    if (e->type == CHANGE_RENAMED)
+        printf("%s %s <- %s\n", typeName[e->type], e->path, e->old_path);
+    else
+        printf("%s %s\n", typeName[e->type], e->path);
+    return 0;
+}
+
+struct seen {
+    char lines[16][256];
+    int n;
+    int stopAfter;      // stop the read after this many, if nonzero
+};
+
+static int collect(const struct change_event *e, void *ctx)
+{
+    struct seen *s = ctx;
+    if (s->n < 16)
+        snprintf(s->lines[s->n++], sizeof(s->lines[0]), "%s %s%s%s",
+                 typeName[e->type], e->path, e->old_path ? " <- " : "",
+                 e->old_path ? e->old_path : "");
+    return s->stopAfter && s->n >= s->stopAfter;
+}
+
+static bool saw(const struct seen *s, const char *line)
+{
+    for (int i=0; i < s->n; i++)
+        if (!strcmp(s->lines[i], line)) return true;
+    return false;
+}
+
+static void writeFile(const char *path, const char *data)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) { perror(path); exit(1); }
+    fputs(data, fp);
+    fclose(fp);
+}
+
+int main(int ac, char**av)
+{
+    if (ac == 4 && !strcmp(av[1], "-p")) {
+        struct change_feed *f = change_feed_open(av[2], av[3], 0);
+        if (!f) {
+            perror(av[2]);
+            return 1;
+        }
+        int r = change_feed_read(f, printChange, 0);
+        if (r < 0) perror("change_feed_read");
+        else if (r == CHANGE_FEED_RESCAN) printf("rescan\n");
+        change_feed_close(f);
+        return r < 0;
+    }
+
+    const char *dir = ac > 1 ? av[1] : ".";
+    // room in 'p' and 'q' for a name under 'root'
+    char root[PATH_BUF/2], state[PATH_BUF/2], p[PATH_BUF], q[PATH_BUF];
+    const char *files[] = { "a", "c", "n", "l", "sub" SEPSTR "b",
+                            "sub" SEPSTR "b2", "d" SEPSTR "x",
+                            "d" SEPSTR "w", "d" SEPSTR "s" SEPSTR "y",
+                            "e" SEPSTR "x", "e" SEPSTR "w", "e" SEPSTR "n",
+                            "e" SEPSTR "s" SEPSTR "y",
+                            "e" SEPSTR "s" SEPSTR "z" };
+    const char *dirs[] = { "sub", "d" SEPSTR "s", "d", "e" SEPSTR "s", "e" };
+
+    snprintf(root, sizeof(root), "%s" SEPSTR "changefeed_test", dir);
+    snprintf(state, sizeof(state), "%s" SEPSTR "changefeed_test.state", dir);
+    for (size_t i=0; i < sizeof(files)/sizeof(*files); i++) {
+        snprintf(p, sizeof(p), "%s" SEPSTR "%s", root, files[i]);
+        remove(p);
+    }
+    for (size_t i=0; i < sizeof(dirs)/sizeof(*dirs); i++) {
+        snprintf(p, sizeof(p), "%s" SEPSTR "%s", root, dirs[i]);
+        rmdir(p);
+    }
+    rmdir(root);
+    remove(state);
+
+    CHECK(!makeDir(root));
+    snprintf(p, sizeof(p), "%s" SEPSTR "sub", root);
+    CHECK(!makeDir(p));
+    snprintf(p, sizeof(p), "%s" SEPSTR "a", root);
+    writeFile(p, "a");
+    snprintf(p, sizeof(p), "%s" SEPSTR "c", root);
+    writeFile(p, "c");
+    snprintf(p, sizeof(p), "%s" SEPSTR "sub" SEPSTR "b", root);
+    writeFile(p, "b");
+
+    // no state: the first read starts the cursor, and says to rescan
+    struct change_feed *f = change_feed_open(root, state,
+                                             CHANGE_FEED_SNAPSHOT);
+    CHECK(f);
+    if (!f) return 1;
+    struct seen s = {0};
+    CHECK(change_feed_read(f, collect, &s) == CHANGE_FEED_RESCAN);
+    CHECK(s.n == 0);
+    CHECK(change_feed_read(f, collect, &s) == 0);
+    CHECK(s.n == 0);
+
+    snprintf(p, sizeof(p), "%s" SEPSTR "n", root);
+    writeFile(p, "new");
+    snprintf(p, sizeof(p), "%s" SEPSTR "a", root);
+    writeFile(p, "longer");
+    snprintf(p, sizeof(p), "%s" SEPSTR "c", root);
+    CHECK(!remove(p));
+    snprintf(p, sizeof(p), "%s" SEPSTR "sub" SEPSTR "b", root);
+    snprintf(q, sizeof(q), "%s" SEPSTR "sub" SEPSTR "b2", root);
+    CHECK(!rename(p, q));
+    snprintf(p, sizeof(p), "%s" SEPSTR "l", root);
+    CHECK(!symlink("a", p));
+
+    memset(&s, 0, sizeof(s));
+    CHECK(change_feed_read(f, collect, &s) == 0);
+    for (int i=0; i < s.n; i++) printf("%s\n", s.lines[i]);
+    CHECK(s.n == 5);
+    CHECK(saw(&s, "created n"));
+    CHECK(saw(&s, "modified a"));
+    CHECK(saw(&s, "deleted c"));
+    CHECK(saw(&s, "renamed sub" SEPSTR "b2 <- sub" SEPSTR "b"));
+    CHECK(saw(&s, "created l"));
+
+    // repointing a link
+    snprintf(p, sizeof(p), "%s" SEPSTR "l", root);
+    CHECK(!remove(p));
+    CHECK(!symlink("n", p));
+    memset(&s, 0, sizeof(s));
+    CHECK(change_feed_read(f, collect, &s) == 0);
+    CHECK(s.n == 1 && saw(&s, "reparse l"));
+
+    // a stopped read leaves the cursor where it was, even across opens
+    snprintf(p, sizeof(p), "%s" SEPSTR "a", root);
+    writeFile(p, "longer still");
+    memset(&s, 0, sizeof(s));
+    s.stopAfter = 1;
+    CHECK(change_feed_read(f, collect, &s) == 0);
+    CHECK(s.n == 1);
+    change_feed_close(f);
+
+    f = change_feed_open(root, state, CHANGE_FEED_SNAPSHOT);
+    CHECK(f);
+    if (!f) return 1;
+    memset(&s, 0, sizeof(s));
+    CHECK(change_feed_read(f, collect, &s) == 0);
+    CHECK(s.n == 1 && saw(&s, "modified a"));
+    memset(&s, 0, sizeof(s));
+    CHECK(change_feed_read(f, collect, &s) == 0);
+    CHECK(s.n == 0);
+
+    // a directory's rename covers its contents'
+    snprintf(p, sizeof(p), "%s" SEPSTR "d", root);
+    CHECK(!makeDir(p));
+    snprintf(p, sizeof(p), "%s" SEPSTR "d" SEPSTR "s", root);
+    CHECK(!makeDir(p));
+    snprintf(p, sizeof(p), "%s" SEPSTR "d" SEPSTR "x", root);
+    writeFile(p, "x");
+    snprintf(p, sizeof(p), "%s" SEPSTR "d" SEPSTR "w", root);
+    writeFile(p, "w");
+    snprintf(p, sizeof(p), "%s" SEPSTR "d" SEPSTR "s" SEPSTR "y", root);
+    writeFile(p, "y");
+    memset(&s, 0, sizeof(s));
+    CHECK(change_feed_read(f, collect, &s) == 0);
+    CHECK(s.n == 5);
+
+    snprintf(p, sizeof(p), "%s" SEPSTR "d", root);
+    snprintf(q, sizeof(q), "%s" SEPSTR "e", root);
+    CHECK(!rename(p, q));
+    snprintf(p, sizeof(p), "%s" SEPSTR "e" SEPSTR "s" SEPSTR "y", root);
+    snprintf(q, sizeof(q), "%s" SEPSTR "e" SEPSTR "s" SEPSTR "z", root);
+    CHECK(!rename(p, q));
+    snprintf(p, sizeof(p), "%s" SEPSTR "e" SEPSTR "w", root);
+    CHECK(!remove(p));
+    snprintf(p, sizeof(p), "%s" SEPSTR "e" SEPSTR "n", root);
+    writeFile(p, "n");
+    memset(&s, 0, sizeof(s));
+    CHECK(change_feed_read(f, collect, &s) == 0);
+    for (int i=0; i < s.n; i++) printf("%s\n", s.lines[i]);
+    CHECK(s.n == 4);
+    CHECK(!strcmp(s.lines[0], "renamed e <- d"));
+    CHECK(saw(&s, "renamed e" SEPSTR "s" SEPSTR "z <- e" SEPSTR "s"
+                  SEPSTR "y"));
+    CHECK(saw(&s, "deleted e" SEPSTR "w"));
+    CHECK(saw(&s, "created e" SEPSTR "n"));
+    change_feed_close(f);
+
+    // a damaged state, or the USN backend's, is no cursor either
+    const char *bad[] = { "damaged", "usn 1 2\n" };
+    for (int i=0; i < 2; i++) {
+        writeFile(state, bad[i]);
+        f = change_feed_open(root, state, CHANGE_FEED_SNAPSHOT);
+        CHECK(f);
+        if (!f) return 1;
+        memset(&s, 0, sizeof(s));
+        CHECK(change_feed_read(f, collect, &s) == CHANGE_FEED_RESCAN);
+        CHECK(change_feed_read(f, collect, &s) == 0);
+        CHECK(s.n == 0);
+        change_feed_close(f);
+    }
+
+    printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures != 0;
+}
+#endif
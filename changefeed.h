@@ -0,0 +1,100 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _CHANGEFEED_H
+#define _CHANGEFEED_H
+
+/* What changed under a directory tree since the last look, so an index
+   can be updated in time proportional to the churn rather than the size
+   of the tree.
+
+   On NTFS, with the privilege to open the volume, changes come from the
+   USN journal.  Otherwise (or with CHANGE_FEED_SNAPSHOT) a snapshot of
+   the tree is kept in the state file, and each read scans the tree and
+   reports the difference; that also works on Linux.
+
+   Typical use:
+
+       f = change_feed_open(root, state, 0);
+       loop:
+           // changes since the last read
+           if (change_feed_read(f, callback, ctx) == CHANGE_FEED_RESCAN)
+               ... full scan ...
+ */
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+// event types
+#define CHANGE_CREATED      1
+#define CHANGE_MODIFIED     2   // data, size or times
+#define CHANGE_DELETED      3
+#define CHANGE_RENAMED      4   // 'old_path' has the old name
+#define CHANGE_REPARSE      5   // became, stopped being, or repointed a link
+
+/* A renamed directory gets one CHANGE_RENAMED, and what moved with it
+   gets none; paths in the events after it are as they are after the
+   rename, so the events can be applied in order.
+*/
+struct change_event {
+    int type;
+    const char *path;           // relative to the root
+    const char *old_path;       // CHANGE_RENAMED only
+};
+
+/* Returns nonzero to stop the read; the cursor stays where it was. */
+typedef int (*change_callback)(const struct change_event *e, void *ctx);
+
+// flags
+#define CHANGE_FEED_SNAPSHOT    1   // don't use the USN journal
+
+// change_feed_read() result when there's no history to read
+#define CHANGE_FEED_RESCAN      1
+
+struct change_feed;
+
+/* Opens a feed on 'root', with its cursor saved in the file 'state'.  If
+   'state' doesn't exist, is damaged or was for the other backend, there
+   is no cursor, and the first read starts one.  Returns NULL with errno
+   set on failure.
+*/
+struct change_feed *change_feed_open(const char *root, const char *state,
+                                     unsigned flags);
+
+/* Calls 'cb' for each change since the cursor, then advances the cursor
+   and saves it.  Returns 0; CHANGE_FEED_RESCAN if there was no cursor
+   or changes were lost (the USN journal was recreated or wrapped, or
+   a rename's old name can't be paired with its new one), in which
+   case the cursor is reset to now and the caller should rescan; or -1
+   with errno set.
+*/
+int change_feed_read(struct change_feed *f, change_callback cb, void *ctx);
+
+void change_feed_close(struct change_feed *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -29,6 +29,8 @@
 #include <stdbool.h>
 #include "pthread.h"
 #include "pthread_time.h"
+#include "winerrno.h"
+#include "diag.h"
 
 // https://randomascii.wordpress.com/2020/10/04/windows-timer-resolution-the-great-rule-change/
 // Feature available in Windows 2004 and later
@@ -44,6 +46,23 @@
 
 #define POW10_9                 1000000000
 
+#ifdef UNIT_TEST
+// lets the test make the timer fail
+static DWORD failTimer;
+
+static BOOL testSetWaitableTimer(HANDLE h, const LARGE_INTEGER *due,
+                                 LONG period, PTIMERAPCROUTINE fn,
+                                 LPVOID arg, BOOL resume)
+{
+    if (failTimer) {
+        SetLastError(failTimer);
+        return FALSE;
+    }
+    return SetWaitableTimer(h, due, period, fn, arg, resume);
+}
+#define SetWaitableTimer testSetWaitableTimer
+#endif
+
 static inline int lc_set_errno(int result)
 {
     if (result != 0) {
@@ -65,24 +84,6 @@ static inline void timersub(struct timespec* c,
     }
 }
 
-static void printLastError(const char* func, int lineno)
-{
-    DWORD err = GetLastError();
-    LPVOID lpMsgBuf=0;
-    DWORD s = FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
-                            FORMAT_MESSAGE_FROM_SYSTEM |
-                            FORMAT_MESSAGE_IGNORE_INSERTS,
-                            0, err, 
-                            MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                            (LPTSTR)&lpMsgBuf, 0, 0);
-    if (s) {
-        fprintf(stderr, "%s:%d err=%ld: %s\n", func, lineno, err, (char*)lpMsgBuf);
-        LocalFree(lpMsgBuf);
-    } else {
-        fprintf(stderr, "%s:%d err=%ld: unknown error\n", func, lineno, err);
-    }
-}
-
 /**
  * Sleep for the specified time.
  * @param  clock_id: CLOCK_REALTIME or CLOCK_MONOTONIC
@@ -140,7 +141,9 @@ int clock_nanosleep(clockid_t clock_id, int flags,
             // Try for low res timer
             hTimer = CreateWaitableTimerEx(0, 0, CREATE_WAITABLE_TIMER_MANUAL_RESET, TIMER_ALL_ACCESS);
             if (!hTimer) {
-                printLastError(__func__, __LINE__);
+                DWORD e = win32_record_error();
+                DIAG(DIAG_ERROR, DIAG_CLOCK, "CreateWaitableTimerEx: error %lu",
+                     e);
                 return lc_set_errno(ENOTSUP);
             }
         }
@@ -151,13 +154,16 @@ int clock_nanosleep(clockid_t clock_id, int flags,
         // Set a timer
         int retval = 0;
         if (!SetWaitableTimer(hTimer, &liDueTime, 0, 0, 0, 0)) {
-            printLastError(__func__, __LINE__);
+            DWORD e = win32_record_error();
+            DIAG(DIAG_ERROR, DIAG_CLOCK, "SetWaitableTimer: error %lu", e);
             retval = lc_set_errno(ENOTSUP);
         } else {
             // Wait for the timer.
             DWORD st = WaitForSingleObject(hTimer, INFINITE);
             if (st != WAIT_OBJECT_0) {
-                printLastError(__func__, __LINE__);
+                DWORD e = win32_record_error();
+                DIAG(DIAG_ERROR, DIAG_CLOCK, "WaitForSingleObject: error %lu",
+                     e);
                 retval = lc_set_errno(ENOTSUP);
             }
         }
@@ -183,7 +189,7 @@ int clock_nanosleep(clockid_t clock_id, int flags,
 }
 
 #ifdef UNIT_TEST
-// gcc -DUNIT_TEST -g -O2 clock_nanosleep.c -o n -Wall -lwinmm
+// gcc -DUNIT_TEST -g -O2 clock_nanosleep.c winerrno.c diag.c -o n -Wall -lwinmm
 
 static inline
 bool haveHighResTimer()
@@ -261,6 +267,19 @@ int main(int ac, char**av)
         printf("Timer res set to minimum\n");
     }
     
+    // a failure is recorded for win32_last_error() with diagnostics off
+    diag_set(DIAG_OFF, 0);
+    failTimer = ERROR_INVALID_PARAMETER;
+    s = clock_nanosleep(CLOCK_MONOTONIC, 0, &delayTime, 0);
+    failTimer = 0;
+    if (s != -1 || errno != ENOTSUP
+        || win32_last_error() != ERROR_INVALID_PARAMETER) {
+        printf("FAILED: failing wait: %d, errno %d, last error %lu\n",
+               s, errno, win32_last_error());
+        return 1;
+    }
+    printf("failing wait: last error recorded\n");
+
     clock_gettime(CLOCK_MONOTONIC, &then);
 
     for (int i=0; i < iterations; i++) {
@@ -0,0 +1,1124 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* dedup(): collapse files with the same contents into hard links.
+
+   Candidates are narrowed in stages, each cheaper per file than the
+   next: size and volume, a hash of the first 4 KiB, a hash of the whole
+   file, and a byte-for-byte compare.  The reading stages run on a pool
+   of threads that claim files from a shared index.  Only the primitives
+   below differ between Windows and Linux, so it can be tested on Linux.
+
+   The hash is XXH64.  On Windows files are read through memory-mapped
+   views, which can't fault: the file is open without FILE_SHARE_WRITE,
+   so it can't be cut short under the view.  On Linux nothing stops a
+   truncate, and a mapped page past the new end raises SIGBUS, so files
+   are read with pread() instead.
+ */
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0600
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include "symlink.h"
+#include "winerrno.h"
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#endif
+
+#include "dedup.h"
+
+#define PREFIX_SIZE     4096
+
+#ifdef _WIN32
+#define VIEW_SIZE       (64 << 20)      // bytes mapped at a time
+#else
+#define VIEW_SIZE       (1 << 20)       // bytes read at a time
+#endif
+
+// identity of a file: its volume and file ID
+struct fileKey {
+    unsigned long long dev;
+    unsigned char id[16];
+};
+
+/* XXH64, https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+
+#define PRIME64_1   0x9E3779B185EBCA87ULL
+#define PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3   0x165667B19E3779F9ULL
+#define PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define PRIME64_5   0x27D4EB2F165667C5ULL
+
+struct xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buf[32];
+    unsigned bufLen;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return x << r | x >> (64 - r);
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);       // little-endian hosts only
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    return rotl64(acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t v)
+{
+    acc ^= xxhRound(0, v);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void xxhInit(struct xxh64 *s)
+{
+    s->v[0] = PRIME64_1 + PRIME64_2;
+    s->v[1] = PRIME64_2;
+    s->v[2] = 0;
+    s->v[3] = -PRIME64_1;
+    s->total = 0;
+    s->bufLen = 0;
+}
+
+static void xxhStripes(struct xxh64 *s, const unsigned char *p, size_t n)
+{
+    uint64_t v0 = s->v[0], v1 = s->v[1], v2 = s->v[2], v3 = s->v[3];
+
+    for (; n >= 32; p += 32, n -= 32) {
+        v0 = xxhRound(v0, read64(p));
+        v1 = xxhRound(v1, read64(p + 8));
+        v2 = xxhRound(v2, read64(p + 16));
+        v3 = xxhRound(v3, read64(p + 24));
+    }
+    s->v[0] = v0; s->v[1] = v1; s->v[2] = v2; s->v[3] = v3;
+}
+
+static void xxhUpdate(struct xxh64 *s, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+
+    s->total += n;
+    if (s->bufLen) {
+        size_t k = 32 - s->bufLen;
+        if (k > n) k = n;
+        memcpy(s->buf + s->bufLen, p, k);
+        s->bufLen += k;
+        p += k;
+        n -= k;
+        if (s->bufLen < 32) return;
+        xxhStripes(s, s->buf, 32);
+        s->bufLen = 0;
+    }
+
+    size_t whole = n & ~(size_t)31;
+    xxhStripes(s, p, whole);
+    memcpy(s->buf, p + whole, n - whole);
+    s->bufLen = n - whole;
+}
+
+static uint64_t xxhDigest(const struct xxh64 *s)
+{
+    uint64_t h;
+
+    if (s->total >= 32) {
+        h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7)
+            + rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+        for (int i=0; i < 4; i++) h = xxhMerge(h, s->v[i]);
+    } else {
+        h = PRIME64_5;
+    }
+    h += s->total;
+
+    const unsigned char *p = s->buf;
+    unsigned n = s->bufLen;
+    for (; n >= 8; p += 8, n -= 8)
+        h = rotl64(h ^ xxhRound(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+    if (n >= 4) {
+        h = rotl64(h ^ read32(p) * PRIME64_1, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n; p++, n--)
+        h = rotl64(h ^ *p * PRIME64_5, 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Platform primitives */
+
+#ifdef _WIN32
+
+struct mapFile {
+    HANDLE file, map;
+};
+
+static int fail(void)
+{
+    win32_set_errno();
+    return -1;
+}
+
+// 'mtime' is the last write time, in the system's own units
+static int fileInfo(const char *path, bool *regular,
+                    unsigned long long *size, unsigned long long *mtime,
+                    struct fileKey *key)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fa))
+        return fail();
+
+    *regular = !(fa.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY
+                                        | FILE_ATTRIBUTE_REPARSE_POINT));
+    *size = (unsigned long long)fa.nFileSizeHigh << 32 | fa.nFileSizeLow;
+    *mtime = (unsigned long long)fa.ftLastWriteTime.dwHighDateTime << 32
+        | fa.ftLastWriteTime.dwLowDateTime;
+    if (!*regular) return 0;
+
+    struct file_id id;
+    if (file_id(path, &id)) return -1;
+    key->dev = id.volume;
+    memcpy(key->id, id.id, sizeof(key->id));
+    return 0;
+}
+
+// Fails with EAGAIN if the file is no longer 'size' bytes.
+static int mapOpen(const char *path, unsigned long long size,
+                   struct mapFile *m)
+{
+    m->file = CreateFileA(path, GENERIC_READ,
+                          FILE_SHARE_READ | FILE_SHARE_DELETE, 0,
+                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (m->file == INVALID_HANDLE_VALUE) return fail();
+
+    LARGE_INTEGER len;
+    int err = 0;
+    if (!GetFileSizeEx(m->file, &len)) {
+        win32_set_errno();
+        err = errno;
+    } else if ((unsigned long long)len.QuadPart != size) {
+        err = EAGAIN;
+    }
+    if (err) {
+        CloseHandle(m->file);
+        errno = err;
+        return -1;
+    }
+
+    m->map = CreateFileMappingA(m->file, 0, PAGE_READONLY, 0, 0, 0);
+    if (!m->map) {
+        int s = fail();
+        CloseHandle(m->file);
+        return s;
+    }
+    return 0;
+}
+
+static const unsigned char *mapView(struct mapFile *m,
+                                    unsigned long long off, size_t len)
+{
+    void *p = MapViewOfFile(m->map, FILE_MAP_READ, off >> 32,
+                            off & 0xffffffff, len);
+    if (!p) win32_set_errno();
+    return p;
+}
+
+static void mapUnview(const unsigned char *p, size_t len)
+{
+    UnmapViewOfFile(p);
+}
+
+static void mapClose(struct mapFile *m)
+{
+    CloseHandle(m->map);
+    CloseHandle(m->file);
+}
+
+static int makeLink(const char *target, const char *path)
+{
+    return CreateHardLinkA(path, target, 0) ? 0 : fail();
+}
+
+static int replaceFile(const char *from, const char *to)
+{
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : fail();
+}
+
+static void removeFile(const char *path)
+{
+    DeleteFileA(path);
+}
+
+static unsigned long processId(void)
+{
+    return GetCurrentProcessId();
+}
+
+static double now(void)
+{
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return t.QuadPart / (double)f.QuadPart;
+}
+
+static int processors(void)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+}
+
+typedef HANDLE thread_t;
+
+static void poolWork(void *arg);
+
+static DWORD WINAPI threadMain(LPVOID arg)
+{
+    poolWork(arg);
+    return 0;
+}
+
+static bool startThread(thread_t *t, void *arg)
+{
+    *t = CreateThread(0, 0, threadMain, arg, 0, 0);
+    return *t != 0;
+}
+
+static void joinThread(thread_t t)
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+#else   // Linux
+
+struct mapFile {
+    int fd;
+    unsigned char *buf;     // VIEW_SIZE bytes
+};
+
+static int fileInfo(const char *path, bool *regular,
+                    unsigned long long *size, unsigned long long *mtime,
+                    struct fileKey *key)
+{
+    struct stat st;
+    if (lstat(path, &st)) return -1;
+
+    *regular = S_ISREG(st.st_mode);
+    *size = st.st_size;
+    *mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    key->dev = st.st_dev;
+    memset(key->id, 0, sizeof(key->id));
+    memcpy(key->id, &st.st_ino, sizeof(st.st_ino));
+    return 0;
+}
+
+// Fails with EAGAIN if the file is no longer 'size' bytes.
+static int mapOpen(const char *path, unsigned long long size,
+                   struct mapFile *m)
+{
+    m->fd = open(path, O_RDONLY);
+    if (m->fd < 0) return -1;
+
+    struct stat st;
+    int err = 0;
+    if (fstat(m->fd, &st))
+        err = errno;
+    else if ((unsigned long long)st.st_size != size)
+        err = EAGAIN;
+    else if (!(m->buf = malloc(VIEW_SIZE)))
+        err = ENOMEM;
+    if (err) {
+        close(m->fd);
+        errno = err;
+        return -1;
+    }
+
+    posix_fadvise(m->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+// A read that comes up short means the file was cut short: EAGAIN.
+static const unsigned char *mapView(struct mapFile *m,
+                                    unsigned long long off, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pread(m->fd, m->buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (!n) errno = EAGAIN;
+            return 0;
+        }
+        done += n;
+    }
+    return m->buf;
+}
+
+static void mapUnview(const unsigned char *p, size_t len)
+{
+    (void)p;
+    (void)len;
+}
+
+static void mapClose(struct mapFile *m)
+{
+    free(m->buf);
+    close(m->fd);
+}
+
+static int makeLink(const char *target, const char *path)
+{
+    return link(target, path);
+}
+
+static int replaceFile(const char *from, const char *to)
+{
+    return rename(from, to);
+}
+
+static void removeFile(const char *path)
+{
+    unlink(path);
+}
+
+static unsigned long processId(void)
+{
+    return getpid();
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int processors(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+typedef pthread_t thread_t;
+
+static void poolWork(void *arg);
+
+static void *threadMain(void *arg)
+{
+    poolWork(arg);
+    return 0;
+}
+
+static bool startThread(thread_t *t, void *arg)
+{
+    return !pthread_create(t, 0, threadMain, arg);
+}
+
+static void joinThread(thread_t t)
+{
+    pthread_join(t, 0);
+}
+
+#endif
+
+/* The pipeline */
+
+struct cand {
+    const char *path;
+    size_t idx;                 // in the caller's list
+    unsigned long long size, mtime;
+    struct fileKey key;
+};
+
+// a distinct file, named by cands[first] to cands[first+count-1]
+struct object {
+    struct cand *cand;
+    size_t count;
+    uint64_t prefix, hash;
+    int error;
+    struct object *keep;        // compare stage: the file to keep
+    bool same;                  // compare stage: contents match 'keep'
+};
+
+#define STAGE_PREFIX    0
+#define STAGE_HASH      1
+#define STAGE_COMPARE   2
+
+struct pool {
+    struct object **work;
+    size_t n;
+    size_t next;                // claimed atomically
+    int stage;
+    unsigned long long bytes;   // added atomically
+};
+
+static int hashPrefix(struct object *o, unsigned long long *bytes)
+{
+    unsigned char buf[PREFIX_SIZE];
+    FILE *fp = fopen(o->cand->path, "rb");
+    if (!fp) return -1;
+
+    size_t n = fread(buf, 1, sizeof(buf), fp);
+    int err = ferror(fp) ? EIO : 0;
+    fclose(fp);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    struct xxh64 s;
+    xxhInit(&s);
+    xxhUpdate(&s, buf, n);
+    o->prefix = xxhDigest(&s);
+    if (o->cand->size <= PREFIX_SIZE)
+        o->hash = o->prefix;    // that was the whole file
+    *bytes = n;
+    return 0;
+}
+
+static int hashFile(struct object *o, unsigned long long *bytes)
+{
+    struct mapFile m;
+    if (mapOpen(o->cand->path, o->cand->size, &m)) return -1;
+
+    struct xxh64 s;
+    xxhInit(&s);
+
+    unsigned long long size = o->cand->size;
+    for (unsigned long long off = 0; off < size; off += VIEW_SIZE) {
+        size_t len = size - off < VIEW_SIZE ? size - off : VIEW_SIZE;
+        const unsigned char *p = mapView(&m, off, len);
+        if (!p) {
+            int err = errno;
+            mapClose(&m);
+            errno = err;
+            return -1;
+        }
+        xxhUpdate(&s, p, len);
+        mapUnview(p, len);
+    }
+    mapClose(&m);
+
+    o->hash = xxhDigest(&s);
+    *bytes = size;
+    return 0;
+}
+
+static int compareFiles(struct object *o, unsigned long long *bytes)
+{
+    struct mapFile a, b;
+    if (mapOpen(o->keep->cand->path, o->keep->cand->size, &a)) return -1;
+    if (mapOpen(o->cand->path, o->cand->size, &b)) {
+        int err = errno;
+        mapClose(&a);
+        errno = err;
+        return -1;
+    }
+
+    int retval = 0;
+    unsigned long long size = o->cand->size;
+    o->same = true;
+    for (unsigned long long off = 0; o->same && off < size; off += VIEW_SIZE) {
+        size_t len = size - off < VIEW_SIZE ? size - off : VIEW_SIZE;
+        const unsigned char *p = mapView(&a, off, len);
+        const unsigned char *q = p ? mapView(&b, off, len) : 0;
+        if (!q) {
+            if (p) mapUnview(p, len);
+            retval = -1;
+            break;
+        }
+        o->same = !memcmp(p, q, len);
+        mapUnview(p, len);
+        mapUnview(q, len);
+        *bytes += 2*len;
+    }
+
+    int err = errno;
+    mapClose(&a);
+    mapClose(&b);
+    errno = err;
+    return retval;
+}
+
+static void poolWork(void *arg)
+{
+    struct pool *p = arg;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        if (i >= p->n) break;
+
+        struct object *o = p->work[i];
+        unsigned long long bytes = 0;
+        int s;
+        switch (p->stage) {
+          case STAGE_PREFIX:    s = hashPrefix(o, &bytes);     break;
+          case STAGE_HASH:      s = hashFile(o, &bytes);       break;
+          default:              s = compareFiles(o, &bytes);   break;
+        }
+        if (s) o->error = errno ? errno : EIO;
+
+        __atomic_fetch_add(&p->bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+// Runs 'stage' over 'work', on up to 'nthreads' threads including this one.
+static unsigned long long runPool(struct object **work, size_t n, int stage,
+                                  int nthreads)
+{
+    struct pool p = { .work = work, .n = n, .stage = stage };
+    thread_t threads[64];
+    int started = 0;
+
+    if (nthreads > 64) nthreads = 64;
+    if ((size_t)nthreads > n) nthreads = n;
+
+    for (int i=1; i < nthreads; i++)
+        if (startThread(&threads[started], &p)) started++;
+    poolWork(&p);
+    for (int i=0; i < started; i++)
+        joinThread(threads[i]);
+
+    return p.bytes;
+}
+
+static int compareKeys(const struct cand *a, const struct cand *b)
+{
+    if (a->size != b->size) return a->size < b->size ? -1 : 1;
+    if (a->key.dev != b->key.dev) return a->key.dev < b->key.dev ? -1 : 1;
+    return memcmp(a->key.id, b->key.id, sizeof(a->key.id));
+}
+
+static int compareCands(const void *x, const void *y)
+{
+    const struct cand *a = x, *b = y;
+    int c = compareKeys(a, b);
+    if (c) return c;
+    return a->idx < b->idx ? -1 : (a->idx > b->idx);
+}
+
+// files that may be duplicates: same size and volume
+static bool sameGroup(const struct object *a, const struct object *b)
+{
+    return a->cand->size == b->cand->size
+        && a->cand->key.dev == b->cand->key.dev;
+}
+
+static int compareByPrefix(const void *x, const void *y)
+{
+    const struct object *a = *(struct object**)x, *b = *(struct object**)y;
+    if (!sameGroup(a, b)) return compareKeys(a->cand, b->cand);
+    if (a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+    return a->cand->idx < b->cand->idx ? -1 : (a->cand->idx > b->cand->idx);
+}
+
+static int compareByHash(const void *x, const void *y)
+{
+    const struct object *a = *(struct object**)x, *b = *(struct object**)y;
+    if (!sameGroup(a, b)) return compareKeys(a->cand, b->cand);
+    if (a->hash != b->hash) return a->hash < b->hash ? -1 : 1;
+    return a->cand->idx < b->cand->idx ? -1 : (a->cand->idx > b->cand->idx);
+}
+
+/* Keeps the objects of 'list' that are in a group of two or more, as
+   judged by 'same', and failed objects out.  Returns the new length.
+*/
+static size_t keepGroups(struct object **list, size_t n,
+                         bool (*same)(const struct object*,
+                                      const struct object*))
+{
+    size_t out = 0;
+
+    for (size_t i=0; i < n; ) {
+        size_t j = i+1;
+        while (j < n && same(list[i], list[j])) j++;
+        if (j - i > 1)
+            for (size_t k=i; k < j; k++) list[out++] = list[k];
+        i = j;
+    }
+    return out;
+}
+
+static bool samePrefix(const struct object *a, const struct object *b)
+{
+    return sameGroup(a, b) && a->prefix == b->prefix;
+}
+
+static bool sameHash(const struct object *a, const struct object *b)
+{
+    return sameGroup(a, b) && a->hash == b->hash;
+}
+
+// drops objects that couldn't be read, reporting them
+static size_t dropFailed(struct object **list, size_t n,
+                         struct dedup_stats *st, dedup_report report,
+                         void *ctx)
+{
+    size_t out = 0;
+
+    for (size_t i=0; i < n; i++) {
+        if (list[i]->error) {
+            st->errors++;
+            if (report) report(0, list[i]->cand->path, list[i]->error, ctx);
+        } else {
+            list[out++] = list[i];
+        }
+    }
+    return out;
+}
+
+/* Whether 'c' is the file that was read: one written to or replaced since
+   may no longer match what it was compared with.
+*/
+static bool unchanged(const struct cand *c)
+{
+    unsigned long long size, mtime;
+    struct fileKey key;
+    bool regular;
+
+    return !fileInfo(c->path, &regular, &size, &mtime, &key) && regular
+        && size == c->size && mtime == c->mtime
+        && !memcmp(&key, &c->key, sizeof(key));
+}
+
+// Replaces 'dup' with a hard link to 'keep', atomically.
+static int replaceWithLink(const char *keep, const char *dup)
+{
+    static unsigned counter;
+    size_t len = strlen(dup) + 32;
+    char *tmp = malloc(len);
+    if (!tmp) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    snprintf(tmp, len, "%s.dedup%lu.%u", dup, processId(),
+             __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+
+    int s = makeLink(keep, tmp);
+    if (!s) {
+        s = replaceFile(tmp, dup);
+        if (s) {
+            int err = errno;
+            removeFile(tmp);
+            errno = err;
+        }
+    }
+
+    free(tmp);
+    return s;
+}
+
+int dedup(const char *const *paths, size_t n, int nthreads, unsigned flags,
+          struct dedup_stats *stats, dedup_report report, void *ctx)
+{
+    struct dedup_stats st = {0};
+    double start = now();
+    struct cand *cands = malloc((n ? n : 1) * sizeof(*cands));
+    struct object *objs = malloc((n ? n : 1) * sizeof(*objs));
+    struct object **list = malloc((n ? n : 1) * sizeof(*list));
+    size_t nCands = 0, nObjs = 0, nList = 0;
+
+    if (!cands || !objs || !list) {
+        free(cands);
+        free(objs);
+        free(list);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (nthreads <= 0) nthreads = processors();
+
+    for (size_t i=0; i < n; i++) {
+        struct cand *c = &cands[nCands];
+        bool regular;
+
+        if (fileInfo(paths[i], &regular, &c->size, &c->mtime, &c->key)) {
+            st.errors++;
+            if (report) report(0, paths[i], errno, ctx);
+            continue;
+        }
+        if (!regular) continue;
+
+        c->path = paths[i];
+        c->idx = i;
+        nCands++;
+    }
+    st.files = nCands;
+
+    // one object per distinct file; the first path listed names it
+    qsort(cands, nCands, sizeof(*cands), compareCands);
+    for (size_t i=0; i < nCands; ) {
+        size_t j = i+1;
+        while (j < nCands && !compareKeys(&cands[i], &cands[j])) j++;
+
+        objs[nObjs] = (struct object){ .cand = &cands[i], .count = j - i };
+        list[nObjs] = &objs[nObjs];
+        nObjs++;
+        st.already_linked += j - i - 1;
+        i = j;
+    }
+
+    // same size and volume, and not empty
+    nList = keepGroups(list, nObjs, sameGroup);
+    size_t skip = 0;
+    while (skip < nList && !list[skip]->cand->size) skip++;
+    memmove(list, list + skip, (nList - skip) * sizeof(*list));
+    nList -= skip;
+
+    double t = now();
+    st.bytes_read += runPool(list, nList, STAGE_PREFIX, nthreads);
+    nList = dropFailed(list, nList, &st, report, ctx);
+    qsort(list, nList, sizeof(*list), compareByPrefix);
+    nList = keepGroups(list, nList, samePrefix);
+
+    // whole files; those that fit in the prefix are already done
+    struct object **big = malloc((nList ? nList : 1) * sizeof(*big));
+    size_t nBig = 0;
+    if (!big) {
+        free(cands);
+        free(objs);
+        free(list);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i=0; i < nList; i++)
+        if (list[i]->cand->size > PREFIX_SIZE) big[nBig++] = list[i];
+    st.bytes_read += runPool(big, nBig, STAGE_HASH, nthreads);
+    nList = dropFailed(list, nList, &st, report, ctx);
+    qsort(list, nList, sizeof(*list), compareByHash);
+    nList = keepGroups(list, nList, sameHash);
+
+    // In each group keep the file with the most names, so the fewest
+    // paths change; compare the others with it.
+    nBig = 0;
+    for (size_t i=0; i < nList; ) {
+        size_t j = i+1;
+        struct object *keep = list[i];
+        while (j < nList && sameHash(list[i], list[j])) {
+            if (list[j]->count > keep->count) keep = list[j];
+            j++;
+        }
+        for (size_t k=i; k < j; k++) {
+            if (list[k] == keep) continue;
+            list[k]->keep = keep;
+            big[nBig++] = list[k];
+        }
+        i = j;
+    }
+    st.bytes_read += runPool(big, nBig, STAGE_COMPARE, nthreads);
+    nBig = dropFailed(big, nBig, &st, report, ctx);
+    st.read_seconds = now() - t;
+
+    for (size_t i=0; i < nBig; i++) {
+        struct object *o = big[i];
+        if (!o->same) continue;     // a hash collision
+
+        st.duplicates++;
+        bool all = true;
+        for (size_t k=0; k < o->count; k++) {
+            const char *keep = o->keep->cand->path, *dup = o->cand[k].path;
+            int err = 0;
+
+            // either may have been written since it was compared
+            if (!(flags & DEDUP_DRY_RUN)) {
+                if (!unchanged(o->keep->cand) || !unchanged(&o->cand[k]))
+                    err = EAGAIN;
+                else if (replaceWithLink(keep, dup))
+                    err = errno;
+            }
+
+            if (err) {
+                st.errors++;
+                all = false;
+            } else {
+                st.linked++;
+            }
+            if (report) report(keep, dup, err, ctx);
+        }
+        if (all) st.bytes_saved += o->cand->size;
+    }
+
+    free(big);
+    free(list);
+    free(objs);
+    free(cands);
+
+    st.seconds = now() - start;
+    if (stats) *stats = st;
+    return 0;
+}
+
+#ifdef UNIT_TEST
+// Linux:   gcc -DUNIT_TEST -g -Wall dedup.c -o dedup -lpthread && ./dedup [dir]
+// Windows: gcc -DUNIT_TEST -g -Wall dedup.c symlink.c reparse.c winerrno.c
+//              diag.c symstats.c fault.c metacache.c -o dedup && dedup [dir]
+//
+// dedup [dir]            runs the tests in 'dir' (default: the current one)
+// dedup -n|-l files...   finds duplicates (-n) or links them (-l), and
+//                        reports GB/s
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("FAILED line %d: %s\n", __LINE__, #cond); \
+                        failures++; } } while (0)
+
+static uint64_t xxh(const void *p, size_t n)
+{
+    struct xxh64 s;
+    xxhInit(&s);
+    xxhUpdate(&s, p, n);
+    return xxhDigest(&s);
+}
+
+static void writeFile(const char *path, const char *data, size_t n)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) { perror(path); exit(1); }
+    fwrite(data, 1, n, fp);
+    fclose(fp);
+}
+
+static void printReport(const char *keep, const char *dup, int error,
+                        void *ctx)
+{
+    if (error)
+        printf("%s: %s\n", dup, strerror(error));
+    else if (ctx)
+        printf("%s -> %s\n", dup, keep);
+}
+
+// appends to 'file' once 'after' is linked, as another writer might
+struct change {
+    const char *after, *file;
+    const char *failed;
+    int error;
+};
+
+static void changeAfter(const char *keep, const char *dup, int error,
+                        void *ctx)
+{
+    struct change *c = ctx;
+    (void)keep;
+
+    if (error) {
+        c->failed = dup;
+        c->error = error;
+    } else if (!strcmp(dup, c->after)) {
+        FILE *fp = fopen(c->file, "ab");
+        if (fp) {
+            fputc('!', fp);
+            fclose(fp);
+        }
+    }
+}
+
+static void printStats(const struct dedup_stats *st)
+{
+    printf("%llu files, %llu already linked, %llu duplicates, %llu linked, "
+           "%llu errors\n%.1f MB saved; read %.1f MB in %.3f s, %.2f GB/s; "
+           "%.3f s total\n",
+           st->files, st->already_linked, st->duplicates, st->linked,
+           st->errors, st->bytes_saved/1e6, st->bytes_read/1e6,
+           st->read_seconds,
+           st->read_seconds ? st->bytes_read/st->read_seconds/1e9 : 0,
+           st->seconds);
+}
+
+int main(int ac, char**av)
+{
+    if (ac > 2 && (!strcmp(av[1], "-n") || !strcmp(av[1], "-l"))) {
+        struct dedup_stats st;
+        unsigned flags = av[1][1] == 'n' ? DEDUP_DRY_RUN : 0;
+        if (dedup((const char *const*)av+2, ac-2, 0, flags, &st,
+                  printReport, (void*)1)) {
+            perror("dedup");
+            return 1;
+        }
+        printStats(&st);
+        return 0;
+    }
+
+    // XXH64 test vectors, and streaming in odd pieces
+    const char *nobody = "Nobody inspects the spammish repetition";
+    CHECK(xxh("", 0) == 0xEF46DB3751D8E999ULL);
+    CHECK(xxh("a", 1) == 0xD24EC4F1A98C6E5BULL);
+    CHECK(xxh("abc", 3) == 0x44BC2CF5AD770999ULL);
+    CHECK(xxh(nobody, strlen(nobody)) == 0xFBCEA83C8A378BF1ULL);
+
+    static char big[3*PREFIX_SIZE + 5];
+    for (size_t i=0; i < sizeof(big); i++) big[i] = i * 7 + (i >> 8);
+    struct xxh64 s;
+    xxhInit(&s);
+    for (size_t i=0, k=1; i < sizeof(big); i += k, k = k*3 % 97 + 1)
+        xxhUpdate(&s, big + i, k < sizeof(big) - i ? k : sizeof(big) - i);
+    CHECK(xxhDigest(&s) == xxh(big, sizeof(big)));
+
+    // a, b and f have the same contents; c differs early, e in its last
+    // byte; d is a hard link to a; g and h are small duplicates; the
+    // empty files i and j are left alone.
+    const char *dir = ac > 1 ? av[1] : ".";
+    const char *names[] = { "a", "b", "c", "d", "e", "f", "g", "h", "i", "j" };
+    enum { A, B, C, D, E, F, G, H, I, J, N };
+    char paths[N][4096];
+    const char *list[N];
+    for (int i=0; i < N; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/dedup_test_%s", dir,
+                 names[i]);
+        list[i] = paths[i];
+        removeFile(paths[i]);
+    }
+
+    writeFile(paths[A], big, sizeof(big));
+    writeFile(paths[B], big, sizeof(big));
+    writeFile(paths[F], big, sizeof(big));
+    big[1] ^= 1;
+    writeFile(paths[C], big, sizeof(big));
+    big[1] ^= 1;
+    big[sizeof(big)-1] ^= 1;
+    writeFile(paths[E], big, sizeof(big));
+    big[sizeof(big)-1] ^= 1;
+    CHECK(!makeLink(paths[A], paths[D]));
+    writeFile(paths[G], "small", 5);
+    writeFile(paths[H], "small", 5);
+    writeFile(paths[I], "", 0);
+    writeFile(paths[J], "", 0);
+
+    struct dedup_stats st;
+    CHECK(!dedup(list, N, 4, DEDUP_DRY_RUN, &st, printReport, 0));
+    CHECK(st.files == N);
+    CHECK(st.already_linked == 1);
+    CHECK(st.duplicates == 3);      // b, f, h
+    CHECK(st.linked == 3);
+    CHECK(st.errors == 0);
+
+    struct fileKey ka, kb, kh, kg, kc, ke;
+    unsigned long long size, mtime;
+    bool regular;
+    fileInfo(paths[B], &regular, &size, &mtime, &kb);
+    fileInfo(paths[A], &regular, &size, &mtime, &ka);
+    CHECK(memcmp(&ka, &kb, sizeof(ka)));    // dry run changed nothing
+
+    CHECK(!dedup(list, N, 4, 0, &st, printReport, 0));
+    CHECK(st.linked == 3);
+    CHECK(st.bytes_saved == 2*sizeof(big) + 5);
+    printStats(&st);
+
+    fileInfo(paths[A], &regular, &size, &mtime, &ka);
+    fileInfo(paths[B], &regular, &size, &mtime, &kb);
+    CHECK(!memcmp(&ka, &kb, sizeof(ka)));
+    fileInfo(paths[F], &regular, &size, &mtime, &kb);
+    CHECK(!memcmp(&ka, &kb, sizeof(ka)));
+    fileInfo(paths[C], &regular, &size, &mtime, &kc);
+    CHECK(memcmp(&ka, &kc, sizeof(ka)));
+    fileInfo(paths[E], &regular, &size, &mtime, &ke);
+    CHECK(memcmp(&ka, &ke, sizeof(ka)));
+    fileInfo(paths[G], &regular, &size, &mtime, &kg);
+    fileInfo(paths[H], &regular, &size, &mtime, &kh);
+    CHECK(!memcmp(&kg, &kh, sizeof(kg)));
+
+    // A file cut short after the scan fails with EAGAIN when it's read,
+    // rather than faulting on a page past its end.
+    struct cand ca = { .path = paths[C], .size = sizeof(big) };
+    struct cand ce = { .path = paths[E], .size = sizeof(big) };
+    struct object oc = { .cand = &ca }, oe = { .cand = &ce, .keep = &oc };
+    unsigned long long bytes = 0;
+    writeFile(paths[C], big, 100);
+    errno = 0;
+    CHECK(hashFile(&oc, &bytes) == -1 && errno == EAGAIN);
+    errno = 0;
+    CHECK(compareFiles(&oe, &bytes) == -1 && errno == EAGAIN);
+    big[1] ^= 1;
+    writeFile(paths[C], big, sizeof(big));
+    big[1] ^= 1;
+
+    // nothing left to do
+    CHECK(!dedup(list, N, 1, 0, &st, printReport, 0));
+    CHECK(st.linked == 0);
+    CHECK(st.already_linked == 4);
+
+    // A file written after the compare stage keeps what was written: b is
+    // linked to a first, then f, or a, which f is to be linked to, changes.
+    const char *abf[] = { paths[A], paths[B], paths[F] };
+    for (int i=0; i < 2; i++) {
+        struct change ch = { .after = paths[B],
+                             .file = i ? paths[A] : paths[F] };
+        for (int k=0; k < 3; k++) {
+            removeFile(abf[k]);
+            writeFile(abf[k], big, sizeof(big));
+        }
+
+        CHECK(!dedup(abf, 3, 2, 0, &st, changeAfter, &ch));
+        CHECK(st.linked == 1 && st.errors == 1);
+        CHECK(ch.failed == paths[F] && ch.error == EAGAIN);
+
+        fileInfo(paths[A], &regular, &size, &mtime, &ka);
+        fileInfo(paths[F], &regular, &size, &mtime, &kb);
+        CHECK(memcmp(&ka, &kb, sizeof(ka)));
+        CHECK(size == sizeof(big) + !i);
+    }
+
+    for (int i=0; i < N; i++) removeFile(paths[i]);
+
+    printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures != 0;
+}
+#endif
@@ -0,0 +1,79 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define DEDUP_DRY_RUN   1   // find duplicates, change nothing
+
+struct dedup_stats {
+    unsigned long long files;           // regular files among the paths
+    unsigned long long already_linked;  // paths to a file listed earlier
+    unsigned long long duplicates;      // files with the same contents
+                                        // as another, linked or not
+    unsigned long long linked;          // paths replaced by hard links
+                                        // (to be, with DEDUP_DRY_RUN)
+    unsigned long long bytes_read;      // to hash and compare
+    unsigned long long bytes_saved;     // size of the files replaced
+    unsigned long long errors;
+    double read_seconds;                // time spent hashing and comparing
+    double seconds;                     // total
+};
+
+/* Called for each path replaced (or, with DEDUP_DRY_RUN, that would be)
+   by a link to 'keep', and for each error, with 'error' the errno value.
+*/
+typedef void (*dedup_report)(const char *keep, const char *dup, int error,
+                             void *ctx);
+
+/* Replaces files among 'paths' that have the same contents with hard
+   links to one of them.  Files are grouped by size and volume, then by
+   a hash of their first 4 KiB, then by a hash of their whole contents
+   computed by 'nthreads' threads (0: one per processor).  Files with
+   equal hashes are compared byte for byte before linking.  Paths that
+   already name the same file (same file ID) are left alone.
+
+   Each duplicate is replaced atomically: a hard link is made under a
+   temporary name next to it and renamed over it.  Just before that, both
+   files are looked at again; if either's size, last write time or file
+   ID has changed since it was read, the duplicate is left alone and
+   reported with EAGAIN.
+
+   Returns 0, or -1 with errno set if the run itself failed; errors on
+   single files are counted in 'stats' and passed to 'report'.  'stats'
+   and 'report' may be NULL.  Throughput is bytes_read/read_seconds.
+*/
+int dedup(const char *const *paths, size_t n, int nthreads, unsigned flags,
+          struct dedup_stats *stats, dedup_report report, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
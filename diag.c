@@ -0,0 +1,271 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Each thread that logs gets a ring buffer, registered on a global list
+   the first time.  The owning thread is the only writer and the drain
+   (background thread or diag_flush) the only reader, so writing needs no
+   lock.  A full ring drops messages and counts them.
+ */
+#define _WIN32_WINNT 0x0600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <windows.h>
+#include "diag.h"
+
+#define RING_SIZE           16384
+#define MAX_RECORD          512
+#define RECORD_HEADER       4       // u16 length, u8 level, u8 subsystem
+#define DRAIN_INTERVAL_MS   20
+
+struct diagRing {
+    struct diagRing *next;
+    volatile LONG head;             // advanced by the owning thread
+    volatile LONG tail;             // advanced by the drain
+    volatile LONG dropped;
+    volatile LONG orphaned;         // the owning thread has exited
+    char buf[RING_SIZE];
+};
+
+volatile int diag_level = DIAG_OFF;
+volatile unsigned diag_mask = DIAG_ALL;
+
+static struct diagRing *rings;
+static SRWLOCK ringLock = SRWLOCK_INIT;    // list, and the drain
+static DWORD flsIndex = FLS_OUT_OF_INDEXES;
+static bool drainStarted;
+
+static diag_callback callback;
+static void *callbackCtx;
+
+static __thread struct diagRing *myRing;
+static __thread bool inDrain;
+
+static const char *levelName(int level)
+{
+    switch (level) {
+      case DIAG_ERROR:  return "error";
+      case DIAG_INFO:   return "info";
+      default:          return "trace";
+    }
+}
+
+static void toStderr(int level, unsigned subsystem, const char *msg,
+                     void *ctx)
+{
+    fprintf(stderr, "[%s %02x] %s\n", levelName(level), subsystem, msg);
+}
+
+void diag_set(int level, unsigned mask)
+{
+    diag_mask = mask;
+    diag_level = level;
+}
+
+void diag_set_callback(diag_callback cb, void *ctx)
+{
+    diag_flush();
+
+    AcquireSRWLockExclusive(&ringLock);
+    callback = cb;
+    callbackCtx = ctx;
+    ReleaseSRWLockExclusive(&ringLock);
+}
+
+// before the constructors that report through DIAG() (fault.c,
+// metacache.c), which have no priority
+__attribute__((constructor(101)))
+static void diagInit(void)
+{
+    const char *env = getenv("MINGW_COMPAT_DIAG");
+    if (!env) return;
+
+    char *end;
+    int level = strtol(env, &end, 0);
+    unsigned mask = DIAG_ALL;
+    if (*end == ',')
+        mask = strtoul(end+1, 0, 0);
+
+    diag_set(level, mask);
+}
+
+static void copyOut(const struct diagRing *r, unsigned pos, char *dst,
+                    size_t n)
+{
+    for (size_t i=0; i < n; i++)
+        dst[i] = r->buf[(pos + i) % RING_SIZE];
+}
+
+static void drainRing(struct diagRing *r, diag_callback cb, void *ctx)
+{
+    unsigned tail = r->tail;
+    unsigned head = r->head;
+    MemoryBarrier();    // read the records only after seeing 'head'
+
+    while (tail != head) {
+        unsigned char hdr[RECORD_HEADER];
+        char msg[MAX_RECORD];
+
+        copyOut(r, tail, (char*)hdr, RECORD_HEADER);
+        size_t len = hdr[0] | hdr[1] << 8;
+        copyOut(r, tail + RECORD_HEADER, msg, len - RECORD_HEADER);
+        msg[len - RECORD_HEADER] = 0;
+
+        cb(hdr[2], hdr[3], msg, ctx);
+        tail += len;
+    }
+
+    MemoryBarrier();
+    InterlockedExchange(&r->tail, tail);
+
+    LONG dropped = InterlockedExchange(&r->dropped, 0);
+    if (dropped) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%ld diagnostics dropped", dropped);
+        cb(DIAG_ERROR, DIAG_ALL, msg, ctx);
+    }
+}
+
+void diag_flush(void)
+{
+    AcquireSRWLockExclusive(&ringLock);
+    inDrain = true;     // a callback that logs mustn't re-enter
+
+    diag_callback cb = callback ? callback : toStderr;
+    struct diagRing **pr = &rings;
+    while (*pr) {
+        struct diagRing *r = *pr;
+        drainRing(r, cb, callbackCtx);
+
+        if (r->orphaned && r->tail == r->head) {
+            *pr = r->next;
+            free(r);
+        } else {
+            pr = &r->next;
+        }
+    }
+
+    inDrain = false;
+    ReleaseSRWLockExclusive(&ringLock);
+}
+
+static DWORD WINAPI drainThread(LPVOID arg)
+{
+    for (;;) {
+        Sleep(DRAIN_INTERVAL_MS);
+        diag_flush();
+    }
+    return 0;
+}
+
+static void diagAtExit(void)
+{
+    diag_flush();
+}
+
+// Runs when a thread with a ring exits; the drain frees the ring once
+// it has passed on what's left in it.
+static void WINAPI ringOrphaned(void *ring)
+{
+    if (ring)
+        InterlockedExchange(&((struct diagRing*)ring)->orphaned, 1);
+}
+
+static struct diagRing *threadRing(void)
+{
+    if (myRing) return myRing;
+
+    struct diagRing *r = calloc(1, sizeof(*r));
+    if (!r) return 0;
+
+    AcquireSRWLockExclusive(&ringLock);
+    if (!drainStarted) {
+        flsIndex = FlsAlloc(ringOrphaned);
+        HANDLE h = CreateThread(0, 0, drainThread, 0, 0, 0);
+        if (h) CloseHandle(h);
+        atexit(diagAtExit);
+        drainStarted = true;
+    }
+    r->next = rings;
+    rings = r;
+    ReleaseSRWLockExclusive(&ringLock);
+
+    if (flsIndex != FLS_OUT_OF_INDEXES)
+        FlsSetValue(flsIndex, r);
+    return myRing = r;
+}
+
+static void logRecord(int level, unsigned subsystem, const char *fmt,
+                      va_list ap)
+{
+    struct diagRing *r = threadRing();
+    if (!r) return;
+
+    char rec[MAX_RECORD];
+    int n = vsnprintf(rec + RECORD_HEADER, MAX_RECORD - RECORD_HEADER,
+                      fmt, ap);
+    if (n < 0) return;
+    if (n > MAX_RECORD - RECORD_HEADER - 1)
+        n = MAX_RECORD - RECORD_HEADER - 1;     // truncated
+
+    size_t len = RECORD_HEADER + n;
+    rec[0] = len & 0xff;
+    rec[1] = len >> 8;
+    rec[2] = level;
+    rec[3] = subsystem;
+
+    unsigned head = r->head;
+    unsigned tail = r->tail;
+    if (RING_SIZE - (head - tail) < len) {
+        InterlockedIncrement(&r->dropped);
+        return;
+    }
+
+    for (size_t i=0; i < len; i++)
+        r->buf[(head + i) % RING_SIZE] = rec[i];
+
+    MemoryBarrier();    // the record must be visible before 'head' moves
+    InterlockedExchange(&r->head, head + len);
+}
+
+void diag_log(int level, unsigned subsystem, const char *fmt, ...)
+{
+    if (inDrain) return;
+
+    // callers usually log right after a failure; leave errno and the
+    // Win32 error as they were
+    int err = errno;
+    DWORD lastError = GetLastError();
+
+    va_list ap;
+    va_start(ap, fmt);
+    logRecord(level, subsystem, fmt, ap);
+    va_end(ap);
+
+    SetLastError(lastError);
+    errno = err;
+}
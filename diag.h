@@ -0,0 +1,84 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _DIAG_H
+#define _DIAG_H
+
+/* Diagnostics for the library, off by default.
+
+   Enable with diag_set(), or with the environment variable
+   MINGW_COMPAT_DIAG=level[,mask], e.g. MINGW_COMPAT_DIAG=3,0x1 for a
+   trace of the symlink functions.  When a message is off, DIAG() costs
+   one compare.  When on, the message is formatted into a buffer owned by
+   the calling thread; a background thread passes it to the callback, so
+   the caller never takes the stdio lock.
+ */
+
+// levels
+#define DIAG_OFF        0
+#define DIAG_ERROR      1   // failures
+#define DIAG_INFO       2   // fallbacks and other notable events
+#define DIAG_TRACE      3   // every call
+
+// subsystems
+#define DIAG_SYMLINK    0x01    // symlink.c
+#define DIAG_CLOCK      0x02    // clock_nanosleep.c
+#define DIAG_LINKBATCH  0x04    // link_batch.c
+#define DIAG_FAULT      0x08    // fault.c
+#define DIAG_METACACHE  0x10    // metacache.c
+#define DIAG_ALL        0xff
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+typedef void (*diag_callback)(int level, unsigned subsystem,
+                              const char *msg, void *ctx);
+
+void diag_set(int level, unsigned mask);
+
+/* 'cb' is called from the background thread, or from diag_flush().
+   NULL restores the default, which writes to stderr.
+*/
+void diag_set_callback(diag_callback cb, void *ctx);
+
+/* Passes all buffered messages to the callback now. */
+void diag_flush(void);
+
+void diag_log(int level, unsigned subsystem, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+extern volatile int diag_level;
+extern volatile unsigned diag_mask;
+
+#define DIAG(level, subsystem, ...)                                 \
+    do {                                                            \
+        if (diag_level >= (level) && (diag_mask & (subsystem)))     \
+            diag_log(level, subsystem, __VA_ARGS__);                \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
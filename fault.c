@@ -0,0 +1,215 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Rules are few and set rarely, so they're a small table searched by
+   name under a shared lock.  Random numbers come from a per-thread
+   xorshift generator, so threads don't contend for one.
+ */
+#define _WIN32_WINNT 0x0600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <windows.h>
+#include "fault.h"
+#include "winerrno.h"
+#include "diag.h"
+
+#define MAX_RULES   32
+
+struct faultRule {
+    char call[48];
+    struct fault_spec spec;
+    volatile LONG calls;        // matched since set, for 'fail_nth'
+};
+
+volatile int fault_active;
+
+static struct faultRule rules[MAX_RULES];
+static int nRules;
+static SRWLOCK ruleLock = SRWLOCK_INIT;
+
+static __thread unsigned long long rngState;
+
+int fault_set(const char *call, const struct fault_spec *spec)
+{
+    int retval = 0;
+
+    AcquireSRWLockExclusive(&ruleLock);
+    int i;
+    for (i=0; i < nRules; i++)
+        if (!strcmp(rules[i].call, call)) break;
+
+    if (i == MAX_RULES || strlen(call) >= sizeof(rules[i].call)) {
+        errno = ENOSPC;
+        retval = -1;
+    } else {
+        if (i == nRules) nRules++;
+        strcpy(rules[i].call, call);
+        rules[i].spec = *spec;
+        rules[i].calls = 0;
+        fault_active = 1;
+    }
+    ReleaseSRWLockExclusive(&ruleLock);
+
+    return retval;
+}
+
+void fault_clear(void)
+{
+    AcquireSRWLockExclusive(&ruleLock);
+    fault_active = 0;
+    nRules = 0;
+    ReleaseSRWLockExclusive(&ruleLock);
+}
+
+// uniform in [0, 1)
+static double random01(void)
+{
+    if (!rngState) {
+        LARGE_INTEGER t;
+        QueryPerformanceCounter(&t);
+        rngState = (t.QuadPart ^ (unsigned long long)GetCurrentThreadId() << 32)
+            | 1;
+    }
+
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (rngState >> 11) * (1.0 / (1ULL << 53));
+}
+
+// Sleep() has millisecond resolution at best; spin for the rest.
+static void delay(unsigned long long us)
+{
+    LARGE_INTEGER freq, start, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    if (us >= 2000) Sleep(us/1000 - 1);
+
+    long long ticks = us * freq.QuadPart / 1000000;
+    do {
+        YieldProcessor();
+        QueryPerformanceCounter(&now);
+    } while (now.QuadPart - start.QuadPart < ticks);
+}
+
+// A rule naming the call wins over '*'.  With 'nth', counts the call
+// against the rule, and sets '*nth' to its number.
+static bool findRule(const char *call, struct fault_spec *spec, LONG *nth)
+{
+    struct faultRule *found = 0;
+
+    AcquireSRWLockShared(&ruleLock);
+    for (int i=0; i < nRules; i++) {
+        if (!strcmp(rules[i].call, call)) {
+            found = &rules[i];
+            break;
+        }
+        if (!strcmp(rules[i].call, "*"))
+            found = &rules[i];
+    }
+    if (found) {
+        *spec = found->spec;
+        if (nth) *nth = InterlockedIncrement(&found->calls);
+    }
+    ReleaseSRWLockShared(&ruleLock);
+
+    return found;
+}
+
+static void delayFor(const struct fault_spec *spec)
+{
+    double us;
+    switch (spec->dist) {
+      case FAULT_UNIFORM:   us = spec->us * random01();             break;
+      case FAULT_EXP:       us = -log(1 - random01()) * spec->us;   break;
+      default:              us = spec->us;                          break;
+    }
+    if (us >= 1) delay(us);
+}
+
+int fault_inject(const char *call)
+{
+    struct fault_spec spec;
+    LONG nth;
+    if (!findRule(call, &spec, &nth)) return 0;
+
+    delayFor(&spec);
+
+    if (spec.fail_nth ? (unsigned)nth == spec.fail_nth
+        : spec.fail_rate > 0 && random01() < spec.fail_rate) {
+        SetLastError(spec.error);
+        errno = win32_to_errno(spec.error);
+        return 1;
+    }
+    return 0;
+}
+
+void fault_delay(const char *call)
+{
+    struct fault_spec spec;
+    if (findRule(call, &spec, 0)) delayFor(&spec);
+}
+
+// MINGW_COMPAT_FAULTS="call=dist/us[,rate[/error]|,#n[/error]];..."
+__attribute__((constructor))
+static void faultInit(void)
+{
+    const char *env = getenv("MINGW_COMPAT_FAULTS");
+    if (!env) return;
+
+    char *list = strdup(env);
+    if (!list) return;
+
+    for (char *r = list, *next; r; r = next) {
+        next = strchr(r, ';');
+        if (next) *next++ = 0;
+        if (!*r) continue;
+
+        char call[48], dist[16];
+        struct fault_spec spec = { .error = ERROR_SHARING_VIOLATION };
+
+        int n = sscanf(r, " %47[^=]=%15[^/]/%u,#%u/%lu", call, dist,
+                       &spec.us, &spec.fail_nth, &spec.error);
+        if (n < 4)
+            n = sscanf(r, " %47[^=]=%15[^/]/%u,%lf/%lu", call, dist,
+                       &spec.us, &spec.fail_rate, &spec.error);
+        if (n < 3) {
+            DIAG(DIAG_ERROR, DIAG_FAULT, "MINGW_COMPAT_FAULTS: bad rule '%s'",
+                 r);
+            continue;
+        }
+
+        spec.dist = !strcmp(dist, "uniform") ? FAULT_UNIFORM
+                  : !strcmp(dist, "exp") ? FAULT_EXP : FAULT_FIXED;
+        fault_set(call, &spec);
+    }
+
+    free(list);
+}
@@ -0,0 +1,87 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _FAULT_H
+#define _FAULT_H
+
+/* Latency and error injection for the file system calls in symlink.c,
+   for benchmarking under slow or flaky storage (SMB shares, antivirus
+   filters).  Off by default; when off, each call costs one compare.
+
+   Rules are set with fault_set(), or with the environment variable
+   MINGW_COMPAT_FAULTS, a list of rules separated by ';':
+
+       call=dist/us[,rate[/error]]
+       call=dist/us,#n[/error]
+
+   'call' is a Win32 function name as called (e.g. CreateFileA), or '*'
+   for any call without its own rule.  'dist' is fixed, uniform (0 to
+   'us') or exp (mean 'us').  'rate' is the fraction of calls, 0 to 1,
+   that fail with Win32 error 'error' (default ERROR_SHARING_VIOLATION);
+   with '#n', only the n'th call matching the rule after it was set
+   fails, which lets a test fail one step of a sequence.  For example:
+
+       MINGW_COMPAT_FAULTS="CreateFileA=exp/2000,0.01;*=fixed/50"
+ */
+
+#define FAULT_FIXED     0
+#define FAULT_UNIFORM   1
+#define FAULT_EXP       2
+
+struct fault_spec {
+    int dist;
+    unsigned us;                // latency, per 'dist'
+    double fail_rate;           // 0 to 1
+    unsigned long error;        // Win32 error for injected failures
+    unsigned fail_nth;          // if not 0, fail only the n'th call
+};
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Adds or replaces the rule for 'call'.  Returns -1 with errno ENOSPC
+   if there are too many rules.
+*/
+int fault_set(const char *call, const struct fault_spec *spec);
+
+/* Removes all rules. */
+void fault_clear(void);
+
+/* For the library: delays per the rule for 'call', and returns nonzero
+   if the call should fail, with the last error and errno set.
+*/
+int fault_inject(const char *call);
+
+/* For calls that can't fail, such as closing a handle: only the delay.
+   Leaves errno and the last error alone.
+*/
+void fault_delay(const char *call);
+
+extern volatile int fault_active;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,223 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _HR_CLOCK_HPP
+#define _HR_CLOCK_HPP
+
+/* std::chrono clocks read with clock_gettime(), and sleeps through
+   clock_nanosleep().
+
+   libstdc++ on MinGW implements std::this_thread::sleep_for() with
+   nanosleep(), which sleeps in whole milliseconds or more.  The sleeps
+   here use clock_nanosleep(CLOCK_MONOTONIC), which uses a high
+   resolution waitable timer where Windows has one (see
+   clock_nanosleep.c).  Absolute sleeps are done as relative ones, to
+   the deadline read from the clock, repeated until it has passed, so
+   they hold for any clock.
+
+   Also builds on POSIX systems, over the native functions.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <ratio>
+
+#ifdef _WIN32
+#include <pthread_time.h>
+#endif
+
+namespace mingw_compat {
+
+namespace detail {
+
+constexpr timespec to_timespec(std::chrono::nanoseconds d) noexcept
+{
+    auto s = std::chrono::duration_cast<std::chrono::seconds>(d);
+    timespec ts{};
+    ts.tv_sec = static_cast<std::time_t>(s.count());
+    ts.tv_nsec = static_cast<long>((d - s).count());
+    return ts;
+}
+
+constexpr std::chrono::nanoseconds from_timespec(const timespec &ts) noexcept
+{
+    return std::chrono::seconds(ts.tv_sec)
+        + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+} // namespace detail
+
+struct hr_steady_clock {
+    using rep = long long;
+    using period = std::nano;
+    using duration = std::chrono::duration<rep, period>;
+    using time_point = std::chrono::time_point<hr_steady_clock>;
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return time_point(detail::from_timespec(ts));
+    }
+};
+
+struct hr_system_clock {
+    using rep = long long;
+    using period = std::nano;
+    using duration = std::chrono::duration<rep, period>;
+    using time_point = std::chrono::time_point<hr_system_clock>;
+    static constexpr bool is_steady = false;
+
+    // both clocks count from the Unix epoch
+    static time_point now() noexcept
+    {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return time_point(detail::from_timespec(ts));
+    }
+
+    static constexpr std::time_t to_time_t(const time_point &t) noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            t.time_since_epoch()).count();
+    }
+
+    static constexpr time_point from_time_t(std::time_t t) noexcept
+    {
+        return time_point(std::chrono::seconds(t));
+    }
+
+    static constexpr std::chrono::system_clock::time_point
+    to_sys(const time_point &t) noexcept
+    {
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                t.time_since_epoch()));
+    }
+
+    static constexpr time_point
+    from_sys(const std::chrono::system_clock::time_point &t) noexcept
+    {
+        return time_point(std::chrono::duration_cast<duration>(
+            t.time_since_epoch()));
+    }
+};
+
+/* Sleeps for at least 'd'. */
+template <class Rep, class Period>
+void sleep_for(const std::chrono::duration<Rep, Period> &d)
+{
+    if (d <= d.zero()) return;
+
+    // round up: sleeping short is wrong, sleeping a little long isn't
+    auto ns = std::chrono::ceil<std::chrono::nanoseconds>(d);
+    timespec req = detail::to_timespec(ns), rem;
+
+    for (;;) {
+        int s = clock_nanosleep(CLOCK_MONOTONIC, 0, &req, &rem);
+        // POSIX returns the error; the Windows version returns -1
+        if (s == -1) s = errno;
+        if (s != EINTR) return;
+        req = rem;
+    }
+}
+
+/* Sleeps until Clock::now() reaches 't'. */
+template <class Clock, class Duration>
+void sleep_until(const std::chrono::time_point<Clock, Duration> &t)
+{
+    for (auto now = Clock::now(); now < t; now = Clock::now())
+        sleep_for(t - now);
+}
+
+} // namespace mingw_compat
+
+#ifdef UNIT_TEST
+// g++ -std=c++17 -DUNIT_TEST -g -Wall -x c++ hr_clock.hpp -o hr_clock
+//
+// Builds on Linux too.  Checks that hr_steady_clock never goes back and
+// ticks finer than a millisecond, that hr_system_clock agrees with
+// std::chrono::system_clock, and that the sleeps don't return early.
+
+#include <cstdio>
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::printf("FAILED line %d: %s\n", __LINE__, \
+                                    #cond); failures++; } } while (0)
+
+int main()
+{
+    using namespace mingw_compat;
+    using namespace std::chrono;
+
+    // monotonic, and the smallest step seen is the effective resolution
+    auto prev = hr_steady_clock::now();
+    auto tick = hr_steady_clock::duration::max();
+    long backwards = 0;
+    for (int i=0; i < 1000000; i++) {
+        auto t = hr_steady_clock::now();
+        if (t < prev) backwards++;
+        else if (t > prev && t - prev < tick) tick = t - prev;
+        prev = t;
+    }
+    CHECK(backwards == 0);
+    CHECK(tick < milliseconds(1));
+    std::printf("hr_steady_clock: smallest step %lld ns\n",
+                (long long)tick.count());
+
+    // the same epoch and rate as system_clock
+    auto sys = system_clock::now();
+    auto hr = hr_system_clock::to_sys(hr_system_clock::now());
+    CHECK(hr - sys < milliseconds(50) && sys - hr < milliseconds(50));
+    auto back = hr_system_clock::to_sys(hr_system_clock::from_sys(sys));
+    CHECK(duration_cast<microseconds>(back - sys).count() == 0);
+    std::time_t tt = std::time(0);
+    CHECK(hr_system_clock::to_time_t(hr_system_clock::from_time_t(tt)) == tt);
+
+    // never short, for a sub-millisecond sleep and for a deadline
+    const microseconds sleeps[] = {
+        microseconds(50), microseconds(500), microseconds(2000)
+    };
+    for (auto d : sleeps) {
+        auto t0 = hr_steady_clock::now();
+        mingw_compat::sleep_for(d);
+        auto took = hr_steady_clock::now() - t0;
+        CHECK(took >= d);
+        std::printf("sleep_for(%lld us) took %lld us\n", (long long)d.count(),
+                    (long long)duration_cast<microseconds>(took).count());
+    }
+    auto deadline = hr_steady_clock::now() + microseconds(300);
+    mingw_compat::sleep_until(deadline);
+    CHECK(hr_steady_clock::now() >= deadline);
+    mingw_compat::sleep_for(-milliseconds(1));    // returns at once
+
+    std::printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures != 0;
+}
+#endif
+
+#endif
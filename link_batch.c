@@ -0,0 +1,529 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Bulk creation of symbolic and hard links.
+
+   Entries are sorted by parent directory, and each worker thread takes a
+   whole directory at a time, so threads don't contend for the same
+   directory.  Missing parent directories are created up front, in a
+   single thread.
+ */
+#define _WIN32_WINNT 0x0600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <windows.h>
+#include "symlink.h"
+#include "winerrno.h"
+#include "diag.h"
+
+struct batchItem {
+    const char *linkpath;
+    size_t dirLen;          // length of the parent directory part
+    size_t idx;             // index into the caller's entries
+};
+
+struct batch {
+    struct link_entry *entries;
+    struct batchItem *items;
+    size_t *groups;         // start of each directory group in 'items'
+    size_t nGroups;
+    bool *created;
+    unsigned flags;
+    volatile LONG nextGroup;
+    volatile LONG failed;
+};
+
+static int compareItems(const void *a, const void *b)
+{
+    const struct batchItem *x = a, *y = b;
+    size_t n = min(x->dirLen, y->dirLen);
+
+    int c = _strnicmp(x->linkpath, y->linkpath, n);
+    if (c) return c;
+    if (x->dirLen != y->dirLen) return x->dirLen < y->dirLen ? -1 : 1;
+    return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+static size_t parentLength(const char *path)
+{
+    const char *fs = strrchr(path, '/');
+    const char *bs = strrchr(path, '\\');
+    const char *sep = fs > bs ? fs : bs;
+
+    return sep ? sep - path : 0;
+}
+
+// Create 'dir' and any missing parents, appending the ones created to
+// 'made' (in creation order) so they can be rolled back.
+static int makeParents(char *dir, char ***made, size_t *nMade, size_t *cap)
+{
+    if (!dir[0] || GetFileAttributesA(dir) != INVALID_FILE_ATTRIBUTES)
+        return 0;
+
+    size_t len = parentLength(dir);
+    if (len && dir[len-1] != ':') {
+        char c = dir[len];
+        dir[len] = 0;
+        int s = makeParents(dir, made, nMade, cap);
+        dir[len] = c;
+        if (s) return s;
+    }
+
+    // room to remember it first, so a directory is never made untracked
+    if (*nMade == *cap) {
+        size_t n = *cap ? *cap*2 : 16;
+        char **p = realloc(*made, n*sizeof(char*));
+        if (!p) { errno = ENOMEM; return -1; }
+        *made = p;
+        *cap = n;
+    }
+    char *copy = strdup(dir);
+    if (!copy) { errno = ENOMEM; return -1; }
+
+    if (!CreateDirectoryA(dir, 0)) {
+        DWORD err = GetLastError();
+        free(copy);
+        if (err == ERROR_ALREADY_EXISTS) return 0;
+        SetLastError(err);
+        win32_set_errno();
+        return -1;
+    }
+    (*made)[(*nMade)++] = copy;
+
+    return 0;
+}
+
+static DWORD WINAPI batchWorker(LPVOID arg)
+{
+    struct batch *b = arg;
+
+    for (;;) {
+        LONG g = InterlockedIncrement(&b->nextGroup) - 1;
+        if (g >= (LONG)b->nGroups) break;
+
+        for (size_t i = b->groups[g]; i < b->groups[g+1]; i++) {
+            struct link_entry *e = &b->entries[b->items[i].idx];
+
+            if ((b->flags & LINK_BATCH_ROLLBACK) && b->failed) {
+                e->error = ECANCELED;
+                continue;
+            }
+
+            int s = (e->type == LINK_TYPE_HARDLINK)
+                ? link(e->target, e->linkpath)
+                : symlink(e->target, e->linkpath);
+
+            if (s) {
+                e->error = errno;
+                DIAG(DIAG_ERROR, DIAG_LINKBATCH, "%s: errno %d",
+                     e->linkpath, e->error);
+                InterlockedExchange(&b->failed, 1);
+            } else {
+                e->error = 0;
+                b->created[b->items[i].idx] = true;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static bool sameDir(const struct batchItem *a, const struct batchItem *b)
+{
+    return a->dirLen == b->dirLen
+        && !_strnicmp(a->linkpath, b->linkpath, a->dirLen);
+}
+
+// The parents of b->items[first]'s group couldn't be made: none of the
+// links were attempted, and that group's failed with 'err'.
+static void failGroup(struct batch *b, size_t n, size_t first, int err)
+{
+    for (size_t i=0; i < n; i++)
+        b->entries[i].error = ECANCELED;
+    for (size_t i=first;
+         i < n && sameDir(&b->items[i], &b->items[first]); i++)
+        b->entries[b->items[i].idx].error = err;
+    errno = err;
+}
+
+int link_batch(struct link_entry *entries, size_t n, int nthreads,
+               unsigned flags)
+{
+    if (!n) return 0;
+
+    struct batch b = { .entries = entries, .flags = flags };
+    char **made = 0;
+    size_t nMade = 0, madeCap = 0;
+    int retval = -1;
+
+    b.items = malloc(n*sizeof(*b.items));
+    b.groups = malloc((n+1)*sizeof(*b.groups));
+    b.created = calloc(n, sizeof(*b.created));
+    if (!b.items || !b.groups || !b.created) {
+        errno = ENOMEM;
+        goto done;
+    }
+
+    for (size_t i=0; i < n; i++) {
+        b.items[i].linkpath = entries[i].linkpath;
+        b.items[i].dirLen = parentLength(entries[i].linkpath);
+        b.items[i].idx = i;
+        entries[i].error = 0;
+    }
+    qsort(b.items, n, sizeof(*b.items), compareItems);
+
+    for (size_t i=0; i < n; i++) {
+        if (i && sameDir(&b.items[i], &b.items[i-1]))
+            continue;
+
+        b.groups[b.nGroups++] = i;
+
+        if ((flags & LINK_BATCH_MKDIRS) && b.items[i].dirLen) {
+            char dir[MAX_PATH];
+            if (b.items[i].dirLen >= sizeof(dir)) {
+                failGroup(&b, n, i, ENAMETOOLONG);
+                goto rollback;
+            }
+            memcpy(dir, b.items[i].linkpath, b.items[i].dirLen);
+            dir[b.items[i].dirLen] = 0;
+            if (makeParents(dir, &made, &nMade, &madeCap)) {
+                failGroup(&b, n, i, errno);
+                goto rollback;
+            }
+        }
+    }
+    b.groups[b.nGroups] = n;
+
+    if (nthreads <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        nthreads = si.dwNumberOfProcessors;
+    }
+    if ((size_t)nthreads > b.nGroups) nthreads = b.nGroups;
+
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+    int started = 0;
+    if (nthreads > MAXIMUM_WAIT_OBJECTS) nthreads = MAXIMUM_WAIT_OBJECTS;
+
+    for (int i=1; i < nthreads; i++) {
+        threads[started] = CreateThread(0, 0, batchWorker, &b, 0, 0);
+        if (threads[started]) started++;
+    }
+    batchWorker(&b);        // the calling thread works too
+
+    if (started) {
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+        for (int i=0; i < started; i++) CloseHandle(threads[i]);
+    }
+
+    if (!b.failed) {
+        retval = 0;
+        goto done;
+    }
+
+    // report the first failure, in caller's order
+    for (size_t i=0; i < n; i++) {
+        if (entries[i].error && entries[i].error != ECANCELED) {
+            errno = entries[i].error;
+            break;
+        }
+    }
+
+ rollback:
+    if (flags & LINK_BATCH_ROLLBACK) {
+        int err = errno;
+        DIAG(DIAG_INFO, DIAG_LINKBATCH,
+             "rolling back the links made and %zu directories", nMade);
+        for (size_t i=0; i < n; i++)
+            if (b.created[i]) link_remove(entries[i].linkpath);
+        for (size_t i=nMade; i-- > 0; )
+            RemoveDirectoryA(made[i]);
+        errno = err;
+    }
+
+ done:
+    for (size_t i=0; i < nMade; i++) free(made[i]);
+    free(made);
+    free(b.items);
+    free(b.groups);
+    free(b.created);
+    return retval;
+}
+
+#ifdef UNIT_TEST
+// gcc -DUNIT_TEST -O2 link_batch.c symlink.c reparse.c winerrno.c diag.c
+//     symstats.c fault.c metacache.c -o lb -Wall
+//
+// lb [dir]
+// Tests rollback, ECANCELED, per-entry errors and failing to make parent
+// directories, with hard links, in 'dir' (default: the temp directory).
+//
+// lb -b dir [links] [threads] [h|s]
+// Creates 'links' hard (h) or symbolic (s) links to one file, spread over
+// directories of 1000 links each, and reports links/sec, followed by the
+// file system calls and latencies of each function used.
+#include "symstats.h"
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("FAILED line %d: %s\n", __LINE__, #cond); \
+                        failures++; } } while (0)
+
+static bool exists(const char *path)
+{
+    return GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES;
+}
+
+static void setEntry(struct link_entry *e, const char *target, char *path,
+                     const char *root, const char *name)
+{
+    snprintf(path, MAX_PATH, "%s\\%s", root, name);
+    e->type = LINK_TYPE_HARDLINK;
+    e->target = target;
+    e->linkpath = path;
+}
+
+// A failure removes the links made and the directories made for them;
+// with one thread, entries after it are skipped with ECANCELED.
+static void testRollback(const char *root, const char *target,
+                         const char *missing)
+{
+    struct link_entry e[3];
+    char p[3][MAX_PATH], rb[MAX_PATH];
+
+    setEntry(&e[0], target, p[0], root, "rb\\a\\l0");
+    setEntry(&e[1], missing, p[1], root, "rb\\b\\l1");
+    setEntry(&e[2], target, p[2], root, "rb\\c\\l2");
+    snprintf(rb, sizeof(rb), "%s\\rb", root);
+
+    CHECK(link_batch(e, 3, 1, LINK_BATCH_MKDIRS | LINK_BATCH_ROLLBACK) == -1
+          && errno == ENOENT);
+    CHECK(e[0].error == 0);
+    CHECK(e[1].error == ENOENT);
+    CHECK(e[2].error == ECANCELED);
+    CHECK(!exists(p[0]) && !exists(p[2]));
+    CHECK(!exists(rb));
+
+    // the same on several threads, with more directories than threads
+    enum { DIRS = 8, PER = 10, N = DIRS*PER };
+    struct link_entry m[N];
+    static char mp[N][MAX_PATH];
+    char name[32];
+    for (int i=0; i < N; i++) {
+        snprintf(name, sizeof(name), "rb\\d%d\\l%d", i % DIRS, i);
+        setEntry(&m[i], i == N/2 ? missing : target, mp[i], root, name);
+    }
+
+    CHECK(link_batch(m, N, 4, LINK_BATCH_MKDIRS | LINK_BATCH_ROLLBACK) == -1
+          && errno == ENOENT);
+    int failed = 0;
+    for (int i=0; i < N; i++) {
+        CHECK(!exists(mp[i]));
+        CHECK(!m[i].error || m[i].error == ECANCELED
+              || (i == N/2 && m[i].error == ENOENT));
+        failed += m[i].error == ENOENT;
+    }
+    CHECK(failed == 1);
+    CHECK(!exists(rb));
+}
+
+// Without LINK_BATCH_ROLLBACK every entry is tried and keeps its own
+// error, and the one returned is the first in the caller's order, not
+// the first made: "nr\a" sorts, and so is made, before "nr\b".
+static void testErrors(const char *root, const char *target,
+                       const char *missing)
+{
+    struct link_entry e[3];
+    char p[3][MAX_PATH], nr[MAX_PATH], a[MAX_PATH], b[MAX_PATH];
+
+    setEntry(&e[0], missing, p[0], root, "nr\\b\\l0");
+    setEntry(&e[1], target, p[1], root, "nr\\a\\l1");
+    setEntry(&e[2], target, p[2], root, "nr\\c\\l2");
+    snprintf(nr, sizeof(nr), "%s\\nr", root);
+    snprintf(a, sizeof(a), "%s\\a", nr);
+    snprintf(b, sizeof(b), "%s\\b", nr);
+
+    // l1 is there already
+    CHECK(CreateDirectoryA(nr, 0));
+    CHECK(CreateDirectoryA(a, 0));
+    FILE *fp = fopen(p[1], "w");
+    if (fp) fclose(fp);
+
+    CHECK(link_batch(e, 3, 1, LINK_BATCH_MKDIRS) == -1 && errno == ENOENT);
+    CHECK(e[0].error == ENOENT);
+    CHECK(e[1].error == EEXIST);
+    CHECK(e[2].error == 0 && exists(p[2]));
+    CHECK(exists(b));               // made, and not rolled back
+
+    for (int i=0; i < 3; i++) {
+        DeleteFileA(p[i]);
+        char d[MAX_PATH];
+        snprintf(d, sizeof(d), "%.*s", (int)parentLength(p[i]), p[i]);
+        RemoveDirectoryA(d);
+    }
+    RemoveDirectoryA(nr);
+}
+
+// A parent that can't be made, below a regular file, fails its own
+// entries with that error and cancels the rest before any link is made.
+static void testParents(const char *root, const char *target)
+{
+    struct link_entry e[3];
+    char p[3][MAX_PATH], mk[MAX_PATH], f[MAX_PATH], a[MAX_PATH];
+
+    setEntry(&e[0], target, p[0], root, "mk\\a\\l0");
+    setEntry(&e[1], target, p[1], root, "mk\\f\\sub\\l1");
+    setEntry(&e[2], target, p[2], root, "mk\\z\\l2");
+    snprintf(mk, sizeof(mk), "%s\\mk", root);
+    snprintf(f, sizeof(f), "%s\\f", mk);
+    snprintf(a, sizeof(a), "%s\\a", mk);
+
+    CHECK(CreateDirectoryA(mk, 0));
+    FILE *fp = fopen(f, "w");
+    if (fp) fclose(fp);
+
+    int s = link_batch(e, 3, 1, LINK_BATCH_MKDIRS | LINK_BATCH_ROLLBACK);
+    int err = errno;
+    CHECK(s == -1);
+    CHECK(e[1].error && e[1].error != ECANCELED && e[1].error == err);
+    CHECK(e[0].error == ECANCELED && e[2].error == ECANCELED);
+    CHECK(!exists(p[0]) && !exists(p[2]));
+    CHECK(!exists(a));              // made for e[0], then removed
+
+    DeleteFileA(f);
+    RemoveDirectoryA(mk);
+}
+
+static int bench(int ac, char **av)
+{
+    const char *dir = av[1];
+    size_t count = ac > 2 ? atoi(av[2]) : 10000;
+    int nthreads = ac > 3 ? atoi(av[3]) : 0;
+    int type = (ac > 4 && av[4][0] == 's') ? LINK_TYPE_SYMLINK
+                                           : LINK_TYPE_HARDLINK;
+
+    char target[MAX_PATH];
+    snprintf(target, sizeof(target), "%s\\target", dir);
+    CreateDirectoryA(dir, 0);
+    FILE *fp = fopen(target, "w");
+    if (!fp) { perror(target); return 1; }
+    fputs("link_batch target\n", fp);
+    fclose(fp);
+
+    struct link_entry *e = calloc(count, sizeof(*e));
+    for (size_t i=0; i < count; i++) {
+        char *p = malloc(MAX_PATH);
+        snprintf(p, MAX_PATH, "%s\\d%zu\\l%zu", dir, i/1000, i);
+        e[i].type = type;
+        e[i].target = target;
+        e[i].linkpath = p;
+    }
+
+    LARGE_INTEGER freq, then, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&then);
+
+    int s = link_batch(e, count, nthreads, LINK_BATCH_MKDIRS);
+
+    QueryPerformanceCounter(&now);
+    double dt = (now.QuadPart - then.QuadPart)/(double)freq.QuadPart;
+
+    if (s) perror("link_batch");
+
+    size_t ok = 0;
+    for (size_t i=0; i < count; i++) if (!e[i].error) ok++;
+
+    printf("%zu of %zu links in %.3f sec: %.0f links/sec\n",
+           ok, count, dt, ok/dt);
+
+    struct symstats *st = malloc(sizeof(*st));
+    symstats_snapshot(st);
+    for (int i=0; i < SYMSTATS_NOPS; i++) {
+        struct symstats_op *o = &st->op[i];
+        if (!o->calls) continue;
+        printf("%-20s %8llu calls %6llu errors %5.1f fs calls/call "
+               "mean %6.1f us p50 %6.1f us p99 %6.1f us\n",
+               symstats_name(i), o->calls, o->errors,
+               (double)o->fs_calls/o->calls, o->total_ns/1e3/o->calls,
+               symstats_percentile(o, 50)/1e3,
+               symstats_percentile(o, 99)/1e3);
+    }
+    free(st);
+
+    // clean up
+    for (size_t i=0; i < count; i++) {
+        DeleteFileA(e[i].linkpath);
+        free((char*)e[i].linkpath);
+    }
+    for (size_t i=0; i <= (count-1)/1000; i++) {
+        char d[MAX_PATH];
+        snprintf(d, sizeof(d), "%s\\d%zu", dir, i);
+        RemoveDirectoryA(d);
+    }
+    DeleteFileA(target);
+    free(e);
+
+    return s ? 1 : 0;
+}
+
+int main(int ac, char **av)
+{
+    if (ac > 2 && !strcmp(av[1], "-b"))
+        return bench(ac - 1, av + 1);
+
+    char base[MAX_PATH], root[MAX_PATH], target[MAX_PATH], missing[MAX_PATH];
+    if (ac > 1)
+        snprintf(base, sizeof(base), "%s", av[1]);
+    else if (!GetTempPathA(sizeof(base), base))
+        return 1;
+
+    size_t n = strlen(base);
+    const char *sep = n && (base[n-1] == '\\' || base[n-1] == '/') ? "" : "\\";
+    snprintf(root, sizeof(root), "%s%slink_batch-test-%lu", base, sep,
+             GetCurrentProcessId());
+    if (!CreateDirectoryA(root, 0)) {
+        printf("can't create %s\n", root);
+        return 1;
+    }
+    snprintf(target, sizeof(target), "%s\\target", root);
+    snprintf(missing, sizeof(missing), "%s\\missing", root);
+    FILE *fp = fopen(target, "w");
+    if (fp) fclose(fp);
+
+    CHECK(!link_batch(0, 0, 0, LINK_BATCH_ROLLBACK));
+    testRollback(root, target, missing);
+    testErrors(root, target, missing);
+    testParents(root, target);
+
+    DeleteFileA(target);
+    CHECK(RemoveDirectoryA(root));      // nothing left behind
+
+    printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures != 0;
+}
+#endif
@@ -0,0 +1,582 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* The cache file: a 64-byte header, then 'slots' slots of 1 KiB, each
+   holding one key (kind and path) and its value.  A key hashes to a pair
+   of slots; a new entry takes the slot holding the same key, else an
+   empty one, else the one the hash picks.
+
+   Slots are seqlocked: a writer claims a slot by moving its count from
+   even to odd with a compare-and-swap, writes, and makes it even again;
+   a reader copies what it wants and takes a miss if the count was odd
+   or has changed.  A writer that finds the slot claimed doesn't wait.
+   A process that dies mid-write leaves the slot claimed, and so unused,
+   until the file is removed.
+
+   Only the primitives below differ between Windows and Linux, so it can
+   be tested on Linux.
+ */
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0600
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include "winerrno.h"
+#include "diag.h"
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DIAG(...)   ((void)0)
+#endif
+
+#include "metacache.h"
+
+#define MAGIC           "MCACHE01"
+#define HEADER_SIZE     64
+#define SLOT_SIZE       1024
+#define DEFAULT_SLOTS   16384
+
+struct header {
+    char magic[8];
+    uint32_t slots;
+    uint32_t slotSize;
+};
+
+struct slot {
+    uint32_t seq;           // odd while being written
+    uint32_t kind;          // 0 if empty
+    uint64_t hash;
+    uint64_t attrs, size, ctime, mtime;
+    uint16_t keyLen, valLen;
+    char data[SLOT_SIZE - 52];  // key, then value
+};
+
+_Static_assert(sizeof(struct slot) == SLOT_SIZE, "slot size");
+
+volatile int metacache_active;
+
+static unsigned char *base;
+static size_t mapSize;
+static struct slot *table;
+static uint32_t nslots;
+static struct metacache_stats counts;
+
+/* Platform primitives */
+
+#ifdef _WIN32
+
+static HANDLE mapping;
+
+// Maps the first 'size' bytes of 'path' read-write, shared, growing it
+// to that size if it's shorter.
+static unsigned char *mapShared(const char *path, size_t size)
+{
+    HANDLE h = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE
+                           | FILE_SHARE_DELETE, 0, OPEN_ALWAYS, 0, 0);
+    if (h == INVALID_HANDLE_VALUE) {
+        win32_set_errno();
+        return 0;
+    }
+
+    void *p = 0;
+    mapping = CreateFileMappingA(h, 0, PAGE_READWRITE,
+                                 (unsigned long long)size >> 32,
+                                 size & 0xffffffff, 0);
+    if (!mapping) {
+        win32_set_errno();
+    } else if (!(p = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size))) {
+        win32_set_errno();
+        CloseHandle(mapping);
+    }
+    CloseHandle(h);
+    return p;
+}
+
+static int fileLength(const char *path, unsigned long long *len)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fa)) {
+        win32_set_errno();
+        return -1;
+    }
+    *len = (unsigned long long)fa.nFileSizeHigh << 32 | fa.nFileSizeLow;
+    return 0;
+}
+
+static void unmapShared(unsigned char *p, size_t size)
+{
+    (void)size;
+    UnmapViewOfFile(p);
+    CloseHandle(mapping);
+}
+
+#else   // Linux
+
+static unsigned char *mapShared(const char *path, size_t size)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    void *p = 0;
+    if (!fstat(fd, &st)) {
+        if ((unsigned long long)st.st_size >= size || !ftruncate(fd, size)) {
+            p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) p = 0;
+        }
+    }
+    int err = errno;
+    close(fd);
+    errno = err;
+    return p;
+}
+
+static void unmapShared(unsigned char *p, size_t size)
+{
+    munmap(p, size);
+}
+
+static int fileLength(const char *path, unsigned long long *len)
+{
+    struct stat st;
+    if (stat(path, &st)) return -1;
+    *len = st.st_size;
+    return 0;
+}
+
+#endif
+
+/* The cache */
+
+static uint64_t hashKey(int kind, const char *path, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL ^ kind;
+    for (size_t i=0; i < len; i++)
+        h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+    return h;
+}
+
+static struct slot *slotPair(uint64_t h)
+{
+    return &table[(h % nslots) & ~1u];
+}
+
+// the size of the cache 'h' describes, or 0 if it isn't one
+static unsigned long long cacheSize(const struct header *h)
+{
+    if (memcmp(h->magic, MAGIC, 8) || h->slotSize != SLOT_SIZE
+        || h->slots < 2 || h->slots & 1)
+        return 0;
+    return HEADER_SIZE + (unsigned long long)h->slots * SLOT_SIZE;
+}
+
+// whether a file of 'len' bytes could be a cache of an even slot count
+static bool isCacheLength(unsigned long long len)
+{
+    return len >= HEADER_SIZE + 2*SLOT_SIZE
+        && !((len - HEADER_SIZE) % (2*SLOT_SIZE));
+}
+
+static void count(unsigned long long *c)
+{
+    __atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+}
+
+int metacache_open(const char *file, unsigned slots)
+{
+    if (metacache_active) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    slots = slots ? (slots + 1) & ~1u : DEFAULT_SLOTS;
+    unsigned long long size = HEADER_SIZE + (unsigned long long)slots
+        * SLOT_SIZE;
+
+    // An existing cache is mapped at the size its header gives, and never
+    // grown.  Any other file is left alone, but for one another process
+    // is creating: empty, or of a cache's length with a zero header.
+    FILE *fp = fopen(file, "rb");
+    if (fp) {
+        struct header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        size_t n = fread(&hdr, 1, sizeof(hdr), fp);
+        fclose(fp);
+
+        unsigned long long len, want = cacheSize(&hdr);
+        if (fileLength(file, &len)) return -1;
+        if (want && len >= want) {
+            size = want;
+        } else if (len && n == sizeof(hdr) && isCacheLength(len)
+                   && !memcmp(hdr.magic, "\0\0\0\0\0\0\0\0", 8)) {
+            size = len;
+        } else if (len) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (size > SIZE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned char *p = mapShared(file, size);
+    if (!p) return -1;
+
+    // a new file is all zeros; racing creators write the same header
+    struct header *h = (struct header*)p;
+    if (!memcmp(h->magic, "\0\0\0\0\0\0\0\0", 8)) {
+        h->slots = (size - HEADER_SIZE) / SLOT_SIZE;
+        h->slotSize = SLOT_SIZE;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(h->magic, MAGIC, 8);
+    }
+
+    if (cacheSize(h) != size) {
+        unmapShared(p, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    base = p;
+    mapSize = size;
+    table = (struct slot*)(p + HEADER_SIZE);
+    nslots = h->slots;
+    metacache_active = 1;
+    return 0;
+}
+
+void metacache_close(void)
+{
+    if (!metacache_active) return;
+    metacache_active = 0;
+    unmapShared(base, mapSize);
+    base = 0;
+    table = 0;
+}
+
+void metacache_stats(struct metacache_stats *s)
+{
+    s->hits = __atomic_load_n(&counts.hits, __ATOMIC_RELAXED);
+    s->misses = __atomic_load_n(&counts.misses, __ATOMIC_RELAXED);
+    s->stale = __atomic_load_n(&counts.stale, __ATOMIC_RELAXED);
+    s->stores = __atomic_load_n(&counts.stores, __ATOMIC_RELAXED);
+    s->busy = __atomic_load_n(&counts.busy, __ATOMIC_RELAXED);
+}
+
+int metacache_get(int kind, const char *path,
+                  const struct metacache_stamp *stamp, void *val, size_t len)
+{
+    size_t keyLen = strlen(path);
+    uint64_t h = hashKey(kind, path, keyLen);
+    struct slot *s = slotPair(h);
+
+    for (int way=0; way < 2; way++, s++) {
+        uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1 || s->hash != h || s->kind != (uint32_t)kind
+            || s->keyLen != keyLen)
+            continue;
+
+        size_t n = s->valLen;
+        if (n > len || keyLen + n > sizeof(s->data)
+            || memcmp(s->data, path, keyLen))
+            continue;
+        bool fresh = s->attrs == stamp->attrs && s->size == stamp->size
+            && s->ctime == stamp->ctime && s->mtime == stamp->mtime;
+        memcpy(val, s->data + keyLen, n);
+
+        // what was read is good only if no writer came by meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) continue;
+
+        if (!fresh) {
+            count(&counts.stale);
+            return -1;
+        }
+        count(&counts.hits);
+        return n;
+    }
+
+    count(&counts.misses);
+    return -1;
+}
+
+void metacache_put(int kind, const char *path,
+                   const struct metacache_stamp *stamp, const void *val,
+                   size_t len)
+{
+    size_t keyLen = strlen(path);
+    if (keyLen + len > sizeof(table->data)) return;
+
+    uint64_t h = hashKey(kind, path, keyLen);
+    struct slot *pair = slotPair(h), *s = 0;
+
+    // the slot with this key, else an empty one, else the hash's pick
+    for (int way=0; !s && way < 2; way++)
+        if (pair[way].hash == h && pair[way].kind == (uint32_t)kind)
+            s = &pair[way];
+    for (int way=0; !s && way < 2; way++)
+        if (!pair[way].kind) s = &pair[way];
+    if (!s) s = &pair[h >> 63];
+
+    uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    if (seq & 1 || !__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, false,
+                                                __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED)) {
+        count(&counts.busy);
+        return;
+    }
+
+    s->kind = kind;
+    s->hash = h;
+    s->attrs = stamp->attrs;
+    s->size = stamp->size;
+    s->ctime = stamp->ctime;
+    s->mtime = stamp->mtime;
+    s->keyLen = keyLen;
+    s->valLen = len;
+    memcpy(s->data, path, keyLen);
+    memcpy(s->data + keyLen, val, len);
+
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+    count(&counts.stores);
+}
+
+// MINGW_COMPAT_CACHE="file[,slots]"
+__attribute__((constructor))
+static void metacacheInit(void)
+{
+    const char *env = getenv("MINGW_COMPAT_CACHE");
+    if (!env || !*env) return;
+
+    char file[1024], *end;
+    unsigned slots = 0;
+    const char *comma = strrchr(env, ',');
+    if (comma) {
+        // a comma in the file name isn't followed by a count
+        slots = strtoul(comma + 1, &end, 10);
+        if (*end || end == comma + 1) {
+            comma = 0;
+            slots = 0;
+        }
+    }
+    size_t n = comma ? (size_t)(comma - env) : strlen(env);
+    if (n >= sizeof(file)) return;
+    memcpy(file, env, n);
+    file[n] = 0;
+
+    if (metacache_open(file, slots))
+        DIAG(DIAG_ERROR, DIAG_METACACHE, "MINGW_COMPAT_CACHE: %s: %s", file,
+             strerror(errno));
+}
+
+#ifdef UNIT_TEST
+// Linux:   gcc -DUNIT_TEST -g -Wall metacache.c -o metacache -lpthread
+// Windows: gcc -DUNIT_TEST -g -Wall metacache.c winerrno.c diag.c -o metacache
+//
+// metacache [dir]        runs the tests with a cache file in 'dir'
+//                        (default: the current one)
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+#define THREAD_RESULT   DWORD WINAPI
+#else
+#include <pthread.h>
+typedef pthread_t thread_t;
+#define THREAD_RESULT   void *
+#endif
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("FAILED line %d: %s\n", __LINE__, #cond); \
+                        failures++; } } while (0)
+
+#define NTHREADS    4
+#define NKEYS       200     // more than the slots, to force evictions
+#define ROUNDS      100000
+
+static volatile int torn;
+
+// each key's value is its number, repeated, and its stamp is the number
+static void keyOf(int k, char *path, size_t n)
+{
+    snprintf(path, n, "C:\\src\\include\\dir%d\\header%d.h", k % 7, k);
+}
+
+static long fileLengthOf(const char *file)
+{
+    FILE *fp = fopen(file, "rb");
+    if (!fp) return -1;
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    fclose(fp);
+    return n;
+}
+
+static THREAD_RESULT hammer(void *arg)
+{
+    unsigned rng = (unsigned)(uintptr_t)arg * 2654435761u + 1;
+    char path[128];
+    int val[32], got[32];
+
+    for (int r=0; r < ROUNDS; r++) {
+        rng = rng * 1103515245 + 12345;
+        int k = rng >> 8 & 0xffff;
+        k %= NKEYS;
+        keyOf(k, path, sizeof(path));
+        struct metacache_stamp st = { .attrs = k, .size = k, .mtime = k };
+        for (int i=0; i < 32; i++) val[i] = k;
+
+        int n = (k % 32 + 1) * sizeof(int);
+        int s = metacache_get(METACACHE_LSTAT, path, &st, got, sizeof(got));
+        if (s >= 0) {
+            if (s != n) torn = 1;
+            for (int i=0; i < s/(int)sizeof(int); i++)
+                if (got[i] != k) torn = 1;
+        } else {
+            metacache_put(METACACHE_LSTAT, path, &st, val, n);
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char**av)
+{
+    const char *dir = ac > 1 ? av[1] : ".";
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/metacache_test", dir);
+    remove(file);
+
+    CHECK(!metacache_open(file, 64));
+    CHECK(metacache_open(file, 64) == -1 && errno == EBUSY);
+
+    struct metacache_stamp st = { 0x20, 1234, 5, 6 }, st2 = st;
+    char buf[512];
+    const char *path = "C:\\src\\main.c";
+
+    CHECK(metacache_get(METACACHE_REALPATH, path, &st, buf, sizeof(buf))
+          == -1);
+    metacache_put(METACACHE_REALPATH, path, &st, "C:\\src\\main.c", 14);
+    CHECK(metacache_get(METACACHE_REALPATH, path, &st, buf, sizeof(buf))
+          == 14 && !strcmp(buf, "C:\\src\\main.c"));
+
+    // the kinds are separate, a changed file is stale, a short buffer
+    // misses, and a key and value that don't fit aren't stored
+    CHECK(metacache_get(METACACHE_LSTAT, path, &st, buf, sizeof(buf)) == -1);
+    st2.mtime++;
+    CHECK(metacache_get(METACACHE_REALPATH, path, &st2, buf, sizeof(buf))
+          == -1);
+    CHECK(metacache_get(METACACHE_REALPATH, path, &st, buf, 4) == -1);
+    static char big[SLOT_SIZE];
+    memset(big, 'x', sizeof(big) - 1);
+    metacache_put(METACACHE_REALPATH, big, &st, "y", 2);
+    CHECK(metacache_get(METACACHE_REALPATH, big, &st, buf, sizeof(buf))
+          == -1);
+
+    struct metacache_stats c;
+    metacache_stats(&c);
+    CHECK(c.hits == 1 && c.stale == 1 && c.stores == 1);
+
+    // it persists
+    metacache_close();
+    CHECK(!metacache_open(file, 1000));     // keeps its 64 slots
+    CHECK(nslots == 64);
+    CHECK(fileLengthOf(file) == HEADER_SIZE + 64*SLOT_SIZE);
+    CHECK(metacache_get(METACACHE_REALPATH, path, &st, buf, sizeof(buf))
+          == 14 && !strcmp(buf, "C:\\src\\main.c"));
+
+    // readers never see a value torn by a writer
+    thread_t t[NTHREADS];
+    for (int i=0; i < NTHREADS; i++) {
+#ifdef _WIN32
+        t[i] = CreateThread(0, 0, hammer, (void*)(uintptr_t)i, 0, 0);
+#else
+        pthread_create(&t[i], 0, hammer, (void*)(uintptr_t)i);
+#endif
+    }
+    for (int i=0; i < NTHREADS; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(t[i], INFINITE);
+        CloseHandle(t[i]);
+#else
+        pthread_join(t[i], 0);
+#endif
+    }
+    CHECK(!torn);
+    metacache_stats(&c);
+    printf("%llu hits, %llu misses, %llu stale, %llu stores, %llu busy\n",
+           c.hits, c.misses, c.stale, c.stores, c.busy);
+    metacache_close();
+
+    // not a cache
+    const char *text = "not a cache file";
+    FILE *fp = fopen(file, "wb");
+    fputs(text, fp);
+    fclose(fp);
+    CHECK(metacache_open(file, 0) == -1 && errno == EINVAL);
+    CHECK(fileLengthOf(file) == (long)strlen(text));  // and it's left alone
+
+    // nor is a file that starts with zeros, unless it's a cache's length
+    static char zeros[HEADER_SIZE + 4*SLOT_SIZE];
+    fp = fopen(file, "wb");
+    fwrite(zeros, 1, 100, fp);
+    fclose(fp);
+    CHECK(metacache_open(file, 0) == -1 && errno == EINVAL);
+    CHECK(fileLengthOf(file) == 100);
+
+    fp = fopen(file, "wb");
+    fwrite(zeros, 1, sizeof(zeros), fp);
+    fclose(fp);
+    CHECK(!metacache_open(file, 0));        // one being created: 4 slots
+    CHECK(nslots == 4 && fileLengthOf(file) == (long)sizeof(zeros));
+    metacache_close();
+
+    // an existing cache made longer isn't mapped past its slots
+    fp = fopen(file, "ab");
+    fwrite(zeros, 1, SLOT_SIZE, fp);
+    fclose(fp);
+    CHECK(!metacache_open(file, 0));
+    CHECK(nslots == 4 && mapSize == sizeof(zeros));
+    metacache_close();
+    remove(file);
+
+    printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures != 0;
+}
+#endif
@@ -0,0 +1,121 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _METACACHE_H
+#define _METACACHE_H
+
+/* A persistent cache of realpath() and lstat() results, shared by the
+   processes that open the same cache file, so that short-lived tools (a
+   compiler run by a build system, say) start warm rather than repeating
+   the metadata calls of the run before.  Off by default.
+
+   It is turned on with metacache_open(), or with the environment
+   variable MINGW_COMPAT_CACHE="file[,slots]".  The file is a table of
+   fixed-size slots, memory mapped.  Readers take no lock: a writer makes
+   a slot's sequence count odd while it writes, and a reader that sees
+   the count change under it takes a miss.
+
+   An entry is used only if the file's attributes, size, creation and
+   last write times are what they were when it was stored.  For
+   realpath() checking that is one GetFileAttributesEx(), where a miss
+   makes four calls.  lstat() makes the check with a handle query, three
+   calls where a miss makes five or so, and takes the file ID, link
+   count and access time from that query rather than from the entry,
+   since a new hard link or a change of access time leaves the stamp as
+   it was.
+
+   realpath() results are only stored when they are the path itself, but
+   for case: a path that crossed a link could resolve elsewhere once the
+   link is repointed, with nothing in the file's stamp to show it.  What
+   the check still can't see is a directory above the file replaced by a
+   link, or renamed in case only, after the entry was stored.  Neither
+   realpath() nor lstat() of a path that is itself a link is cached.
+
+   Entries are keyed on the absolute path, made with GetFullPathName(),
+   so a relative path given in one current directory never finds the
+   entry for the same string given in another.  That is lexical, as
+   Win32's own handling of '..' is; a path too long for PATH_MAX once
+   made absolute bypasses the cache.
+ */
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+// kinds of entry
+#define METACACHE_REALPATH  1
+#define METACACHE_LSTAT     2
+
+// what an entry is checked against
+struct metacache_stamp {
+    unsigned long long attrs;
+    unsigned long long size;
+    unsigned long long ctime, mtime;    // FILETIME
+};
+
+// counts for this process
+struct metacache_stats {
+    unsigned long long hits;
+    unsigned long long misses;      // no entry
+    unsigned long long stale;       // an entry, but the file had changed
+    unsigned long long stores;
+    unsigned long long busy;        // not stored; another writer had the slot
+};
+
+/* Maps 'file', creating it with room for 'slots' entries (0 for the
+   default, 16384 of 1 KiB) if it doesn't exist or is empty; an existing
+   cache keeps its size, and is never grown.  Returns -1 with errno set on
+   failure: EINVAL if 'file' isn't a cache (one being created, all zeros
+   at a cache's length, is taken for one), EBUSY if a cache is already
+   open.
+*/
+int metacache_open(const char *file, unsigned slots);
+
+/* Unmaps the cache.  Only once other threads are done with the
+   library.
+*/
+void metacache_close(void);
+
+void metacache_stats(struct metacache_stats *s);
+
+/* For the library; 'path' is the key, and should be absolute (see
+   above).  metacache_get() copies the entry for 'path' into 'val' if
+   it's there, fits in 'len', and matches 'stamp'; it returns the entry's
+   length, or -1.  metacache_put() stores an entry, unless it's too long
+   or another writer has the slot.
+*/
+int metacache_get(int kind, const char *path,
+                  const struct metacache_stamp *stamp, void *val, size_t len);
+void metacache_put(int kind, const char *path,
+                   const struct metacache_stamp *stamp, const void *val,
+                   size_t len);
+
+extern volatile int metacache_active;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
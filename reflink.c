@@ -0,0 +1,458 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* reflink(): block cloning with a fallback to a sparse-aware copy.
+
+   The chunking and fallback logic is shared; only the few primitives
+   below differ between Windows and Linux, so it can be tested on Linux
+   against FICLONERANGE and copy_file_range.
+ */
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0600
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include "winerrno.h"
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#endif
+
+#include "reflink.h"
+
+// Largest clone request; Windows limits each one to under 4 GB.
+#define CLONE_CHUNK     (1LL << 30)
+#define COPY_BUFSIZE    (1 << 20)
+
+/* Length of the next clone request at 'off' in a file of 'size' bytes.
+   Requests are multiples of the cluster size 'align'.  The last one
+   ends at end of file, or with 'roundTail', at the next cluster boundary,
+   as Windows requires.
+*/
+static long long cloneChunk(long long off, long long size, long long align,
+                            bool roundTail)
+{
+    long long max = CLONE_CHUNK - CLONE_CHUNK % align;
+    long long len = size - off;
+
+    if (len > max) return max;
+    if (roundTail && len % align) len += align - len % align;
+    return len;
+}
+
+#ifdef _WIN32
+
+typedef HANDLE file_t;
+
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE 0x00098344
+#endif
+
+typedef struct {
+    HANDLE FileHandle;
+    LARGE_INTEGER SourceFileOffset;
+    LARGE_INTEGER TargetFileOffset;
+    LARGE_INTEGER ByteCount;
+} _DUPLICATE_EXTENTS_DATA;
+
+static int fail(void)
+{
+    win32_set_errno();
+    return -1;
+}
+
+static int openSrc(const char *path, file_t *f, long long *size,
+                   bool *sparse, long long *align)
+{
+    *f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                     0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (*f == INVALID_HANDLE_VALUE) return fail();
+
+    BY_HANDLE_FILE_INFORMATION fi;
+    if (!GetFileInformationByHandle(*f, &fi)) {
+        int s = fail();
+        CloseHandle(*f);
+        return s;
+    }
+    *size = (long long)fi.nFileSizeHigh << 32 | fi.nFileSizeLow;
+    *sparse = fi.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE;
+
+    // clone requests are in whole clusters
+    char root[MAX_PATH];
+    DWORD spc, bps, nfree, total;
+    *align = 4096;
+    if (GetVolumePathNameA(path, root, sizeof(root))
+        && GetDiskFreeSpaceA(root, &spc, &bps, &nfree, &total))
+        *align = (long long)spc * bps;
+
+    return 0;
+}
+
+static int createDst(const char *path, file_t *f, bool sparse)
+{
+    *f = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW,
+                     FILE_ATTRIBUTE_NORMAL, 0);
+    if (*f == INVALID_HANDLE_VALUE) return fail();
+
+    DWORD sz;
+    if (sparse)     // holes stay holes; cloning a sparse file requires it
+        DeviceIoControl(*f, FSCTL_SET_SPARSE, 0, 0, 0, 0, &sz, 0);
+
+    return 0;
+}
+
+static int setSize(file_t f, long long size)
+{
+    LARGE_INTEGER li;
+    li.QuadPart = size;
+    if (!SetFilePointerEx(f, li, 0, FILE_BEGIN) || !SetEndOfFile(f))
+        return fail();
+    return 0;
+}
+
+static int cloneRange(file_t src, file_t dst, long long off, long long len)
+{
+    _DUPLICATE_EXTENTS_DATA dd;
+    DWORD sz;
+
+    dd.FileHandle = src;
+    dd.SourceFileOffset.QuadPart = off;
+    dd.TargetFileOffset.QuadPart = off;
+    dd.ByteCount.QuadPart = len;
+
+    if (!DeviceIoControl(dst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dd,
+                         sizeof(dd), 0, 0, &sz, 0))
+        return fail();
+    return 0;
+}
+
+// Next allocated range at or after 'off'; returns 0 if there is none.
+static int dataRange(file_t src, long long off, long long size,
+                     long long *start, long long *end)
+{
+    FILE_ALLOCATED_RANGE_BUFFER in, out;
+    DWORD sz;
+
+    in.FileOffset.QuadPart = off;
+    in.Length.QuadPart = size - off;
+    if (!DeviceIoControl(src, FSCTL_QUERY_ALLOCATED_RANGES, &in, sizeof(in),
+                         &out, sizeof(out), &sz, 0)
+        && GetLastError() != ERROR_MORE_DATA)
+        return fail();
+
+    if (sz < sizeof(out)) return 0;
+
+    *start = out.FileOffset.QuadPart;
+    *end = min(*start + out.Length.QuadPart, size);
+    return 1;
+}
+
+static int copyRange(file_t src, file_t dst, long long off, long long len,
+                     char *buf)
+{
+    LARGE_INTEGER li;
+    li.QuadPart = off;
+    if (!SetFilePointerEx(src, li, 0, FILE_BEGIN)
+        || !SetFilePointerEx(dst, li, 0, FILE_BEGIN))
+        return fail();
+
+    while (len > 0) {
+        DWORD n = min(len, COPY_BUFSIZE), got, put;
+        if (!ReadFile(src, buf, n, &got, 0)) return fail();
+        if (!got) break;
+        if (!WriteFile(dst, buf, got, &put, 0)) return fail();
+        len -= got;
+    }
+    return 0;
+}
+
+static void closeFile(file_t f)
+{
+    CloseHandle(f);
+}
+
+static void removeFile(const char *path)
+{
+    DeleteFileA(path);
+}
+
+#define ROUND_TAIL true
+
+#else   // Linux
+
+typedef int file_t;
+
+static int openSrc(const char *path, file_t *f, long long *size,
+                   bool *sparse, long long *align)
+{
+    struct stat st;
+
+    *f = open(path, O_RDONLY);
+    if (*f < 0) return -1;
+    if (fstat(*f, &st)) {
+        close(*f);
+        return -1;
+    }
+    *size = st.st_size;
+    *sparse = (long long)st.st_blocks*512 < st.st_size;
+    *align = st.st_blksize;
+    return 0;
+}
+
+static int createDst(const char *path, file_t *f, bool sparse)
+{
+    (void)sparse;       // ftruncate() leaves holes anyway
+    *f = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+    return *f < 0 ? -1 : 0;
+}
+
+static int setSize(file_t f, long long size)
+{
+    return ftruncate(f, size);
+}
+
+static int cloneRange(file_t src, file_t dst, long long off, long long len)
+{
+    struct file_clone_range r = {
+        .src_fd = src, .src_offset = off, .src_length = len, .dest_offset = off
+    };
+    return ioctl(dst, FICLONERANGE, &r);
+}
+
+static int dataRange(file_t src, long long off, long long size,
+                     long long *start, long long *end)
+{
+    off_t s = lseek(src, off, SEEK_DATA);
+    if (s < 0) return errno == ENXIO ? 0 : -1;
+    if (s >= size) return 0;
+
+    off_t e = lseek(src, s, SEEK_HOLE);
+    if (e < 0) return -1;
+
+    *start = s;
+    *end = e < size ? e : size;
+    return 1;
+}
+
+static int copyRange(file_t src, file_t dst, long long off, long long len,
+                     char *buf)
+{
+    loff_t in = off, out = off;
+
+    while (len > 0) {
+        ssize_t n = copy_file_range(src, &in, dst, &out, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL)) {
+            n = pread(src, buf, len < COPY_BUFSIZE ? len : COPY_BUFSIZE, in);
+            if (n > 0 && pwrite(dst, buf, n, out) != n) return -1;
+            in += n;
+            out += n;
+        }
+        if (n < 0) return -1;
+        if (n == 0) break;
+        len -= n;
+    }
+    return 0;
+}
+
+static void closeFile(file_t f)
+{
+    close(f);
+}
+
+static void removeFile(const char *path)
+{
+    unlink(path);
+}
+
+#define ROUND_TAIL false
+
+#endif
+
+static bool cloneUnsupported(int err)
+{
+    // not this filesystem, or not the same volume; ENOTSUP and EOPNOTSUPP
+    // differ on MinGW, where ERROR_NOT_SUPPORTED maps to ENOTSUP
+    return err == ENOTSUP || err == EOPNOTSUPP || err == ENOTTY
+        || err == EXDEV || err == EINVAL || err == ENOSYS;
+}
+
+int reflink(const char *src, const char *dst, int *method)
+{
+    file_t in, out;
+    long long size, align;
+    bool sparse;
+
+    if (openSrc(src, &in, &size, &sparse, &align))
+        return -1;
+
+    if (createDst(dst, &out, sparse)) {
+        int err = errno;
+        closeFile(in);
+        errno = err;
+        return -1;
+    }
+
+    int how = REFLINK_CLONE;
+    char *buf = 0;
+
+    if (setSize(out, size))
+        goto failed;
+
+    for (long long off = 0; off < size; ) {
+        long long len = cloneChunk(off, size, align, ROUND_TAIL);
+        if (cloneRange(in, out, off, len)) {
+            if (off || !cloneUnsupported(errno))
+                goto failed;
+            how = REFLINK_COPY;
+            break;
+        }
+        off += len;
+    }
+
+    if (how == REFLINK_COPY) {
+        buf = malloc(COPY_BUFSIZE);
+        if (!buf) {
+            errno = ENOMEM;
+            goto failed;
+        }
+
+        long long start, end;
+        for (long long off = 0; off < size; off = end) {
+            int s = dataRange(in, off, size, &start, &end);
+            if (s < 0) goto failed;
+            if (s == 0) break;
+            if (copyRange(in, out, start, end - start, buf))
+                goto failed;
+        }
+        free(buf);
+    }
+
+    closeFile(in);
+    closeFile(out);
+    if (method) *method = how;
+    return 0;
+
+ failed:
+    {
+        int err = errno;
+        free(buf);
+        closeFile(in);
+        closeFile(out);
+        removeFile(dst);
+        errno = err;
+    }
+    return -1;
+}
+
+#ifdef UNIT_TEST
+// Linux:   gcc -DUNIT_TEST -g -Wall reflink.c -o reflink && ./reflink [dir]
+// Windows: gcc -DUNIT_TEST -g -Wall reflink.c winerrno.c -o reflink && reflink [dir]
+//
+// 'dir' should be on a filesystem that can clone (btrfs, XFS, ReFS) to
+// test cloning; elsewhere the copy path is tested.
+
+static int failures;
+
+#define CHECK(c) do { if (!(c)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+    failures++; } } while (0)
+
+static long long fileSize(FILE *fp)
+{
+    fseek(fp, 0, SEEK_END);
+    long long n = ftell(fp);
+    rewind(fp);
+    return n;
+}
+
+int main(int ac, char**av)
+{
+    const char *dir = ac > 1 ? av[1] : ".";
+    char src[1024], dst[1024];
+
+    // chunking
+    CHECK(cloneChunk(0, 100, 4096, false) == 100);
+    CHECK(cloneChunk(0, 100, 4096, true) == 4096);
+    CHECK(cloneChunk(0, 3*CLONE_CHUNK, 4096, true) == CLONE_CHUNK);
+    CHECK(cloneChunk(CLONE_CHUNK, CLONE_CHUNK+5, 4096, true) == 4096);
+    CHECK(cloneChunk(0, CLONE_CHUNK+1, 3000, false) % 3000 == 0);
+
+    // a file with data, a hole, and more data
+    snprintf(src, sizeof(src), "%s/reflink_src.tmp", dir);
+    snprintf(dst, sizeof(dst), "%s/reflink_dst.tmp", dir);
+    remove(src);
+    remove(dst);
+
+    FILE *fp = fopen(src, "wb");
+    if (!fp) { perror(src); return 1; }
+    fputs("head", fp);
+    fseek(fp, 8 << 20, SEEK_SET);
+    fputs("tail", fp);
+    fclose(fp);
+
+    int method = 0;
+    CHECK(reflink(src, dst, &method) == 0);
+    CHECK(method == REFLINK_CLONE || method == REFLINK_COPY);
+    printf("reflink used %s\n", method == REFLINK_CLONE ? "clone" : "copy");
+
+    fp = fopen(dst, "rb");
+    CHECK(fp != 0);
+    if (fp) {
+        char b[5] = {0};
+        CHECK(fileSize(fp) == (8 << 20) + 4);
+        CHECK(fread(b, 1, 4, fp) == 4 && !strcmp(b, "head"));
+        fseek(fp, 1 << 20, SEEK_SET);
+        CHECK(fread(b, 1, 4, fp) == 4 && !memcmp(b, "\0\0\0\0", 4));
+        fseek(fp, 8 << 20, SEEK_SET);
+        CHECK(fread(b, 1, 4, fp) == 4 && !strcmp(b, "tail"));
+        fclose(fp);
+    }
+
+    // the destination must not exist
+    errno = 0;
+    CHECK(reflink(src, dst, &method) == -1 && errno == EEXIST);
+
+    remove(dst);
+    errno = 0;
+    CHECK(reflink("no such file", dst, &method) == -1 && errno == ENOENT);
+
+    remove(src);
+    remove(dst);
+
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+#endif
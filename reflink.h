@@ -0,0 +1,47 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _REFLINK_H
+#define _REFLINK_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+// How reflink() copied the data
+#define REFLINK_CLONE   1   // block clone: shares extents, copy-on-write
+#define REFLINK_COPY    2   // streamed copy, holes in sparse files kept
+
+/* Copy 'src' to 'dst', which must not exist.  On ReFS and Dev Drive
+   volumes (FSCTL_DUPLICATE_EXTENTS_TO_FILE) or Linux filesystems with
+   FICLONERANGE, the copy shares the source's blocks until either file is
+   written; otherwise the data is copied.  Returns 0 with '*method' (if not
+   NULL) set to REFLINK_CLONE or REFLINK_COPY, or -1 with errno set.
+*/
+int reflink(const char *src, const char *dst, int *method);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
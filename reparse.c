@@ -0,0 +1,281 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/ntifs/ns-ntifs-_reparse_data_buffer
+//
+//   ULONG  ReparseTag;
+//   USHORT ReparseDataLength;      bytes following this header
+//   USHORT Reserved;
+//   USHORT SubstituteNameOffset;   byte offsets into PathBuffer
+//   USHORT SubstituteNameLength;   byte lengths, without null
+//   USHORT PrintNameOffset;
+//   USHORT PrintNameLength;
+//   ULONG  Flags;                  symlinks only
+//   WCHAR  PathBuffer[];
+
+#include <string.h>
+#include "reparse.h"
+
+#define HEADER_LEN      8
+#define MOUNT_POINT_LEN (HEADER_LEN + 8)
+#define SYMLINK_LEN     (HEADER_LEN + 12)
+
+static const uint16_t ntPrefix[] = { '\\', '?', '?', '\\' };
+
+static inline void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p+2, v >> 16);
+}
+
+static inline uint16_t get16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+    return get16(p) | (uint32_t)get16(p+2) << 16;
+}
+
+size_t reparse_encode_junction(const uint16_t *target, size_t len,
+                               void *buf, size_t bufsiz)
+{
+    unsigned char *b = buf;
+
+    // SubstituteName is the NT path "\??\C:\dir"; PrintName is "C:\dir".
+    // Both are followed by a null.
+    size_t substBytes = (4 + len)*2;
+    size_t printBytes = len*2;
+    size_t dataLen = 8 + substBytes + 2 + printBytes + 2;
+    size_t total = HEADER_LEN + dataLen;
+
+    if (total > bufsiz || total > REPARSE_MAX_BUFFER)
+        return 0;
+
+    put32(b, REPARSE_TAG_MOUNT_POINT);
+    put16(b+4, dataLen);
+    put16(b+6, 0);
+    put16(b+8, 0);
+    put16(b+10, substBytes);
+    put16(b+12, substBytes + 2);
+    put16(b+14, printBytes);
+
+    unsigned char *p = b + MOUNT_POINT_LEN;
+    for (int i=0; i < 4; i++, p += 2) put16(p, ntPrefix[i]);
+    for (size_t i=0; i < len; i++, p += 2) put16(p, target[i]);
+    put16(p, 0);
+    p += 2;
+    for (size_t i=0; i < len; i++, p += 2) put16(p, target[i]);
+    put16(p, 0);
+
+    return total;
+}
+
+size_t reparse_encode_symlink(const uint16_t *target, size_t len,
+                              int relative, void *buf, size_t bufsiz)
+{
+    unsigned char *b = buf;
+
+    // As CreateSymbolicLink lays it out: the SubstituteName, which is the
+    // NT path "\??\C:\dir" unless relative, then the PrintName, the target
+    // as given, neither with a null.
+    size_t prefix = relative ? 0 : 4;
+    size_t substBytes = (prefix + len)*2;
+    size_t printBytes = len*2;
+    size_t dataLen = 12 + substBytes + printBytes;
+    size_t total = HEADER_LEN + dataLen;
+
+    if (total > bufsiz || total > REPARSE_MAX_BUFFER)
+        return 0;
+
+    put32(b, REPARSE_TAG_SYMLINK);
+    put16(b+4, dataLen);
+    put16(b+6, 0);
+    put16(b+8, 0);
+    put16(b+10, substBytes);
+    put16(b+12, substBytes);
+    put16(b+14, printBytes);
+    put32(b+16, relative ? REPARSE_SYMLINK_RELATIVE : 0);
+
+    unsigned char *p = b + SYMLINK_LEN;
+    for (size_t i=0; i < prefix; i++, p += 2) put16(p, ntPrefix[i]);
+    for (size_t i=0; i < len; i++, p += 2) put16(p, target[i]);
+    for (size_t i=0; i < len; i++, p += 2) put16(p, target[i]);
+
+    return total;
+}
+
+int reparse_decode(const void *buf, size_t len, struct reparse_link *link)
+{
+    const unsigned char *b = buf;
+
+    if (len < HEADER_LEN) return -1;
+
+    uint32_t tag = get32(b);
+    size_t dataLen = get16(b+4);
+    size_t pathStart;
+
+    switch (tag) {
+      case REPARSE_TAG_MOUNT_POINT: pathStart = MOUNT_POINT_LEN;  break;
+      case REPARSE_TAG_SYMLINK:     pathStart = SYMLINK_LEN;  break;
+      default:                      return 0;
+    }
+
+    if (HEADER_LEN + dataLen > len || pathStart > HEADER_LEN + dataLen)
+        return -1;
+
+    size_t pathLen = HEADER_LEN + dataLen - pathStart;
+    size_t substOff = get16(b+8), substLen = get16(b+10);
+    size_t printOff = get16(b+12), printLen = get16(b+14);
+
+    if (substOff + substLen > pathLen || printOff + printLen > pathLen
+        || (substOff | substLen | printOff | printLen) & 1)
+        return -1;
+
+    link->tag = tag;
+    link->flags = (tag == REPARSE_TAG_SYMLINK) ? get32(b+16) : 0;
+    link->subst = (const uint16_t*)(b + pathStart + substOff);
+    link->substLen = substLen/2;
+    link->print = (const uint16_t*)(b + pathStart + printOff);
+    link->printLen = printLen/2;
+
+    return 1;
+}
+
+#ifdef UNIT_TEST
+// gcc -DUNIT_TEST -g -Wall reparse.c -o reparse && ./reparse
+// Runs anywhere; no Windows headers needed.
+
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(c) do { if (!(c)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+    failures++; } } while (0)
+
+static size_t widen(const char *s, uint16_t *w)
+{
+    size_t n;
+    for (n=0; s[n]; n++) w[n] = (unsigned char)s[n];
+    return n;
+}
+
+static int equals(const uint16_t *w, size_t n, const char *s)
+{
+    if (strlen(s) != n) return 0;
+    for (size_t i=0; i < n; i++)
+        if (w[i] != (unsigned char)s[i]) return 0;
+    return 1;
+}
+
+int main()
+{
+    // uint16_t alignment, as in a Windows reparse buffer
+    uint16_t storage[REPARSE_MAX_BUFFER/2];
+    unsigned char *buf = (unsigned char*)storage;
+    uint16_t target[300];
+    struct reparse_link link;
+
+    size_t n = widen("C:\\build\\out", target);
+    size_t len = reparse_encode_junction(target, n, buf, sizeof(storage));
+
+    // header, four USHORTs, "\??\C:\build\out" and "C:\build\out" with nulls
+    CHECK(len == 8 + 8 + (4+n+1)*2 + (n+1)*2);
+    CHECK(get32(buf) == REPARSE_TAG_MOUNT_POINT);
+    CHECK(get16(buf+4) == len - 8);
+    CHECK(get16(buf+8) == 0);
+    CHECK(get16(buf+10) == (4+n)*2);
+    CHECK(get16(buf+12) == (4+n+1)*2);
+    CHECK(get16(buf+14) == n*2);
+    CHECK(get16(buf+16+(4+n)*2) == 0);
+    CHECK(get16(buf+len-2) == 0);
+
+    CHECK(reparse_decode(buf, len, &link) == 1);
+    CHECK(link.tag == REPARSE_TAG_MOUNT_POINT);
+    CHECK(link.flags == 0);
+    CHECK(equals(link.subst, link.substLen, "\\??\\C:\\build\\out"));
+    CHECK(equals(link.print, link.printLen, "C:\\build\\out"));
+
+    // doesn't fit
+    CHECK(reparse_encode_junction(target, n, buf, len-1) == 0);
+    CHECK(reparse_encode_junction(target, n, buf, len) == len);
+
+    // truncated or corrupt buffers are rejected
+    CHECK(reparse_decode(buf, len-1, &link) == -1);
+    CHECK(reparse_decode(buf, 4, &link) == -1);
+    put16(buf+14, n*2 + 100);
+    CHECK(reparse_decode(buf, len, &link) == -1);
+
+    // a relative symlink, laid out as the filesystem returns it
+    memset(buf, 0, 64);
+    n = widen("..\\lib", target);
+    put32(buf, REPARSE_TAG_SYMLINK);
+    put16(buf+4, 12 + 4*n);
+    put16(buf+8, 0);            // SubstituteName first, then PrintName
+    put16(buf+10, 2*n);
+    put16(buf+12, 2*n);
+    put16(buf+14, 2*n);
+    put32(buf+16, REPARSE_SYMLINK_RELATIVE);
+    for (size_t i=0; i < n; i++) {
+        put16(buf+20+2*i, target[i]);
+        put16(buf+20+2*n+2*i, target[i]);
+    }
+    CHECK(reparse_decode(buf, 20 + 4*n, &link) == 1);
+    CHECK(link.tag == REPARSE_TAG_SYMLINK);
+    CHECK(link.flags == REPARSE_SYMLINK_RELATIVE);
+    CHECK(equals(link.print, link.printLen, "..\\lib"));
+
+    // encoded symlinks decode to what went in
+    n = widen("C:\\build\\out", target);
+    len = reparse_encode_symlink(target, n, 0, buf, sizeof(storage));
+    CHECK(len == 8 + 12 + (4+n)*2 + n*2);
+    CHECK(reparse_decode(buf, len, &link) == 1);
+    CHECK(link.tag == REPARSE_TAG_SYMLINK && link.flags == 0);
+    CHECK(equals(link.subst, link.substLen, "\\??\\C:\\build\\out"));
+    CHECK(equals(link.print, link.printLen, "C:\\build\\out"));
+    CHECK(reparse_encode_symlink(target, n, 0, buf, len-1) == 0);
+
+    n = widen("..\\lib", target);
+    len = reparse_encode_symlink(target, n, 1, buf, sizeof(storage));
+    CHECK(reparse_decode(buf, len, &link) == 1);
+    CHECK(link.flags == REPARSE_SYMLINK_RELATIVE);
+    CHECK(equals(link.subst, link.substLen, "..\\lib"));
+    CHECK(equals(link.print, link.printLen, "..\\lib"));
+
+    // other tags aren't links
+    put32(buf, 0x80000023);     // IO_REPARSE_TAG_APPEXECLINK
+    CHECK(reparse_decode(buf, 20 + 4*n, &link) == 0);
+
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,84 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _REPARSE_H
+#define _REPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Encoding and decoding of Windows reparse point buffers, as used with
+   FSCTL_SET_REPARSE_POINT and FSCTL_GET_REPARSE_POINT.  No Windows
+   headers are needed, so this can be built and tested on any system.
+   Path names are UTF-16, in host byte order (little endian on Windows).
+ */
+
+#define REPARSE_TAG_MOUNT_POINT     0xA0000003u
+#define REPARSE_TAG_SYMLINK         0xA000000Cu
+
+#define REPARSE_SYMLINK_RELATIVE    0x00000001u
+
+// Space for the largest buffer the filesystem will return.
+#define REPARSE_MAX_BUFFER          (16*1024)
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Builds a mount point (junction) buffer for the absolute DOS path
+   'target', 'len' code units long, not null terminated.  Returns the
+   number of bytes written to 'buf', or 0 if 'buf' is too small.
+*/
+size_t reparse_encode_junction(const uint16_t *target, size_t len,
+                               void *buf, size_t bufsiz);
+
+/* Builds a symbolic link buffer for 'target', 'len' code units long, not
+   null terminated: an absolute DOS path, or with 'relative' nonzero a
+   path relative to the link's directory.  Returns the number of bytes
+   written to 'buf', or 0 if 'buf' is too small.
+*/
+size_t reparse_encode_symlink(const uint16_t *target, size_t len,
+                              int relative, void *buf, size_t bufsiz);
+
+struct reparse_link {
+    uint32_t tag;
+    uint32_t flags;             // REPARSE_SYMLINK_RELATIVE, symlinks only
+    const uint16_t *print;      // PrintName, points into the buffer
+    size_t printLen;            // in code units
+    const uint16_t *subst;      // SubstituteName
+    size_t substLen;
+};
+
+/* Decodes a symlink or mount point buffer of 'len' bytes.
+   Returns:
+   -1 : truncated or inconsistent buffer
+    0 : some other reparse tag
+    1 : decoded into 'link'
+*/
+int reparse_decode(const void *buf, size_t len, struct reparse_link *link);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
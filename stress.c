@@ -0,0 +1,315 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Stress test: many threads mixing clock_nanosleep() with the metadata
+   functions, to see where the library stops scaling.
+
+   gcc -O2 stress.c symlink.c clock_nanosleep.c reparse.c winerrno.c diag.c
+       symstats.c fault.c metacache.c -o stress -Wall -lpsapi
+
+   stress <dir> [-w sleep|meta|mix] [-t 1,2,4,...] [-d seconds] [-o samples.csv]
+
+   For each thread count (default 1,2,4,8,16,32,64) the threads run the
+   workload for 'seconds' (default 2), and throughput is reported with
+   its scaling relative to one thread.  The process handle count and
+   private bytes are sampled every 100 ms; growth over a step that
+   doesn't come back points to a leak.  -o writes the samples as CSV.
+
+   Each metadata round also calls readlink() on a regular file, and
+   checks that the calling thread sees EINVAL; any other errno means
+   error state leaked between threads.
+
+   Exits with status 1 if the handle count at the end exceeds the count
+   before the first step by more than HANDLE_SLACK, so a handle leak
+   (such as isSymLink() once closing its find handle with CloseHandle)
+   fails the run.
+ */
+#define _WIN32_WINNT 0x0600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <windows.h>
+#include <psapi.h>
+#include "pthread.h"
+#include "pthread_time.h"
+#include "symlink.h"
+
+#define WORK_SLEEP  1
+#define WORK_META   2
+#define WORK_MIX    (WORK_SLEEP | WORK_META)
+
+#define MAX_THREADS         256
+#define SAMPLE_INTERVAL_MS  100
+#define HANDLE_SLACK        16  // handles the system may cache
+
+static char file[MAX_PATH], junction[MAX_PATH], subdir[MAX_PATH];
+static unsigned workload = WORK_MIX;
+
+static volatile LONG stop;
+
+struct worker {
+    HANDLE thread;
+    size_t ops;
+    size_t errors;
+    size_t errnoMismatch;
+};
+
+struct sample {
+    double t;
+    int threads;
+    DWORD handles;
+    size_t privateBytes;
+};
+
+static struct sample *samples;
+static size_t nSamples, sampleCap;
+static SRWLOCK sampleLock = SRWLOCK_INIT;
+static volatile LONG curThreads;
+static LARGE_INTEGER freq, start;
+
+static double now(void)
+{
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (t.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+}
+
+static struct sample takeSample(void)
+{
+    struct sample s = { .t = now(), .threads = curThreads };
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+
+    GetProcessHandleCount(GetCurrentProcess(), &s.handles);
+    if (GetProcessMemoryInfo(GetCurrentProcess(),
+                             (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc)))
+        s.privateBytes = pmc.PrivateUsage;
+
+    AcquireSRWLockExclusive(&sampleLock);
+    if (nSamples == sampleCap) {
+        sampleCap = sampleCap ? sampleCap*2 : 1024;
+        samples = realloc(samples, sampleCap * sizeof(*samples));
+        if (!samples) { perror("realloc"); exit(1); }
+    }
+    samples[nSamples++] = s;
+    ReleaseSRWLockExclusive(&sampleLock);
+
+    return s;
+}
+
+static DWORD WINAPI sampler(LPVOID arg)
+{
+    HANDLE done = arg;
+
+    while (WaitForSingleObject(done, SAMPLE_INTERVAL_MS) == WAIT_TIMEOUT)
+        takeSample();
+    return 0;
+}
+
+static void metaRound(struct worker *w)
+{
+    struct stat st;
+    char buf[MAX_PATH];
+
+    if (lstat(file, &st)) w->errors++;
+    if (lstat(junction, &st)) w->errors++;
+    if (isSymLink(junction) != ISLINK_JUNCTION) w->errors++;
+    if (readlink(junction, buf, sizeof(buf)) < 0) w->errors++;
+    if (!realpath(subdir, buf)) w->errors++;
+
+    char *p = realpath(file, 0);
+    if (!p) w->errors++;
+    free(p);
+
+    errno = 0;
+    if (readlink(file, buf, sizeof(buf)) >= 0 || errno != EINVAL)
+        w->errnoMismatch++;
+
+    w->ops += 7;
+}
+
+static void sleepRound(struct worker *w)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000 };
+
+    if (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, 0)) w->errors++;
+    w->ops++;
+}
+
+static DWORD WINAPI work(LPVOID arg)
+{
+    struct worker *w = arg;
+
+    while (!stop) {
+        if (workload & WORK_META) metaRound(w);
+        if (workload & WORK_SLEEP) sleepRound(w);
+    }
+    return 0;
+}
+
+static int setup(const char *dir)
+{
+    char full[MAX_PATH];
+
+    if (!GetFullPathNameA(dir, sizeof(full), full, 0)) return -1;
+    CreateDirectoryA(full, 0);
+
+    snprintf(file, sizeof(file), "%s\\file", full);
+    snprintf(subdir, sizeof(subdir), "%s\\sub", full);
+    snprintf(junction, sizeof(junction), "%s\\junction", full);
+
+    FILE *fp = fopen(file, "w");
+    if (!fp) { perror(file); return -1; }
+    fputs("stress\n", fp);
+    fclose(fp);
+
+    CreateDirectoryA(subdir, 0);
+    if (junction_create(subdir, junction)) {
+        perror(junction);
+        return -1;
+    }
+    return 0;
+}
+
+static void cleanup(void)
+{
+    junction_remove(junction);
+    RemoveDirectoryA(subdir);
+    DeleteFileA(file);
+}
+
+int main(int ac, char **av)
+{
+    const char *dir = 0, *csv = 0, *counts = "1,2,4,8,16,32,64";
+    double seconds = 2;
+
+    for (int i=1; i < ac; i++) {
+        if (!strcmp(av[i], "-w") && i+1 < ac) {
+            i++;
+            workload = !strcmp(av[i], "sleep") ? WORK_SLEEP
+                     : !strcmp(av[i], "meta") ? WORK_META : WORK_MIX;
+        } else if (!strcmp(av[i], "-t") && i+1 < ac) {
+            counts = av[++i];
+        } else if (!strcmp(av[i], "-d") && i+1 < ac) {
+            seconds = atof(av[++i]);
+        } else if (!strcmp(av[i], "-o") && i+1 < ac) {
+            csv = av[++i];
+        } else if (!dir && av[i][0] != '-') {
+            dir = av[i];
+        } else {
+            dir = 0;
+            break;
+        }
+    }
+    if (!dir || seconds <= 0) {
+        fprintf(stderr, "usage: %s dir [-w sleep|meta|mix] [-t 1,2,4,...] "
+                "[-d seconds] [-o samples.csv]\n", av[0]);
+        return 1;
+    }
+    if (setup(dir)) return 1;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    HANDLE done = CreateEvent(0, TRUE, FALSE, 0);
+    HANDLE hSampler = CreateThread(0, 0, sampler, done, 0, 0);
+    struct sample first = takeSample();
+    int status = 0;
+
+    printf("%7s %12s %8s %8s %8s %10s %12s\n", "threads", "ops/sec",
+           "scaling", "errors", "errno", "handles", "private KB");
+
+    double base = 0;
+    static struct worker workers[MAX_THREADS];
+
+    for (const char *c = counts; *c; ) {
+        int n = strtol(c, (char**)&c, 10);
+        if (*c == ',') c++;
+        if (n <= 0) break;
+        if (n > MAX_THREADS) n = MAX_THREADS;
+
+        memset(workers, 0, sizeof(workers));
+        struct sample before = takeSample();
+
+        stop = 0;
+        curThreads = n;
+        double t0 = now();
+        int started = 0;
+        for (int i=0; i < n; i++)
+            if ((workers[i].thread = CreateThread(0, 0, work, &workers[i],
+                                                  0, 0)))
+                started++;
+
+        Sleep(seconds * 1000);
+        InterlockedExchange(&stop, 1);
+
+        size_t ops = 0, errors = 0, mismatch = 0;
+        for (int i=0; i < n; i++) {
+            if (!workers[i].thread) continue;
+            WaitForSingleObject(workers[i].thread, INFINITE);
+            CloseHandle(workers[i].thread);
+            ops += workers[i].ops;
+            errors += workers[i].errors;
+            mismatch += workers[i].errnoMismatch;
+        }
+        double rate = ops / (now() - t0);
+        curThreads = 0;
+
+        struct sample after = takeSample();
+
+        if (!base) base = rate / started;
+        printf("%7d %12.0f %7.0f%% %8zu %8zu %+10ld %+12ld\n",
+               started, rate, 100 * rate / (base * started), errors,
+               mismatch, (long)after.handles - (long)before.handles,
+               ((long)after.privateBytes - (long)before.privateBytes) / 1024);
+    }
+
+    struct sample last = takeSample();
+    if (last.handles > first.handles + HANDLE_SLACK) {
+        fprintf(stderr, "handle count grew by %lu\n",
+                last.handles - first.handles);
+        status = 1;
+    }
+
+    SetEvent(done);
+    WaitForSingleObject(hSampler, INFINITE);
+    CloseHandle(hSampler);
+    CloseHandle(done);
+    cleanup();
+
+    if (csv) {
+        FILE *fp = fopen(csv, "w");
+        if (!fp) { perror(csv); return 1; }
+        fprintf(fp, "seconds,threads,handles,private_bytes\n");
+        for (size_t i=0; i < nSamples; i++)
+            fprintf(fp, "%.3f,%d,%lu,%zu\n", samples[i].t, samples[i].threads,
+                    samples[i].handles, samples[i].privateBytes);
+        fclose(fp);
+    }
+
+    free(samples);
+    return status;
+}
@@ -28,43 +28,71 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <ctype.h>
 #include <windows.h>
 #include "symlink.h"
+#include "reparse.h"
+#include "winerrno.h"
+#include "diag.h"
+#include "symstats.h"
+#include "fault.h"
+#include "metacache.h"
 
-static int debug;
+/* File system calls made in this thread, for symstats.c: each call below
+   bumps the count.  A C runtime stat() counts as one call.  Each call can
+   also be delayed, or made to fail with the given value, by fault.c.
+*/
+static __thread unsigned fsCalls;
 
-static void setErrno(const char* funcName)
-{
-    DWORD err = GetLastError();
+#define COUNTED(fn, fail, ...)                                          \
+    (fsCalls++, fault_active && fault_inject(#fn) ? (fail) : fn(__VA_ARGS__))
 
-    switch (err) {
-      case ERROR_FILE_NOT_FOUND:    errno = ENOENT;  break;
-      case ERROR_ACCESS_DENIED:     errno = EACCES;  break;
-      case ERROR_ALREADY_EXISTS:
-      case ERROR_FILE_EXISTS:       errno = EEXIST;  break;
-      case ERROR_PATH_NOT_FOUND:    errno = ENAMETOOLONG;  break;
-      case ERROR_NOT_ENOUGH_MEMORY: errno = ENOMEM;  break;
-      case ERROR_NOT_SAME_DEVICE:   errno = EPERM;  break;
-      default:
-        {
-            char* msg = 0;
-            FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER
-                          |FORMAT_MESSAGE_FROM_SYSTEM
-                          | FORMAT_MESSAGE_IGNORE_INSERTS,
-                          0, err, 0, (LPTSTR)&msg, 0, 0);
-            if (msg) {
-                fprintf(stderr, "%s: %s (%ld)", funcName, msg, err);
-                LocalFree(msg);
-            } else {
-                fprintf(stderr, "%s: error %ld\n", funcName, err);
-            }
-            errno = EIO;
-        }
-        break;
-    }
-}
+// closing always happens, but may be delayed; errno is left alone, as
+// error paths close after setting it
+#define COUNTED_CLOSE(fn, ...)                                          \
+    (fsCalls++, fault_active ? fault_delay(#fn) : (void)0, fn(__VA_ARGS__))
+
+#define CloseHandle(...)        COUNTED_CLOSE(CloseHandle, __VA_ARGS__)
+#define FindClose(...)          COUNTED_CLOSE(FindClose, __VA_ARGS__)
+
+#define CopyFileA(...)          COUNTED(CopyFileA, FALSE, __VA_ARGS__)
+#define CreateDirectoryA(...)   COUNTED(CreateDirectoryA, FALSE, __VA_ARGS__)
+#define CreateFileA(...)        \
+    COUNTED(CreateFileA, INVALID_HANDLE_VALUE, __VA_ARGS__)
+#define CreateHardLinkA(...)    COUNTED(CreateHardLinkA, FALSE, __VA_ARGS__)
+#define CreateSymbolicLinkA(...) \
+    COUNTED(CreateSymbolicLinkA, FALSE, __VA_ARGS__)
+#define DeleteFileA(...)        COUNTED(DeleteFileA, FALSE, __VA_ARGS__)
+#define DeviceIoControl(...)    COUNTED(DeviceIoControl, FALSE, __VA_ARGS__)
+#define FindFirstFileExA(...)   \
+    COUNTED(FindFirstFileExA, INVALID_HANDLE_VALUE, __VA_ARGS__)
+#define FindFirstFileNameW(...) \
+    COUNTED(FindFirstFileNameW, INVALID_HANDLE_VALUE, __VA_ARGS__)
+#define FindNextFileNameW(...)  COUNTED(FindNextFileNameW, FALSE, __VA_ARGS__)
+#define GetFileAttributesA(...) \
+    COUNTED(GetFileAttributesA, INVALID_FILE_ATTRIBUTES, __VA_ARGS__)
+#define GetFileAttributesExA(...) \
+    COUNTED(GetFileAttributesExA, FALSE, __VA_ARGS__)
+#define GetFileInformationByHandle(...) \
+    COUNTED(GetFileInformationByHandle, FALSE, __VA_ARGS__)
+#define GetFileInformationByHandleEx(...) \
+    COUNTED(GetFileInformationByHandleEx, FALSE, __VA_ARGS__)
+#define GetFinalPathNameByHandleA(...) \
+    COUNTED(GetFinalPathNameByHandleA, 0, __VA_ARGS__)
+#define GetVolumePathNameA(...) COUNTED(GetVolumePathNameA, FALSE, __VA_ARGS__)
+#define GetVolumePathNameW(...) COUNTED(GetVolumePathNameW, FALSE, __VA_ARGS__)
+#define MoveFileExA(...)        COUNTED(MoveFileExA, FALSE, __VA_ARGS__)
+#define RemoveDirectoryA(...)   COUNTED(RemoveDirectoryA, FALSE, __VA_ARGS__)
+#define SetFileInformationByHandle(...) \
+    COUNTED(SetFileInformationByHandle, FALSE, __VA_ARGS__)
+#define SetFileTime(...)        COUNTED(SetFileTime, FALSE, __VA_ARGS__)
+#define _stat64(...)            COUNTED(_stat64, -1, __VA_ARGS__)
+#ifndef stat
+#define stat(...)               COUNTED(stat, -1, __VA_ARGS__)
+#endif
 
 // This function is used only to avoid false positive warning from gcc 10
 // re: returning pointer to local buffer.
@@ -76,11 +104,10 @@ int getPathAndStripPrefix(HANDLE hPath, char* fn, DWORD buflen)
 
     // return value s doesn't include null terminator; buflen does
     if (s >= buflen) {
-        fprintf(stderr, "%s:%d> buffer length %ld too small; need %ld",
-                __FILE__, __LINE__, buflen, s);
+        errno = ENAMETOOLONG;
         return -1;
     } else if (s == 0) {
-        setErrno(__func__);
+        win32_set_errno();
         return -1;
     }
 
@@ -90,13 +117,15 @@ int getPathAndStripPrefix(HANDLE hPath, char* fn, DWORD buflen)
     return 0;
 }
 
-char* realpath(const char *path, char *resolved_path)
+static char* realpathImpl(const char *path, char *resolved_path)
 {
+    DIAG(DIAG_TRACE, DIAG_SYMLINK, "realpath %s", path);
+
     HANDLE hPath = CreateFile(path, 0, 0, 0, OPEN_EXISTING, 0, 0);
     if (hPath == INVALID_HANDLE_VALUE) {
-        setErrno("realpath");
-        if (debug)
-            fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't open %s: %s",
+             path, strerror(errno));
         return 0;
     }
 
@@ -105,10 +134,9 @@ char* realpath(const char *path, char *resolved_path)
         // get pathname size
         s = GetFinalPathNameByHandleA(hPath, 0, 0, FILE_NAME_OPENED);
         if (!s) {
-            setErrno("realpath");
-            if (debug)
-                fprintf(stderr, "can't get final path %s: %s\n", 
-                        path, strerror(errno));
+            win32_set_errno();
+            DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't get final path %s: %s",
+                 path, strerror(errno));
             return 0;
         }
 
@@ -128,41 +156,144 @@ char* realpath(const char *path, char *resolved_path)
     }
 }
 
-// https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/ntifs/ns-ntifs-_reparse_data_buffer
-
-typedef struct _REPARSE_DATA_BUFFER {
-    ULONG  ReparseTag;
-    USHORT ReparseDataLength;
-    USHORT Reserved;
-    union {
-        struct {
-            USHORT SubstituteNameOffset;
-            USHORT SubstituteNameLength;
-            USHORT PrintNameOffset;
-            USHORT PrintNameLength;
-            ULONG  Flags;
-            WCHAR  PathBuffer[1];
-        } SymbolicLinkReparseBuffer;
-        struct {
-            USHORT SubstituteNameOffset;
-            USHORT SubstituteNameLength;
-            USHORT PrintNameOffset;
-            USHORT PrintNameLength;
-            WCHAR  PathBuffer[1];
-        } MountPointReparseBuffer;
-        struct {
-            UCHAR DataBuffer[1];
-        } GenericReparseBuffer;
-    } DUMMYUNIONNAME;
-} _REPARSE_DATA_BUFFER;
+/* The persistent cache (metacache.c), when it's on.  A realpath() hit
+   costs one GetFileAttributesEx, to check that the file is as it was; an
+   lstat() hit costs a handle query (see cachedLstat()).  A miss costs
+   that on top of the usual calls.
+*/
+static bool cacheStamp(const char *path, struct metacache_stamp *st)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fa))
+        return false;
 
-ssize_t readlink(const char *path, char *buf, size_t bufsiz)
+    st->attrs = fa.dwFileAttributes;
+    st->size = (unsigned long long)fa.nFileSizeHigh << 32 | fa.nFileSizeLow;
+    st->ctime = (unsigned long long)fa.ftCreationTime.dwHighDateTime << 32
+        | fa.ftCreationTime.dwLowDateTime;
+    st->mtime = (unsigned long long)fa.ftLastWriteTime.dwHighDateTime << 32
+        | fa.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+/* Entries are keyed on the absolute path, so that a relative path isn't
+   taken for the same name in another process's current directory, or in
+   this one's before a chdir().  GetFullPathName is lexical, as Win32
+   itself treats '..', and makes no file system call.
+*/
+static bool cacheKey(const char *path, char *key, DWORD len)
+{
+    DWORD n = GetFullPathNameA(path, len, key, 0);
+    return n && n < len;
+}
+
+static char* cachedRealpath(const char *path, char *resolved_path)
+{
+    struct metacache_stamp st;
+    char fn[PATH_MAX+4+1], key[PATH_MAX];
+
+    // a link's stamp says nothing about where it leads
+    bool stamped = cacheKey(path, key, sizeof(key)) && cacheStamp(path, &st)
+        && !(st.attrs & FILE_ATTRIBUTE_REPARSE_POINT);
+    int n = stamped ? metacache_get(METACACHE_REALPATH, key, &st,
+                                    fn, sizeof(fn)) : -1;
+    if (n > 0 && !fn[n-1]) {
+        if (!resolved_path) return strdup(fn);
+        strncpy(resolved_path, fn, PATH_MAX-1);
+        resolved_path[PATH_MAX-1] = 0;
+        return resolved_path;
+    }
+
+    // A result that isn't the key, but for case, crossed a link in one of
+    // the directories above; the file's stamp wouldn't see that link
+    // repointed, so only its own name is cached.
+    char *p = realpathImpl(path, resolved_path);
+    if (p && stamped && !_stricmp(p, key))
+        metacache_put(METACACHE_REALPATH, key, &st, p, strlen(p) + 1);
+    return p;
+}
+
+char* realpath(const char *path, char *resolved_path)
+{
+    unsigned calls = fsCalls;
+    unsigned long long t = symstats_begin();
+
+    char *p = metacache_active ? cachedRealpath(path, resolved_path)
+                               : realpathImpl(path, resolved_path);
+
+    symstats_end(resolved_path ? SYMSTATS_REALPATH_BUF
+                               : SYMSTATS_REALPATH_ALLOC,
+                 t, fsCalls - calls, !p);
+    return p;
+}
+
+/* Reads and decodes the reparse point of 'path' itself: one open and one
+   FSCTL_GET_REPARSE_POINT, into 'rdb' (REPARSE_MAX_BUFFER bytes).  Fails
+   with EINVAL if 'path' isn't a symlink or junction.
+*/
+static int readReparse(const char *path, void *rdb, struct reparse_link *link)
+{
+    HANDLE handle = CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE
+                                | FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+                                FILE_FLAG_BACKUP_SEMANTICS
+                                | FILE_FLAG_OPEN_REPARSE_POINT, 0);
+    if (handle == INVALID_HANDLE_VALUE) {
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't open %s: %s",
+             path, strerror(errno));
+        return -1;
+    }
+
+    DWORD sz;
+    int s = DeviceIoControl(handle, FSCTL_GET_REPARSE_POINT,
+                            0, 0, rdb, REPARSE_MAX_BUFFER, &sz, 0);
+    DWORD err = GetLastError();
+    CloseHandle(handle);
+
+    if (!s) {
+        if (err == ERROR_NOT_A_REPARSE_POINT) {
+            errno = EINVAL;
+            return -1;
+        }
+        SetLastError(err);
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't get reparse info for %s: %s",
+             path, strerror(errno));
+        return -1;
+    }
+
+    if (reparse_decode(rdb, sz, link) != 1) {
+        errno = EINVAL;
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "invalid reparse tag for %s", path);
+        return -1;
+    }
+
+    // Some tools leave the PrintName empty; the SubstituteName is the NT
+    // path, "\??\C:\...".
+    if (!link->printLen) {
+        link->print = link->subst;
+        link->printLen = link->substLen;
+        if (link->printLen >= 4 && link->print[0] == '\\'
+            && link->print[1] == '?' && link->print[2] == '?'
+            && link->print[3] == '\\') {
+            link->print += 4;
+            link->printLen -= 4;
+        }
+    }
+    return 0;
+}
+
+/* The reparse point of the link 'path', into 'rdb' (REPARSE_MAX_BUFFER
+   bytes), with the LINK_* flags in '*flags' if it's not null.
+*/
+static int readLinkTarget(const char *path, void *rdb,
+                          struct reparse_link *link, unsigned *flags)
 {
     DWORD st = GetFileAttributesA(path);
     if (st == INVALID_FILE_ATTRIBUTES) {
-        setErrno("readlink");
-        if (debug)
-            fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't open %s: %s",
+             path, strerror(errno));
         return -1;
     }
     if (!(st & FILE_ATTRIBUTE_REPARSE_POINT)) {
@@ -170,101 +301,516 @@ ssize_t readlink(const char *path, char *buf, size_t bufsiz)
         return -1;      // not a link
     }
 
-    HANDLE handle = CreateFileA(path, 0, 0, 0, OPEN_EXISTING,
-                                FILE_FLAG_OPEN_REPARSE_POINT, 0);
-    if (handle == INVALID_HANDLE_VALUE) {
-        setErrno("readlink");
-        if (debug)
-            fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+    if (readReparse(path, rdb, link)) return -1;
+
+    if (flags) {
+        *flags = link->tag == REPARSE_TAG_MOUNT_POINT ? LINK_JUNCTION
+            : link->flags & REPARSE_SYMLINK_RELATIVE ? LINK_RELATIVE : 0;
+    }
+    return 0;
+}
+
+/* Converts the target's UTF-16 print name to the ANSI code page, as the
+   other *A calls here see names.  With 'bufsiz' 0, only measures it.
+   Returns the length in bytes, no NUL.
+*/
+static int targetText(const struct reparse_link *link, char *buf,
+                      int bufsiz)
+{
+    if (!link->printLen) return 0;
+
+    int n = WideCharToMultiByte(CP_ACP, 0, link->print, link->printLen,
+                                buf, bufsiz, 0, 0);
+    if (!n) win32_set_errno();
+    return n ? n : -1;
+}
+
+/* POSIX readlink(): no NUL is written, and a target longer than
+   'bufsiz' is cut short to 'bufsiz' bytes.
+*/
+static ssize_t readlinkImpl(const char *path, char *buf, size_t bufsiz,
+                            unsigned *flags)
+{
+    DIAG(DIAG_TRACE, DIAG_SYMLINK, "readlink %s", path);
+
+    char rdb[REPARSE_MAX_BUFFER];
+    struct reparse_link link;
+    if (readLinkTarget(path, rdb, &link, flags)) return -1;
+
+    int n = targetText(&link, 0, 0);
+    if (n <= 0) return n;
+
+    if ((size_t)n <= bufsiz)
+        return targetText(&link, buf, n);
+
+    // WideCharToMultiByte won't truncate, so convert it all, then cut
+    char *full = malloc(n);
+    if (!full) return -1;
+    n = targetText(&link, full, n);
+    if (n > 0) memcpy(buf, full, bufsiz);
+    free(full);
+    return n > 0 ? (ssize_t)bufsiz : -1;
+}
+
+ssize_t readlink(const char *path, char *buf, size_t bufsiz)
+{
+    return readlink_flags(path, buf, bufsiz, 0);
+}
+
+ssize_t readlink_flags(const char *path, char *buf, size_t bufsiz,
+                       unsigned *flags)
+{
+    unsigned calls = fsCalls;
+    unsigned long long t = symstats_begin();
+
+    ssize_t s = readlinkImpl(path, buf, bufsiz, flags);
+
+    symstats_end(SYMSTATS_READLINK, t, fsCalls - calls, s < 0);
+    return s;
+}
+
+static char* readlinkAllocImpl(const char *path, size_t *len)
+{
+    DIAG(DIAG_TRACE, DIAG_SYMLINK, "readlink_alloc %s", path);
+
+    char rdb[REPARSE_MAX_BUFFER];
+    struct reparse_link link;
+    if (readLinkTarget(path, rdb, &link, 0)) return 0;
+
+    // sized from the reparse buffer already read
+    int n = targetText(&link, 0, 0);
+    char *p = n < 0 ? 0 : malloc(n + 1);
+    if (!p) return 0;
+
+    if (n && targetText(&link, p, n) < 0) {
+        free(p);
+        return 0;
+    }
+    p[n] = 0;
+    if (len) *len = n;
+    return p;
+}
+
+char* readlink_alloc(const char *path, size_t *len)
+{
+    unsigned calls = fsCalls;
+    unsigned long long t = symstats_begin();
+
+    char *p = readlinkAllocImpl(path, len);
+
+    symstats_end(SYMSTATS_READLINK, t, fsCalls - calls, !p);
+    return p;
+}
+
+/* Lexical path normalization, as Windows applies to the targets of
+   relative links: '/' becomes '\\', and empty and '.' components are
+   dropped, as is each '..' with the component before it.  A '..' can't
+   climb above the root of an absolute path; a relative path keeps its
+   leading '..'s.  Returns the length, or -1 with ERANGE.
+*/
+static ssize_t normalizePath(const char *path, char *buf, size_t bufsiz)
+{
+    char tmp[PATH_MAX*2];
+    size_t n = strlen(path);
+    if (n >= sizeof(tmp)) {
+        errno = ERANGE;
         return -1;
     }
+    for (size_t i=0; i <= n; i++)
+        tmp[i] = path[i] == '/' ? '\\' : path[i];
 
-    // If the filesystem is Unicode, MAX_PATH is 32,767.  If the buffer
-    // isn't big enough, 'DeviceIoControl' will fail.
-    char rdbbuf[sizeof(_REPARSE_DATA_BUFFER) + MAX_PATH*2];
-    DWORD sz;
-    
-    int s = DeviceIoControl(handle, FSCTL_GET_REPARSE_POINT,
-                            0, 0, rdbbuf, sizeof(rdbbuf), &sz, 0);
-    CloseHandle(handle);
+    // the root, which '..' can't remove: "\\?\", "X:\", "\\server\share\"
+    // or "\"; or none
+    char *p = tmp;
+    if (!strncmp(p, "\\\\?\\", 4)) {
+        p += 4;
+        if (!strncmp(p, "UNC\\", 4)) {
+            p += 2;
+            p[0] = p[1] = '\\';
+        }
+    }
+    size_t rootLen = 0;
+    if (isalpha((unsigned char)p[0]) && p[1] == ':')
+        rootLen = p[2] == '\\' ? 3 : 2;
+    else if (p[0] == '\\' && p[1] == '\\') {
+        const char *share = strchr(p + 2, '\\');
+        const char *end = share ? strchr(share + 1, '\\') : 0;
+        rootLen = end ? (size_t)(end - p) + 1 : strlen(p);
+    } else if (p[0] == '\\')
+        rootLen = 1;
 
-    if (!s) {
-        setErrno("readlink");
-        if (debug)
-            fprintf(stderr, "can't get reparse info for %s: %s\n", 
-                    path, strerror(errno));
-        return -1;
-    }
-
-    _REPARSE_DATA_BUFFER *rdb = (_REPARSE_DATA_BUFFER*)rdbbuf;
-    
-    wchar_t *buffer;
-    size_t offset, len;
-    switch (rdb->ReparseTag)
-    {
-      case IO_REPARSE_TAG_MOUNT_POINT:
-        buffer = rdb->MountPointReparseBuffer.PathBuffer;
-        offset = rdb->MountPointReparseBuffer.PrintNameOffset;
-        len = rdb->MountPointReparseBuffer.PrintNameLength;
-        break;
-      case IO_REPARSE_TAG_SYMLINK:
-        buffer = rdb->SymbolicLinkReparseBuffer.PathBuffer;
-        offset = rdb->SymbolicLinkReparseBuffer.PrintNameOffset;
-        len = rdb->SymbolicLinkReparseBuffer.PrintNameLength;
-        // Note: iff rdb->SymbolicLinkReparseBuffer.Flags & SYMLINK_FLAG_RELATIVE
-        //       -> resulting path is relative to the source
-        break;
-      default:
-        errno = EINVAL;
-        if (debug)
-            fprintf(stderr, "invalid reparse tag for %s\n", path);
+    size_t out = 0;
+    if (rootLen + 1 > bufsiz) goto range;
+    memcpy(buf, p, rootLen);
+    out = rootLen;
+
+    const char *c = p + rootLen;
+    while (*c) {
+        const char *end = strchr(c, '\\');
+        size_t len = end ? (size_t)(end - c) : strlen(c);
+        bool keep = len && !(len == 1 && c[0] == '.');
+
+        if (len == 2 && c[0] == '.' && c[1] == '.') {
+            size_t last = out;      // where the last component starts
+            while (last > rootLen && buf[last-1] != '\\') last--;
+            bool lastIsDots = out - last == 2 && buf[last] == '.'
+                && buf[last+1] == '.';
+
+            if (out > rootLen && !lastIsDots) {
+                out = last > rootLen ? last - 1 : rootLen;
+                keep = false;
+            } else if (rootLen) {
+                keep = false;       // above the root
+            }
+        }
+
+        if (keep) {
+            if (out > rootLen) {
+                if (out + 1 >= bufsiz) goto range;
+                buf[out++] = '\\';
+            }
+            if (out + len >= bufsiz) goto range;
+            memcpy(buf + out, c, len);
+            out += len;
+        }
+        c += len + (end != 0);
+    }
+
+    if (!out) {
+        if (bufsiz < 2) goto range;
+        buf[out++] = '.';
+    }
+    buf[out] = 0;
+    return out;
+
+ range:
+    errno = ERANGE;
+    return -1;
+}
+
+/* Joins a link's target to the link's directory, if it's relative, and
+   normalizes the result.
+*/
+static ssize_t joinTarget(const char *linkpath, const char *target,
+                          unsigned flags, char *buf, size_t bufsiz)
+{
+    char joined[PATH_MAX*2];
+    size_t n;
+
+    if (!(flags & LINK_RELATIVE)) {
+        n = snprintf(joined, sizeof(joined), "%s", target);
+    } else if (target[0] == '\\' || target[0] == '/') {
+        // rooted, on the link's drive
+        bool drive = isalpha((unsigned char)linkpath[0]) && linkpath[1] == ':';
+        n = snprintf(joined, sizeof(joined), "%.*s%s", drive ? 2 : 0,
+                     linkpath, target);
+    } else {
+        const char *sep = strrchr(linkpath, '\\');
+        const char *slash = strrchr(linkpath, '/');
+        if (!sep || (slash && slash > sep)) sep = slash;
+        if (!sep && isalpha((unsigned char)linkpath[0]) && linkpath[1] == ':')
+            sep = linkpath + 1;     // "X:link"
+        n = !sep ? snprintf(joined, sizeof(joined), "%s", target)
+            : *sep == ':' ? snprintf(joined, sizeof(joined), "%.2s%s",
+                                     linkpath, target)
+            : snprintf(joined, sizeof(joined), "%.*s\\%s",
+                       (int)(sep - linkpath), linkpath, target);
+    }
+    if (n >= sizeof(joined)) {
+        errno = ERANGE;
         return -1;
     }
+    return normalizePath(joined, buf, bufsiz);
+}
 
-    len /= sizeof(wchar_t);
-    offset /= sizeof(wchar_t);
+ssize_t resolve_link_target(const char *linkpath, char *buf, size_t bufsiz,
+                            int follow)
+{
+    char path[PATH_MAX*2], target[PATH_MAX*2];
+    char rdb[REPARSE_MAX_BUFFER];
+    struct reparse_link link;
 
-    // Convert to ASCII
-    int i;
-    for (i=0; i < min(len, bufsiz-1); i++)
-        wctomb(&buf[i], buffer[offset++]);
+    DIAG(DIAG_TRACE, DIAG_SYMLINK, "resolve_link_target %s", linkpath);
 
-    buf[i++] = 0;
+    if (snprintf(path, sizeof(path), "%s", linkpath) >= (int)sizeof(path)) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    // one reparse read per hop; Windows itself stops at 63
+    for (int hops=0; ; hops++) {
+        if (readReparse(path, rdb, &link)) {
+            // the end of the chain: not a link, or not there at all
+            if ((errno == EINVAL || errno == ENOENT || errno == ENOTDIR)
+                && follow && hops)
+                break;
+            if (errno == EINVAL && follow)
+                return normalizePath(path, buf, bufsiz);
+            return -1;
+        }
+        if (hops == 63) {
+            errno = ELOOP;
+            return -1;
+        }
+
+        int n = targetText(&link, target, sizeof(target) - 1);
+        if (n < 0) return -1;
+        target[n] = 0;
+
+        unsigned flags = link.tag == REPARSE_TAG_SYMLINK
+            && (link.flags & REPARSE_SYMLINK_RELATIVE) ? LINK_RELATIVE : 0;
+        if (joinTarget(path, target, flags, path, sizeof(path)) < 0)
+            return -1;
+        if (!follow) break;
+    }
 
-    return i;
+    size_t n = strlen(path);
+    if (n >= bufsiz) {
+        errno = ERANGE;
+        return -1;
+    }
+    memcpy(buf, path, n + 1);
+    return n;
 }
 
 /* Returns:
    -1 : failed
    0 : not a sym link
-   1 : is a sym link
+   1 : is a sym link (ISLINK_SYMLINK)
+   2 : is a junction (ISLINK_JUNCTION)
+
+   Most paths aren't reparse points, and GetFileAttributesEx says so
+   without opening anything.  Only for reparse points is the tag read,
+   with the lightest directory query.
 */
 int isSymLink(const char *path)
 {
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fa)) {
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't get attributes for %s: %s",
+             path, strerror(errno));
+        return -1;
+    }
+
+    if (!(fa.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        return 0;
+
     WIN32_FIND_DATAA wd;
-    HANDLE h = FindFirstFile(path, &wd);
+    HANDLE h = FindFirstFileExA(path, FindExInfoBasic, &wd,
+                                FindExSearchNameMatch, 0, 0);
+    if (h == INVALID_HANDLE_VALUE) {
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't get reparse tag for %s: %s",
+             path, strerror(errno));
+        return -1;
+    }
+
+    FindClose(h);
+
+    switch (wd.dwReserved0) {
+      case IO_REPARSE_TAG_SYMLINK:      return ISLINK_SYMLINK;
+      case IO_REPARSE_TAG_MOUNT_POINT:  return ISLINK_JUNCTION;
+      default:                          return 0;
+    }
+}
+
+// FileIdInfo (Windows 8 and later) gives the 128-bit file IDs used by
+// ReFS; older headers don't define it.
+#define FILE_ID_INFO_CLASS ((FILE_INFO_BY_HANDLE_CLASS)18)
+
+typedef struct {
+    ULONGLONG VolumeSerialNumber;
+    BYTE FileId[16];
+} _FILE_ID_INFO;
+
+static HANDLE openForQuery(const char *path, bool follow)
+{
+    return CreateFileA(path, FILE_READ_ATTRIBUTES,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS
+                       | (follow ? 0 : FILE_FLAG_OPEN_REPARSE_POINT), 0);
+}
+
+static BOOL queryFileId(HANDLE h, struct file_id *id)
+{
+    _FILE_ID_INFO fii;
+    if (GetFileInformationByHandleEx(h, FILE_ID_INFO_CLASS, &fii,
+                                     sizeof(fii))) {
+        id->volume = fii.VolumeSerialNumber;
+        memcpy(id->id, fii.FileId, sizeof(id->id));
+        return TRUE;
+    }
+
+    // Before Windows 8: 32-bit volume serial number and 64-bit file index
+    BY_HANDLE_FILE_INFORMATION fi;
+    if (!GetFileInformationByHandle(h, &fi))
+        return FALSE;
+
+    ULONGLONG index = (ULONGLONG)fi.nFileIndexHigh << 32 | fi.nFileIndexLow;
+    id->volume = fi.dwVolumeSerialNumber;
+    memset(id->id, 0, sizeof(id->id));
+    memcpy(id->id, &index, sizeof(index));
+    return TRUE;
+}
+
+int file_id(const char *path, struct file_id *id)
+{
+    HANDLE h = openForQuery(path, true);
     if (h == INVALID_HANDLE_VALUE) {
-        setErrno("isSymLink");
-        if (debug)
-            fprintf(stderr, "can't get handle for %s: %s\n", 
-                    path, strerror(errno));
+        win32_set_errno();
         return -1;
     }
 
+    BOOL ok = queryFileId(h, id);
+    if (!ok) win32_set_errno();
     CloseHandle(h);
 
-    return ((wd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) 
-            && (wd.dwReserved0 == IO_REPARSE_TAG_SYMLINK)) ? 1:0;
+    return ok ? 0 : -1;
+}
+
+int same_file(const char *a, const char *b)
+{
+    struct file_id ida, idb;
+
+    if (file_id(a, &ida) || file_id(b, &idb))
+        return -1;
+
+    return ida.volume == idb.volume && !memcmp(ida.id, idb.id, sizeof(ida.id));
+}
+
+/* Every name of the file 'path' (its hard links), as absolute paths.
+   https://docs.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-findfirstfilenamew
+
+   With no buffer, only the link count is fetched, with one handle query.
+*/
+int link_names(const char *path, char *buf, size_t bufsiz, size_t *needed)
+{
+    bool countOnly = !buf || !bufsiz;
+
+    // the count alone needs no enumeration; '*needed' does
+    if (countOnly && !needed) {
+        HANDLE h = openForQuery(path, true);
+        if (h == INVALID_HANDLE_VALUE) {
+            win32_set_errno();
+            return -1;
+        }
+
+        BY_HANDLE_FILE_INFORMATION fi;
+        BOOL ok = GetFileInformationByHandle(h, &fi);
+        if (!ok) win32_set_errno();
+        CloseHandle(h);
+
+        return ok ? (int)fi.nNumberOfLinks : -1;
+    }
+
+    WCHAR wpath[MAX_PATH], root[MAX_PATH];
+    if (!MultiByteToWideChar(CP_ACP, 0, path, -1, wpath, MAX_PATH)
+        || !GetVolumePathNameW(wpath, root, MAX_PATH)) {
+        win32_set_errno();
+        return -1;
+    }
+
+    // names come back as "\dir\file"; drop the root's trailing backslash
+    size_t rootLen = wcslen(root);
+    if (rootLen && root[rootLen-1] == L'\\') root[--rootLen] = 0;
+
+    // "C:" + a name of up to 32767 characters
+    DWORD nameSize = 32768;
+    WCHAR *name = malloc((rootLen + nameSize)*sizeof(WCHAR));
+    if (!name) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(name, root, rootLen*sizeof(WCHAR));
+
+    DWORD len = nameSize;
+    HANDLE h = FindFirstFileNameW(wpath, 0, &len, name + rootLen);
+    if (h == INVALID_HANDLE_VALUE) {
+        win32_set_errno();
+        free(name);
+        return -1;
+    }
+
+    int count = 0;
+    size_t total = 1;       // the final null
+    do {
+        int n = WideCharToMultiByte(CP_ACP, 0, name, -1, 0, 0, 0, 0);
+        if (n > 0 && !countOnly && total + n <= bufsiz)
+            WideCharToMultiByte(CP_ACP, 0, name, -1, buf + total-1, n, 0, 0);
+        total += n;
+        count++;
+        len = nameSize;
+    } while (FindNextFileNameW(h, &len, name + rootLen));
+
+    DWORD err = GetLastError();
+    FindClose(h);
+    free(name);
+
+    if (err != ERROR_HANDLE_EOF) {
+        SetLastError(err);
+        win32_set_errno();
+        return -1;
+    }
+
+    if (needed) *needed = total;
+    if (countOnly) return count;
+    if (total > bufsiz) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    buf[total-1] = 0;
+    return count;
+}
+
+/* Number of 100ns-seconds between the beginning of the Windows epoch
+ * (Jan. 1, 1601) and the Unix epoch (Jan. 1, 1970)
+ */
+#define DELTA_EPOCH_IN_100NS    116444736000000000LL
+
+#define POW10_7                 10000000
+
+static void fileTimeToTimespec(const FILETIME *ft, struct timespec *ts)
+{
+    long long t = ((long long)ft->dwHighDateTime << 32 | ft->dwLowDateTime)
+        - DELTA_EPOCH_IN_100NS;
+    long long sec = t / POW10_7, rem = t % POW10_7;
+
+    if (rem < 0) {      // before 1970: keep tv_nsec positive
+        sec--;
+        rem += POW10_7;
+    }
+    ts->tv_sec = sec;
+    ts->tv_nsec = rem * 100;
+}
+
+static void timespecToFileTime(const struct timespec *ts, FILETIME *ft)
+{
+    long long t = (long long)ts->tv_sec * POW10_7 + ts->tv_nsec / 100
+        + DELTA_EPOCH_IN_100NS;
+
+    ft->dwLowDateTime = (DWORD)t;
+    ft->dwHighDateTime = (DWORD)(t >> 32);
 }
 
 /*
   https://docs.microsoft.com/en-us/cpp/c-runtime-library/reference/stat-functions?view=msvc-160
 
   "_stat does work correctly with symbolic links."
+
+  lstat(), lstat_tim() and lstat64() all fill a struct stat64.  One handle
+  query on the link itself supplies the file ID, link count and (for
+  lstat_tim) the timestamps at the full 100 ns resolution of FILETIME; the
+  rest comes from _stat64.
 */
-int lstat(const char *path, struct stat *buf)
+static int lstatQuery(const char *path, struct stat64 *buf,
+                      struct stat_tim *tim)
 {
     struct  _stat64 st;
+    bool timed = false;
+
+    DIAG(DIAG_TRACE, DIAG_SYMLINK, "lstat %s", path);
 
     int s = _stat64(path, &st); // sets errno on failure
 
@@ -275,11 +821,52 @@ int lstat(const char *path, struct stat *buf)
     buf->st_uid = st.st_uid;
     buf->st_gid = st.st_gid;
     buf->st_rdev = st.st_rdev;
-    buf->st_size = (_off_t) st.st_size;
+    buf->st_size = st.st_size;
     buf->st_atime = st.st_atime;
     buf->st_mtime = st.st_mtime;
     buf->st_ctime = st.st_ctime;
 
+    // _stat64 leaves st_ino 0, sets st_dev to the drive number, doesn't
+    // reliably count hard links, and takes a link's times from its
+    // target.  Use the volume serial number, file ID, link count and
+    // times of the link itself, so lstat() and lstat_tim() agree; _ino_t
+    // is only 16 bits, so st_ino holds the low bits of the ID.  Use
+    // file_id() or same_file() to compare files reliably.
+    if (!s) {
+        HANDLE h = openForQuery(path, false);
+        if (h != INVALID_HANDLE_VALUE) {
+            BY_HANDLE_FILE_INFORMATION fi;
+            if (GetFileInformationByHandle(h, &fi)) {
+                buf->st_dev = fi.dwVolumeSerialNumber;
+                buf->st_ino = (_ino_t)fi.nFileIndexLow;
+                buf->st_nlink = min(fi.nNumberOfLinks, (DWORD)SHRT_MAX);
+
+                struct stat_tim t;
+                fileTimeToTimespec(&fi.ftLastAccessTime, &t.st_atim);
+                fileTimeToTimespec(&fi.ftLastWriteTime, &t.st_mtim);
+                // st_ctime from _stat64 is the creation time
+                fileTimeToTimespec(&fi.ftCreationTime, &t.st_ctim);
+                buf->st_atime = t.st_atim.tv_sec;
+                buf->st_mtime = t.st_mtim.tv_sec;
+                buf->st_ctime = t.st_ctim.tv_sec;
+                if (tim) {
+                    *tim = t;
+                    timed = true;
+                }
+            }
+            CloseHandle(h);
+        }
+    }
+
+    if (tim && !timed) {    // fall back to whole seconds
+        tim->st_atim.tv_sec = buf->st_atime;
+        tim->st_mtim.tv_sec = buf->st_mtime;
+        tim->st_ctim.tv_sec = buf->st_ctime;
+        tim->st_atim.tv_nsec = tim->st_mtim.tv_nsec = tim->st_ctim.tv_nsec = 0;
+    }
+
+    // junctions report as links too, as they do with Cygwin; st_link
+    // tells them apart
     int is = isSymLink(path);
     if (is > 0) {
         buf->st_mode |= S_IFLNK;
@@ -288,40 +875,539 @@ int lstat(const char *path, struct stat *buf)
     } else if (is < 0) {
         return -1;
     }
+    if (tim) tim->st_link = is;
 
     return s;
 }
 
-int symlink(const char *oldpath, const char *newpath)
+// the stamp, from the handle query that also gives what it can't cover
+static bool lstatStamp(const char *path, BY_HANDLE_FILE_INFORMATION *fi,
+                       struct metacache_stamp *st)
 {
-    DWORD dwflags = SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE;
-    struct stat statbuf;
-        
-    int s = stat(oldpath, &statbuf);
-    if (s) return s;
+    HANDLE h = openForQuery(path, false);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
 
-    if (S_ISDIR(statbuf.st_mode))
-        dwflags |= SYMBOLIC_LINK_FLAG_DIRECTORY;
+    BOOL ok = GetFileInformationByHandle(h, fi);
+    CloseHandle(h);
+    if (!ok) return false;
 
-    s = CreateSymbolicLinkA(newpath, oldpath, dwflags);
+    st->attrs = fi->dwFileAttributes;
+    st->size = (unsigned long long)fi->nFileSizeHigh << 32
+        | fi->nFileSizeLow;
+    st->ctime = (unsigned long long)fi->ftCreationTime.dwHighDateTime << 32
+        | fi->ftCreationTime.dwLowDateTime;
+    st->mtime = (unsigned long long)fi->ftLastWriteTime.dwHighDateTime << 32
+        | fi->ftLastWriteTime.dwLowDateTime;
+    return true;
+}
 
-    if (s)
-        return 0;
-    else {
-        setErrno("symlink");
-        if (debug)
-            fprintf(stderr, "can't set soft link from %s to %s: %s\n", 
-                    newpath, oldpath, strerror(errno));
-        return -1;
+// Entries hold the full-resolution times, for lstat_tim().  Creating a
+// hard link, or replacing a file with another of the same size and times,
+// changes nothing in the stamp, so the file ID, link count and access time
+// are always taken from the file.  Links aren't cached, as some of what
+// lstat() reports for them comes from the target, which their stamp
+// doesn't cover.
+static int cachedLstat(const char *path, struct stat64 *buf,
+                       struct stat_tim *tim)
+{
+    BY_HANDLE_FILE_INFORMATION fi;
+    struct metacache_stamp st;
+    struct {
+        struct stat64 st;
+        struct stat_tim tim;
+    } v;
+    char key[PATH_MAX];
+
+    bool stamped = cacheKey(path, key, sizeof(key))
+        && lstatStamp(path, &fi, &st)
+        && !(st.attrs & FILE_ATTRIBUTE_REPARSE_POINT);
+    int s = 0;
+    if (stamped && metacache_get(METACACHE_LSTAT, key, &st, &v, sizeof(v))
+                   == sizeof(v)) {
+        v.st.st_dev = fi.dwVolumeSerialNumber;
+        v.st.st_ino = (_ino_t)fi.nFileIndexLow;
+        v.st.st_nlink = min(fi.nNumberOfLinks, (DWORD)SHRT_MAX);
+        fileTimeToTimespec(&fi.ftLastAccessTime, &v.tim.st_atim);
+        v.st.st_atime = v.tim.st_atim.tv_sec;
+    } else {
+        s = lstatQuery(path, &v.st, &v.tim);
+        if (!s && stamped)
+            metacache_put(METACACHE_LSTAT, key, &st, &v, sizeof(v));
     }
+
+    *buf = v.st;
+    if (tim) *tim = v.tim;
+    return s;
 }
 
-// hard link
-// https://docs.microsoft.com/en-us/windows/win32/fileio/hard-links-and-junctions
-int link(const char *oldpath, const char *newpath)
+static int lstatImpl(const char *path, struct stat64 *buf, struct stat_tim *tim)
 {
-    struct stat statbuf;
-        
+    unsigned calls = fsCalls;
+    unsigned long long t = symstats_begin();
+
+    int s = metacache_active ? cachedLstat(path, buf, tim)
+                             : lstatQuery(path, buf, tim);
+
+    symstats_end(SYMSTATS_LSTAT, t, fsCalls - calls, s != 0);
+    return s;
+}
+
+static void stat64ToStat(const struct stat64 *st, struct stat *buf)
+{
+    buf->st_dev = st->st_dev;
+    buf->st_ino = st->st_ino;
+    buf->st_mode = st->st_mode;
+    buf->st_nlink = st->st_nlink;
+    buf->st_uid = st->st_uid;
+    buf->st_gid = st->st_gid;
+    buf->st_rdev = st->st_rdev;
+    buf->st_size = (_off_t) st->st_size;    // truncated over 2 GiB
+    buf->st_atime = st->st_atime;
+    buf->st_mtime = st->st_mtime;
+    buf->st_ctime = st->st_ctime;
+}
+
+int lstat(const char *path, struct stat *buf)
+{
+    struct stat64 st;
+
+    int s = lstatImpl(path, &st, 0);
+    stat64ToStat(&st, buf);
+    return s;
+}
+
+int lstat_tim(const char *path, struct stat *buf, struct stat_tim *tim)
+{
+    struct stat64 st;
+
+    int s = lstatImpl(path, &st, tim);
+    stat64ToStat(&st, buf);
+    return s;
+}
+
+int lstat64(const char *path, struct stat64 *buf)
+{
+    return lstatImpl(path, buf, 0);
+}
+
+int utimensat(int dirfd, const char *path, const struct timespec times[2],
+              int flags)
+{
+    if (dirfd != AT_FDCWD) {
+        errno = ENOTSUP;    // no directory descriptors here
+        return -1;
+    }
+    if (flags & ~AT_SYMLINK_NOFOLLOW) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    FILETIME ft[2], now;
+    const FILETIME *pft[2];
+
+    GetSystemTimeAsFileTime(&now);
+    for (int i=0; i < 2; i++) {
+        if (!times || times[i].tv_nsec == UTIME_NOW) {
+            pft[i] = &now;
+        } else if (times[i].tv_nsec == UTIME_OMIT) {
+            pft[i] = 0;
+        } else if (times[i].tv_nsec < 0 || times[i].tv_nsec >= 1000000000) {
+            errno = EINVAL;
+            return -1;
+        } else {
+            timespecToFileTime(&times[i], &ft[i]);
+            pft[i] = &ft[i];
+        }
+    }
+
+    if (!pft[0] && !pft[1]) return 0;
+
+    HANDLE h = CreateFileA(path, FILE_WRITE_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE
+                           | FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+                           FILE_FLAG_BACKUP_SEMANTICS
+                           | ((flags & AT_SYMLINK_NOFOLLOW)
+                              ? FILE_FLAG_OPEN_REPARSE_POINT : 0), 0);
+    if (h == INVALID_HANDLE_VALUE) {
+        win32_set_errno();
+        return -1;
+    }
+
+    BOOL ok = SetFileTime(h, 0, pft[0], pft[1]);
+    if (!ok) win32_set_errno();
+    CloseHandle(h);
+
+    return ok ? 0 : -1;
+}
+
+/* symlink() fallback support.
+
+   Without SeCreateSymbolicLinkPrivilege (or Developer Mode),
+   CreateSymbolicLinkA fails every time, after a fairly expensive call.
+   symlink_probe() checks once per process whether links can be created;
+   when they can't, symlink() goes straight to the fallback policy set
+   with symlink_set_fallback(), or with no policy fails with EPERM at
+   once.  Whatever fallback works is remembered per volume, so later
+   calls for the same volume don't retry the ones that failed.
+*/
+enum linkStrategy {
+    STRATEGY_UNKNOWN = 0,
+    STRATEGY_SYMLINK,
+    STRATEGY_JUNCTION,
+    STRATEGY_HARDLINK,
+    STRATEGY_COPY
+};
+
+#define MAX_VOLUMES 32
+
+struct volumeStrategy {
+    char root[MAX_PATH];
+    unsigned char dir;      // enum linkStrategy, for links to directories
+    unsigned char file;     // enum linkStrategy, for links to files
+};
+
+static struct volumeStrategy volumes[MAX_VOLUMES];
+static int nVolumes;
+static SRWLOCK volumeLock = SRWLOCK_INIT;
+
+static volatile LONG fallbackPolicy = SYMLINK_FALLBACK_NONE;
+static volatile LONG symlinkCapability = -1;    // -1: not probed yet
+
+void symlink_set_fallback(unsigned policy)
+{
+    InterlockedExchange(&fallbackPolicy, policy & SYMLINK_FALLBACK_ALL);
+}
+
+int symlink_probe(void)
+{
+    LONG cap = symlinkCapability;
+    if (cap >= 0) return cap;
+
+    char dir[MAX_PATH], target[MAX_PATH], lnk[MAX_PATH];
+
+    // If the probe can't run, assume links work; symlink() will find out.
+    cap = 1;
+    DWORD s = GetTempPathA(sizeof(dir), dir);
+    if (s && s < sizeof(dir) && GetTempFileNameA(dir, "sl", 0, target)) {
+        int n = snprintf(lnk, sizeof(lnk), "%s.lnk", target);
+        if (n >= 0 && (size_t)n < sizeof(lnk)) {
+            if (CreateSymbolicLinkA(lnk, target,
+                            SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE))
+                DeleteFileA(lnk);
+            else if (GetLastError() == ERROR_PRIVILEGE_NOT_HELD)
+                cap = 0;
+        }
+        DeleteFileA(target);
+    }
+
+    DIAG(DIAG_INFO, DIAG_SYMLINK, "symbolic links %s",
+         cap ? "can be created" : "can't be created; using fallbacks");
+    InterlockedExchange(&symlinkCapability, cap);
+    return cap;
+}
+
+static int getStrategy(const char *root, bool isDir)
+{
+    int strategy = STRATEGY_UNKNOWN;
+
+    AcquireSRWLockShared(&volumeLock);
+    for (int i=0; i < nVolumes; i++) {
+        if (!_stricmp(volumes[i].root, root)) {
+            strategy = isDir ? volumes[i].dir : volumes[i].file;
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&volumeLock);
+
+    return strategy;
+}
+
+static void setStrategy(const char *root, bool isDir, int strategy)
+{
+    AcquireSRWLockExclusive(&volumeLock);
+
+    int i;
+    for (i=0; i < nVolumes; i++)
+        if (!_stricmp(volumes[i].root, root)) break;
+
+    if (i == nVolumes) {
+        if (nVolumes == MAX_VOLUMES) {  // table full; just don't remember
+            ReleaseSRWLockExclusive(&volumeLock);
+            return;
+        }
+        strcpy(volumes[i].root, root);
+        volumes[i].dir = volumes[i].file = STRATEGY_UNKNOWN;
+        nVolumes++;
+    }
+
+    if (isDir)
+        volumes[i].dir = strategy;
+    else
+        volumes[i].file = strategy;
+
+    ReleaseSRWLockExclusive(&volumeLock);
+}
+
+/* Sets the reparse point 'rdb' on the existing 'path'.  If 'path' is
+   already a link of the same kind, this replaces its target in place.
+*/
+static BOOL writeReparse(const char *path, const void *rdb, size_t len)
+{
+    HANDLE h = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ
+                           | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                           OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT
+                           | FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if (h == INVALID_HANDLE_VALUE) return FALSE;
+
+    DWORD sz;
+    BOOL ok = DeviceIoControl(h, FSCTL_SET_REPARSE_POINT, (void*)rdb, len,
+                              0, 0, &sz, 0);
+    DWORD err = GetLastError();
+    CloseHandle(h);
+    SetLastError(err);
+    return ok;
+}
+
+// Create a directory junction (mount point) at 'linkpath'.  Unlike
+// symbolic links, junctions need no privilege, but the target must be
+// an absolute local path.
+static BOOL createJunction(const char *target, const char *linkpath)
+{
+    char full[MAX_PATH];
+    DWORD s = GetFullPathNameA(target, sizeof(full), full, 0);
+    if (!s || s >= sizeof(full)) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return FALSE;
+    }
+
+    WCHAR wfull[MAX_PATH];
+    int len = MultiByteToWideChar(CP_ACP, 0, full, -1, wfull, MAX_PATH);
+    if (!len) return FALSE;
+
+    // WCHAR-aligned, as DeviceIoControl expects
+    WCHAR rdb[(MAX_PATH*2 + 32)];
+    size_t rdbLen = reparse_encode_junction((uint16_t*)wfull, len-1,
+                                            rdb, sizeof(rdb));
+    if (!rdbLen) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return FALSE;
+    }
+
+    if (!CreateDirectoryA(linkpath, 0)) return FALSE;
+
+    BOOL ok = writeReparse(linkpath, rdb, rdbLen);
+    if (!ok) {
+        DWORD err = GetLastError();
+        RemoveDirectoryA(linkpath);
+        SetLastError(err);
+    }
+    return ok;
+}
+
+int junction_create(const char *target, const char *linkpath)
+{
+    struct stat statbuf;
+
+    int s = stat(target, &statbuf);
+    if (s) return s;
+
+    if (!S_ISDIR(statbuf.st_mode)) {
+        errno = ENOTDIR;    // junctions can only point to directories
+        return -1;
+    }
+
+    if (createJunction(target, linkpath))
+        return 0;
+
+    win32_set_errno();
+    DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't create junction from %s to %s: %s",
+         linkpath, target, strerror(errno));
+    return -1;
+}
+
+int junction_remove(const char *linkpath)
+{
+    int is = isSymLink(linkpath);
+    if (is < 0) return -1;
+    if (is != ISLINK_JUNCTION) {
+        errno = EINVAL;     // won't remove a real directory
+        return -1;
+    }
+
+    // Removing the directory removes the mount point with it; the
+    // target is untouched.
+    if (RemoveDirectoryA(linkpath))
+        return 0;
+
+    win32_set_errno();
+    DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't remove junction %s: %s",
+         linkpath, strerror(errno));
+    return -1;
+}
+
+static BOOL tryStrategy(int strategy, const char *oldpath, const char *newpath)
+{
+    switch (strategy) {
+      case STRATEGY_JUNCTION: return createJunction(oldpath, newpath);
+      case STRATEGY_HARDLINK: return CreateHardLinkA(newpath, oldpath, 0);
+      case STRATEGY_COPY:     return CopyFileA(oldpath, newpath, TRUE);
+      default:
+        SetLastError(ERROR_PRIVILEGE_NOT_HELD);
+        return FALSE;
+    }
+}
+
+static int symlinkFallback(const char *oldpath, const char *newpath,
+                           bool isDir, const char *root, int cached)
+{
+    // Directories can only become junctions; files try a hard link, which
+    // works only on the same volume, then a copy.
+    static const int dirOrder[] = { STRATEGY_JUNCTION, 0 };
+    static const int fileOrder[] = { STRATEGY_HARDLINK, STRATEGY_COPY, 0 };
+    static const char *strategyName[] = {
+        [STRATEGY_JUNCTION] = "junction",
+        [STRATEGY_HARDLINK] = "hard link",
+        [STRATEGY_COPY] = "copy",
+    };
+    static const unsigned policyBit[] = {
+        [STRATEGY_JUNCTION] = SYMLINK_FALLBACK_JUNCTION,
+        [STRATEGY_HARDLINK] = SYMLINK_FALLBACK_HARDLINK,
+        [STRATEGY_COPY] = SYMLINK_FALLBACK_COPY,
+    };
+    unsigned policy = fallbackPolicy;
+
+    SetLastError(ERROR_PRIVILEGE_NOT_HELD);
+
+    if (cached != STRATEGY_UNKNOWN && cached != STRATEGY_SYMLINK) {
+        if (tryStrategy(cached, oldpath, newpath))
+            return 0;
+    }
+
+    for (const int *o = isDir ? dirOrder : fileOrder; *o; o++) {
+        if (!(policy & policyBit[*o]) || *o == cached) continue;
+
+        if (tryStrategy(*o, oldpath, newpath)) {
+            DIAG(DIAG_INFO, DIAG_SYMLINK, "%s: %s instead of symlink to %s",
+                 newpath, strategyName[*o], oldpath);
+            if (root[0]) setStrategy(root, isDir, *o);
+            return 0;
+        }
+    }
+
+    win32_set_errno();
+    DIAG(DIAG_ERROR, DIAG_SYMLINK, "no symlink fallback from %s to %s: %s",
+         newpath, oldpath, strerror(errno));
+    return -1;
+}
+
+/* A relative 'oldpath' is relative to the link's directory, not to the
+   current one; this is the path the fallbacks, and the test for a
+   directory, must use.
+*/
+static bool isAbsolute(const char *path)
+{
+    return (isalpha((unsigned char)path[0]) && path[1] == ':')
+        || ((path[0] == '\\' || path[0] == '/')
+            && (path[1] == '\\' || path[1] == '/'));
+}
+
+static int targetPath(const char *oldpath, const char *newpath,
+                      char *buf, size_t bufsiz)
+{
+    if (joinTarget(newpath, oldpath, isAbsolute(oldpath) ? 0 : LINK_RELATIVE,
+                   buf, bufsiz) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int symlinkImpl(const char *oldpath, const char *newpath, int *op)
+{
+    DWORD dwflags = SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE;
+    struct stat statbuf;
+    char target[MAX_PATH];
+
+    DIAG(DIAG_TRACE, DIAG_SYMLINK, "symlink %s -> %s", newpath, oldpath);
+
+    if (targetPath(oldpath, newpath, target, sizeof(target)))
+        return -1;
+    int s = stat(target, &statbuf);
+    if (s) return s;
+
+    bool isDir = S_ISDIR(statbuf.st_mode);
+    if (isDir)
+        dwflags |= SYMBOLIC_LINK_FLAG_DIRECTORY;
+
+    char root[MAX_PATH] = "";
+    int strategy = STRATEGY_UNKNOWN;
+    bool fallback = (fallbackPolicy != SYMLINK_FALLBACK_NONE);
+
+    if (fallback) {
+        if (GetVolumePathNameA(newpath, root, sizeof(root)))
+            strategy = getStrategy(root, isDir);
+        else
+            root[0] = 0;
+
+        *op = SYMSTATS_SYMLINK_FALLBACK;
+        if (strategy != STRATEGY_UNKNOWN && strategy != STRATEGY_SYMLINK)
+            return symlinkFallback(target, newpath, isDir, root, strategy);
+        if (!symlink_probe())
+            return symlinkFallback(target, newpath, isDir, root, strategy);
+        *op = SYMSTATS_SYMLINK;
+    } else if (!symlink_probe()) {
+        // fails as CreateSymbolicLinkA would, without the call
+        SetLastError(ERROR_PRIVILEGE_NOT_HELD);
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't set soft link from %s to %s: %s",
+             newpath, oldpath, strerror(errno));
+        return -1;
+    }
+
+    s = CreateSymbolicLinkA(newpath, oldpath, dwflags);
+
+    if (s) {
+        if (fallback && root[0] && strategy == STRATEGY_UNKNOWN)
+            setStrategy(root, isDir, STRATEGY_SYMLINK);
+        return 0;
+    }
+
+    // no privilege, or the filesystem has no reparse points (e.g. FAT)
+    DWORD err = GetLastError();
+    if (fallback && (err == ERROR_PRIVILEGE_NOT_HELD
+                     || err == ERROR_INVALID_FUNCTION
+                     || err == ERROR_NOT_SUPPORTED)) {
+        *op = SYMSTATS_SYMLINK_FALLBACK;
+        return symlinkFallback(target, newpath, isDir, root, STRATEGY_UNKNOWN);
+    }
+
+    win32_set_errno();
+    DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't set soft link from %s to %s: %s",
+         newpath, oldpath, strerror(errno));
+    return -1;
+}
+
+int symlink(const char *oldpath, const char *newpath)
+{
+    int op = SYMSTATS_SYMLINK;
+    unsigned calls = fsCalls;
+    unsigned long long t = symstats_begin();
+
+    int s = symlinkImpl(oldpath, newpath, &op);
+
+    symstats_end(op, t, fsCalls - calls, s != 0);
+    return s;
+}
+
+// hard link
+// https://docs.microsoft.com/en-us/windows/win32/fileio/hard-links-and-junctions
+static int linkImpl(const char *oldpath, const char *newpath)
+{
+    struct stat statbuf;
+
+    DIAG(DIAG_TRACE, DIAG_SYMLINK, "link %s -> %s", newpath, oldpath);
+        
     int s = stat(oldpath, &statbuf);
     if (s) return s;
 
@@ -335,10 +1421,680 @@ int link(const char *oldpath, const char *newpath)
     if (s)
         return 0;
     else {
-        setErrno("link");
-        if (debug)
-            fprintf(stderr, "can't set hard link from %s to %s: %s\n", 
-                    newpath, oldpath, strerror(errno));
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't set hard link from %s to %s: %s",
+             newpath, oldpath, strerror(errno));
+        return -1;
+    }
+}
+
+int link(const char *oldpath, const char *newpath)
+{
+    unsigned calls = fsCalls;
+    unsigned long long t = symstats_begin();
+
+    int s = linkImpl(oldpath, newpath);
+
+    symstats_end(SYMSTATS_LINK, t, fsCalls - calls, s != 0);
+    return s;
+}
+
+/* FileRenameInfoEx (Windows 10 1607 and later) lets a rename replace the
+   target with POSIX semantics: the old name keeps resolving to the old file
+   until the new one takes its place.  Older headers don't define it.
+*/
+#define RENAME_INFO_EX_CLASS ((FILE_INFO_BY_HANDLE_CLASS)22)
+
+#ifndef FILE_RENAME_FLAG_REPLACE_IF_EXISTS
+#define FILE_RENAME_FLAG_REPLACE_IF_EXISTS  0x00000001
+#define FILE_RENAME_FLAG_POSIX_SEMANTICS    0x00000002
+#endif
+
+typedef struct {
+    DWORD  Flags;           // union with BOOLEAN ReplaceIfExists
+    HANDLE RootDirectory;
+    DWORD  FileNameLength;
+    WCHAR  FileName[1];
+} _FILE_RENAME_INFO_EX;
+
+// Rename the file open as 'h' to 'newpath'.  The name must be an NT path,
+// "\??\C:\dir\name" or "\??\UNC\server\share\name".
+static BOOL renameByHandle(HANDLE h, const char *newpath, DWORD flags)
+{
+    char full[MAX_PATH];
+    DWORD s = GetFullPathNameA(newpath, sizeof(full), full, 0);
+    if (!s || s >= sizeof(full)) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return FALSE;
+    }
+
+    char buf[sizeof(_FILE_RENAME_INFO_EX) + (MAX_PATH+8)*sizeof(WCHAR)];
+    memset(buf, 0, sizeof(buf));
+    _FILE_RENAME_INFO_EX *ri = (_FILE_RENAME_INFO_EX*)buf;
+
+    const char *name = full;
+    int prefix = 4;
+    memcpy(ri->FileName, L"\\??\\", prefix*sizeof(WCHAR));
+    if (!memcmp(full, "\\\\", 2)) {
+        memcpy(ri->FileName+prefix, L"UNC", 3*sizeof(WCHAR));
+        prefix += 3;
+        name++;     // keep one backslash before the server name
+    }
+
+    int len = MultiByteToWideChar(CP_ACP, 0, name, -1,
+                                  ri->FileName+prefix, MAX_PATH+1);
+    if (!len) return FALSE;
+
+    ri->Flags = flags;
+    ri->RootDirectory = 0;
+    ri->FileNameLength = (prefix + len - 1)*sizeof(WCHAR);
+
+    return SetFileInformationByHandle(h, RENAME_INFO_EX_CLASS, ri,
+                                      sizeof(buf));
+}
+
+// Rename 'from' to 'to', atomically, replacing 'to' only if 'replace'.
+// Returns FALSE with the last error set on failure.
+static BOOL renameAtomic(const char *from, const char *to, bool replace)
+{
+    DWORD flags = replace ? FILE_RENAME_FLAG_REPLACE_IF_EXISTS : 0;
+
+    HANDLE h = CreateFileA(from, DELETE | SYNCHRONIZE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE
+                           | FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+                           FILE_FLAG_OPEN_REPARSE_POINT
+                           | FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if (h == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    BOOL ok = renameByHandle(h, to, flags | FILE_RENAME_FLAG_POSIX_SEMANTICS);
+    if (!ok && GetLastError() == ERROR_NOT_SUPPORTED) {
+        // filesystem without POSIX semantics, e.g. FAT or SMB
+        ok = renameByHandle(h, to, flags);
+    }
+    DWORD err = GetLastError();
+    CloseHandle(h);
+
+    if (ok) return TRUE;
+    if (err != ERROR_INVALID_PARAMETER) {
+        SetLastError(err);
+        return FALSE;
+    }
+
+    // FileRenameInfoEx not available
+    return MoveFileExA(from, to, replace ? MOVEFILE_REPLACE_EXISTING : 0);
+}
+
+int link_remove(const char *path)
+{
+    DWORD attr = GetFileAttributesA(path);
+
+    // directory symlinks and junctions are removed as directories
+    BOOL ok = (attr != INVALID_FILE_ATTRIBUTES
+               && (attr & FILE_ATTRIBUTE_DIRECTORY))
+        ? RemoveDirectoryA(path) : DeleteFileA(path);
+    if (!ok) win32_set_errno();
+    return ok ? 0 : -1;
+}
+
+static int tempName(char *tmp, size_t len, const char *path)
+{
+    static volatile LONG counter;
+
+    int n = snprintf(tmp, len, "%s.tmp%lu.%ld", path,
+                     GetCurrentProcessId(), InterlockedIncrement(&counter));
+    if (n < 0 || (size_t)n >= len) {
+        errno = ENAMETOOLONG;
         return -1;
     }
+    return 0;
+}
+
+/* A link to a directory is itself a directory, and no rename replaces a
+   directory: FileRenameInfoEx and MoveFileEx both refuse.  Instead its
+   reparse point is rewritten in place, one FSCTL_SET_REPARSE_POINT that
+   swaps the old target for the new.  The new target must be a directory,
+   and the link keeps its kind; a junction's target is made absolute.
+*/
+static int repointDirLink(const char *target, const char *linkpath)
+{
+    // WCHAR-aligned, as DeviceIoControl expects
+    WCHAR rdb[REPARSE_MAX_BUFFER/2];
+    struct reparse_link link;
+    if (readReparse(linkpath, rdb, &link)) return -1;
+    uint32_t tag = link.tag;
+
+    char full[MAX_PATH], text[MAX_PATH];
+    struct stat st;
+    if (targetPath(target, linkpath, full, sizeof(full))) return -1;
+    if (stat(full, &st)) return -1;
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;    // a directory link can't become a file link
+        return -1;
+    }
+
+    bool relative = tag == REPARSE_TAG_SYMLINK && !isAbsolute(target);
+    if (relative) {
+        snprintf(text, sizeof(text), "%s", target);
+        for (char *p = text; *p; p++) if (*p == '/') *p = '\\';
+    } else {
+        DWORD n = GetFullPathNameA(full, sizeof(text), text, 0);
+        if (!n || n >= sizeof(text)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+    }
+
+    WCHAR wtarget[MAX_PATH];
+    int len = MultiByteToWideChar(CP_ACP, 0, text, -1, wtarget, MAX_PATH);
+    if (!len) {
+        win32_set_errno();
+        return -1;
+    }
+
+    size_t rdbLen = tag == REPARSE_TAG_MOUNT_POINT
+        ? reparse_encode_junction((uint16_t*)wtarget, len-1, rdb, sizeof(rdb))
+        : reparse_encode_symlink((uint16_t*)wtarget, len-1, relative,
+                                 rdb, sizeof(rdb));
+    if (!rdbLen) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (!writeReparse(linkpath, rdb, rdbLen)) {
+        win32_set_errno();
+        DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't repoint %s to %s: %s",
+             linkpath, target, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Atomically point 'linkpath' at 'target', replacing any existing link.
+   A temporary link is created next to 'linkpath' and renamed over it, so
+   'linkpath' never disappears.  Before Windows 10 1607, MoveFileEx is used
+   instead.  A link to a directory can't be renamed over, so it is
+   repointed in place (see repointDirLink()).
+*/
+int symlink_replace(const char *target, const char *linkpath)
+{
+    char tmp[MAX_PATH];
+
+    DWORD attr = GetFileAttributesA(linkpath);
+    if (attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY)
+        && (attr & FILE_ATTRIBUTE_REPARSE_POINT))
+        return repointDirLink(target, linkpath);
+
+    if (tempName(tmp, sizeof(tmp), linkpath))
+        return -1;
+
+    if (symlink(target, tmp))
+        return -1;
+
+    if (renameAtomic(tmp, linkpath, true))
+        return 0;
+
+    win32_set_errno();
+    DIAG(DIAG_ERROR, DIAG_SYMLINK, "can't replace %s with %s: %s",
+         linkpath, tmp, strerror(errno));
+
+    int err = errno;
+    link_remove(tmp);
+    errno = err;
+    return -1;
+}
+
+/* rename() with Linux renameat2() flags.
+
+   RENAME_NOREPLACE is atomic: the rename fails with EEXIST if 'newpath'
+   exists, with no window for another process to create it.
+
+   RENAME_EXCHANGE is NOT atomic; Windows has no exchanging rename.  It is
+   done in three renames, each of which is atomic:
+     1. oldpath -> temporary name
+     2. newpath -> oldpath
+     3. temporary name -> newpath
+   Between steps 1 and 2 'oldpath' doesn't exist; between 2 and 3
+   'newpath' doesn't.  If step 2 or 3 fails, the earlier steps are undone.
+*/
+int rename2(const char *oldpath, const char *newpath, unsigned flags)
+{
+    if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+        || (flags & RENAME_NOREPLACE && flags & RENAME_EXCHANGE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(flags & RENAME_EXCHANGE)) {
+        if (renameAtomic(oldpath, newpath, !(flags & RENAME_NOREPLACE)))
+            return 0;
+        win32_set_errno();
+        return -1;
+    }
+
+    char tmp[MAX_PATH];
+    if (tempName(tmp, sizeof(tmp), oldpath))
+        return -1;
+
+    if (!renameAtomic(oldpath, tmp, false)) {
+        win32_set_errno();
+        return -1;
+    }
+
+    if (!renameAtomic(newpath, oldpath, false)) {
+        win32_set_errno();
+        int err = errno;
+        renameAtomic(tmp, oldpath, false);
+        errno = err;
+        return -1;
+    }
+
+    if (!renameAtomic(tmp, newpath, false)) {
+        win32_set_errno();
+        int err = errno;
+        renameAtomic(oldpath, newpath, false);
+        renameAtomic(tmp, oldpath, false);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef UNIT_TEST
+// gcc -DUNIT_TEST -g -Wall symlink.c reparse.c winerrno.c diag.c symstats.c
+//     fault.c metacache.c -o symlink && symlink [dir]
+//
+// Tests symlink() with and without a fallback policy, symlink_replace()
+// under a reader, rename2(), the metadata cache, and lstat() and
+// resolve_link_target(), mostly with junctions, which need no privilege,
+// in 'dir' (default: the temp directory).
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("FAILED line %d: %s\n", __LINE__, #cond); \
+                        failures++; } } while (0)
+
+static bool resolvesTo(const char *link, int follow, const char *want)
+{
+    char buf[MAX_PATH];
+    ssize_t n = resolve_link_target(link, buf, sizeof(buf), follow);
+    if (n < 0) {
+        printf("%s: %s\n", link, strerror(errno));
+        return false;
+    }
+    return (size_t)n == strlen(want) && !strcmp(buf, want);
+}
+
+static void writeFile(const char *path, const char *text)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        fputs(text, fp);
+        fclose(fp);
+    }
+}
+
+static bool fileHolds(const char *path, const char *text)
+{
+    char buf[64] = "";
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+    if (!fgets(buf, sizeof(buf), fp)) buf[0] = 0;
+    fclose(fp);
+    return !strcmp(buf, text);
+}
+
+// relative targets are relative to the link, wherever the caller is
+static void testFallback(const char *root)
+{
+    char d[MAX_PATH*2], t[MAX_PATH*2], sub[MAX_PATH*2], m[MAX_PATH*2];
+    char l[MAX_PATH*2], ld[MAX_PATH*2], lm[MAX_PATH*2], other[MAX_PATH*2];
+    char cwd[MAX_PATH];
+
+    snprintf(d, sizeof(d), "%s\\fb", root);
+    snprintf(t, sizeof(t), "%s\\t", d);
+    snprintf(sub, sizeof(sub), "%s\\sub", d);
+    snprintf(m, sizeof(m), "%s\\m", sub);
+    snprintf(l, sizeof(l), "%s\\l", d);
+    snprintf(ld, sizeof(ld), "%s\\ld", d);
+    snprintf(lm, sizeof(lm), "%s\\m", ld);
+    snprintf(other, sizeof(other), "%s\\other", root);
+
+    CHECK(CreateDirectoryA(d, 0));
+    CHECK(CreateDirectoryA(sub, 0));
+    CHECK(CreateDirectoryA(other, 0));
+    writeFile(t, "target");
+    writeFile(m, "marker");
+
+    DWORD n = GetCurrentDirectoryA(sizeof(cwd), cwd);
+    CHECK(n && n < sizeof(cwd) && SetCurrentDirectoryA(other));
+    symlink_set_fallback(SYMLINK_FALLBACK_ALL);
+
+    CHECK(!symlink("t", l));
+    CHECK(fileHolds(l, "target"));
+    CHECK(!symlink("sub", ld));
+    CHECK(fileHolds(lm, "marker"));
+
+    symlink_set_fallback(SYMLINK_FALLBACK_NONE);
+    SetCurrentDirectoryA(cwd);
+
+    link_remove(l);
+    link_remove(ld);
+    DeleteFileA(m);
+    DeleteFileA(t);
+    RemoveDirectoryA(sub);
+    RemoveDirectoryA(d);
+    RemoveDirectoryA(other);
+}
+
+// reads the link, and opens 'through', a file reached by way of it
+struct reader {
+    const char *path, *through;
+    volatile LONG stop;
+    unsigned reads, errors;
+};
+
+static DWORD WINAPI readLoop(LPVOID arg)
+{
+    struct reader *r = arg;
+    char buf[MAX_PATH];
+
+    while (!r->stop) {
+        if (readlink(r->path, buf, sizeof(buf)) < 0) r->errors++;
+        FILE *fp = fopen(r->through, "r");
+        if (fp)
+            fclose(fp);
+        else
+            r->errors++;
+        r->reads++;
+    }
+    return 0;
+}
+
+// repoints 'link' between 'a' and 'b' while another thread reads it
+static void flipWhileReading(const char *link, const char *a, const char *b,
+                             const char *through)
+{
+    struct reader r = { .path = link, .through = through };
+    HANDLE t = CreateThread(0, 0, readLoop, &r, 0, 0);
+    CHECK(t);
+
+    for (int i=0; i < 200; i++)
+        CHECK(!symlink_replace(i & 1 ? a : b, link));
+    InterlockedExchange(&r.stop, 1);
+    if (t) {
+        WaitForSingleObject(t, INFINITE);
+        CloseHandle(t);
+    }
+    CHECK(r.errors == 0);
+    CHECK(resolvesTo(link, 0, a));
+    printf("%s: %u reads while repointing\n", link, r.reads);
+}
+
+static void testReplace(const char *root)
+{
+    char d1[MAX_PATH*2], d2[MAX_PATH*2], f1[MAX_PATH*2], f2[MAX_PATH*2];
+    char j[MAX_PATH*2], ds[MAX_PATH*2], fs[MAX_PATH*2];
+    char m1[MAX_PATH*2], m2[MAX_PATH*2], jm[MAX_PATH*2], dsm[MAX_PATH*2];
+
+    snprintf(d1, sizeof(d1), "%s\\r1", root);
+    snprintf(d2, sizeof(d2), "%s\\r2", root);
+    snprintf(f1, sizeof(f1), "%s\\rf1", root);
+    snprintf(f2, sizeof(f2), "%s\\rf2", root);
+    snprintf(j, sizeof(j), "%s\\current", root);
+    snprintf(ds, sizeof(ds), "%s\\dirlink", root);
+    snprintf(fs, sizeof(fs), "%s\\filelink", root);
+    snprintf(m1, sizeof(m1), "%s\\m", d1);
+    snprintf(m2, sizeof(m2), "%s\\m", d2);
+    snprintf(jm, sizeof(jm), "%s\\m", j);
+    snprintf(dsm, sizeof(dsm), "%s\\m", ds);
+
+    CHECK(CreateDirectoryA(d1, 0));
+    CHECK(CreateDirectoryA(d2, 0));
+    writeFile(f1, "1");
+    writeFile(f2, "2");
+    writeFile(m1, "m");
+    writeFile(m2, "m");
+
+    // a junction, the usual blue/green "current", stays a junction
+    CHECK(!junction_create(d1, j));
+    flipWhileReading(j, d1, d2, jm);
+    CHECK(isSymLink(j) == ISLINK_JUNCTION);
+    CHECK(symlink_replace(f1, j) == -1 && errno == ENOTDIR);
+
+    if (symlink_probe()) {
+        CHECK(!symlink(d1, ds));
+        flipWhileReading(ds, d1, d2, dsm);
+        CHECK(isSymLink(ds) == ISLINK_SYMLINK);
+        CHECK(!symlink(f1, fs));
+        flipWhileReading(fs, f1, f2, fs);
+        CHECK(fileHolds(fs, "1"));
+    } else {
+        printf("no symlink privilege: symbolic links not repointed\n");
+    }
+
+    link_remove(fs);
+    link_remove(ds);
+    link_remove(j);
+    DeleteFileA(f1);
+    DeleteFileA(f2);
+    DeleteFileA(m1);
+    DeleteFileA(m2);
+    RemoveDirectoryA(d1);
+    RemoveDirectoryA(d2);
+}
+
+static void testRename(const char *root)
+{
+    char a[MAX_PATH*2], b[MAX_PATH*2], c[MAX_PATH*2], gone[MAX_PATH*2];
+
+    snprintf(a, sizeof(a), "%s\\na", root);
+    snprintf(b, sizeof(b), "%s\\nb", root);
+    snprintf(c, sizeof(c), "%s\\nc", root);
+    snprintf(gone, sizeof(gone), "%s\\ngone", root);
+    writeFile(a, "a");
+    writeFile(b, "b");
+
+    CHECK(rename2(a, b, RENAME_NOREPLACE | RENAME_EXCHANGE) == -1
+          && errno == EINVAL);
+
+    // NOREPLACE leaves an existing 'newpath' alone
+    CHECK(rename2(a, b, RENAME_NOREPLACE) == -1 && errno == EEXIST);
+    CHECK(fileHolds(a, "a") && fileHolds(b, "b"));
+    CHECK(!rename2(a, c, RENAME_NOREPLACE));
+    CHECK(fileHolds(c, "a")
+          && GetFileAttributesA(a) == INVALID_FILE_ATTRIBUTES);
+    CHECK(!rename2(c, a, 0));
+
+    // EXCHANGE swaps, and puts 'oldpath' back when 'newpath' is missing
+    CHECK(!rename2(a, b, RENAME_EXCHANGE));
+    CHECK(fileHolds(a, "b") && fileHolds(b, "a"));
+    CHECK(rename2(a, gone, RENAME_EXCHANGE) == -1 && errno == ENOENT);
+    CHECK(fileHolds(a, "b")
+          && GetFileAttributesA(gone) == INVALID_FILE_ATTRIBUTES);
+
+    // Step 2 or 3 of an exchange failing undoes the steps before it,
+    // leaving no temporary name behind.  b and a now hold "a" and "b".
+    // Each step is one rename by handle, on NTFS.
+    char pattern[MAX_PATH*2];
+    WIN32_FIND_DATAA fd;
+    snprintf(pattern, sizeof(pattern), "%s.tmp*", a);
+    for (int step = 2; step <= 3; step++) {
+        struct fault_spec fs = { .error = ERROR_SHARING_VIOLATION,
+                                 .fail_nth = step };
+        CHECK(!fault_set("SetFileInformationByHandle", &fs));
+        CHECK(rename2(a, b, RENAME_EXCHANGE) == -1 && errno == EACCES);
+        fault_clear();
+        CHECK(fileHolds(a, "b") && fileHolds(b, "a"));
+        HANDLE h = FindFirstFileA(pattern, &fd);
+        CHECK(h == INVALID_HANDLE_VALUE);
+        if (h != INVALID_HANDLE_VALUE) FindClose(h);
+    }
+
+    // a missing 'oldpath', whatever the flags
+    CHECK(rename2(gone, c, 0) == -1 && errno == ENOENT);
+    CHECK(rename2(gone, c, RENAME_NOREPLACE) == -1 && errno == ENOENT);
+    CHECK(rename2(gone, a, RENAME_EXCHANGE) == -1 && errno == ENOENT);
+    CHECK(fileHolds(a, "b"));
+
+    DeleteFileA(a);
+    DeleteFileA(b);
+}
+
+// With the cache on, lstat() sees a new hard link, and realpath() sees a
+// junction above the file repointed.  'x1' and 'x2' are one file, so
+// their attributes, size and times match.
+static void testCache(const char *root)
+{
+    char cache[MAX_PATH*2], f[MAX_PATH*2], f2[MAX_PATH*2];
+    char d1[MAX_PATH*2], d2[MAX_PATH*2], x1[MAX_PATH*2], x2[MAX_PATH*2];
+    char j[MAX_PATH*2], jx[MAX_PATH*2];
+    char want1[MAX_PATH], want2[MAX_PATH], buf[MAX_PATH];
+
+    snprintf(cache, sizeof(cache), "%s\\cache", root);
+    snprintf(f, sizeof(f), "%s\\cf", root);
+    snprintf(f2, sizeof(f2), "%s\\cf2", root);
+    snprintf(d1, sizeof(d1), "%s\\c1", root);
+    snprintf(d2, sizeof(d2), "%s\\c2", root);
+    snprintf(x1, sizeof(x1), "%s\\x", d1);
+    snprintf(x2, sizeof(x2), "%s\\x", d2);
+    snprintf(j, sizeof(j), "%s\\cj", root);
+    snprintf(jx, sizeof(jx), "%s\\x", j);
+
+    if (metacache_active) {
+        printf("a cache is already open: cache not tested\n");
+        return;
+    }
+    CHECK(!metacache_open(cache, 64));
+
+    struct stat sb;
+    struct stat64 sb64;
+    writeFile(f, "f");
+    CHECK(!lstat(f, &sb) && sb.st_nlink == 1);
+    CHECK(!lstat(f, &sb) && sb.st_nlink == 1);      // from the cache
+    CHECK(!link(f, f2));
+    CHECK(!lstat(f, &sb) && sb.st_nlink == 2);
+    CHECK(!lstat64(f, &sb64) && sb64.st_nlink == 2);
+
+    CHECK(CreateDirectoryA(d1, 0));
+    CHECK(CreateDirectoryA(d2, 0));
+    writeFile(x1, "x");
+    CHECK(!link(x1, x2));
+    CHECK(realpath(x1, want1) && realpath(x2, want2));
+    CHECK(!junction_create(d1, j));
+    CHECK(realpath(jx, buf) && !strcmp(buf, want1));
+    CHECK(realpath(jx, buf) && !strcmp(buf, want1));
+    CHECK(!symlink_replace(d2, j));
+    CHECK(realpath(jx, buf) && !strcmp(buf, want2));
+
+    struct metacache_stats ms;
+    metacache_stats(&ms);
+    CHECK(ms.hits > 0);
+    metacache_close();
+
+    link_remove(j);
+    DeleteFileA(x1);
+    DeleteFileA(x2);
+    RemoveDirectoryA(d1);
+    RemoveDirectoryA(d2);
+    DeleteFileA(f);
+    DeleteFileA(f2);
+    DeleteFileA(cache);
+}
+
+int main(int ac, char **av)
+{
+    char base[MAX_PATH], tmp[MAX_PATH*2], root[MAX_PATH];
+    char dir[MAX_PATH*2], j1[MAX_PATH*2], j2[MAX_PATH*2], file[MAX_PATH*2];
+
+    if (ac > 1)
+        snprintf(base, sizeof(base), "%s", av[1]);
+    else if (!GetTempPathA(sizeof(base), base))
+        return 1;
+
+    // absolute, as junction targets are
+    size_t n = strlen(base);
+    const char *sep = n && (base[n-1] == '\\' || base[n-1] == '/') ? "" : "\\";
+    snprintf(tmp, sizeof(tmp), "%s%ssymlink-test-%lu", base, sep,
+             GetCurrentProcessId());
+    if (!GetFullPathNameA(tmp, sizeof(root), root, 0)
+        || !CreateDirectoryA(root, 0)) {
+        printf("can't create %s\n", tmp);
+        return 1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s\\d", root);
+    snprintf(j1, sizeof(j1), "%s\\j1", root);
+    snprintf(j2, sizeof(j2), "%s\\j2", root);
+    snprintf(file, sizeof(file), "%s\\f", root);
+
+    CHECK(CreateDirectoryA(dir, 0));
+    CHECK(!junction_create(dir, j1));
+    CHECK(!junction_create(j1, j2));
+    FILE *fp = fopen(file, "w");
+    if (fp) fclose(fp);
+
+    // without privilege and without a fallback, symlink() fails at once
+    symlink_set_fallback(SYMLINK_FALLBACK_NONE);
+    char lnk[MAX_PATH*2];
+    snprintf(lnk, sizeof(lnk), "%s\\s", root);
+    if (!symlink_probe()) {
+        unsigned calls = fsCalls;
+        CHECK(symlink(file, lnk) == -1 && errno == EPERM);
+        CHECK(win32_last_error() == ERROR_PRIVILEGE_NOT_HELD);
+        CHECK(fsCalls - calls == 1);    // the stat() of the target
+    } else {
+        CHECK(!symlink(file, lnk));
+        CHECK(resolvesTo(lnk, 0, file));
+        DeleteFileA(lnk);
+    }
+
+    testFallback(root);
+    testReplace(root);
+    testRename(root);
+    testCache(root);
+
+    // not a link
+    char buf[MAX_PATH];
+    CHECK(resolve_link_target(file, buf, sizeof(buf), 0) == -1
+          && errno == EINVAL);
+    CHECK(resolvesTo(file, 1, file));
+
+    // one hop, and the whole chain
+    CHECK(resolvesTo(j2, 0, j1));
+    CHECK(resolvesTo(j2, 1, dir));
+    CHECK(resolve_link_target(j2, buf, 4, 1) == -1 && errno == ERANGE);
+
+    // lstat() takes a link's times from the link, as lstat_tim() does
+    struct stat sb, sbt;
+    struct stat_tim tim;
+    CHECK(!lstat(j1, &sb) && !lstat_tim(j1, &sbt, &tim));
+    CHECK(sb.st_mtime == tim.st_mtim.tv_sec
+          && sb.st_ctime == tim.st_ctim.tv_sec);
+
+    // junctions are S_IFLNK, and st_link says they're junctions
+    CHECK(S_ISLNK(sb.st_mode) && !S_ISDIR(sb.st_mode));
+    CHECK(tim.st_link == ISLINK_JUNCTION);
+    CHECK(!lstat_tim(file, &sbt, &tim) && tim.st_link == 0);
+
+    // dangling, and a link to a dangling link
+    CHECK(RemoveDirectoryA(dir));
+    CHECK(resolvesTo(j1, 0, dir));
+    CHECK(resolvesTo(j1, 1, dir));
+    CHECK(resolvesTo(j2, 1, dir));
+
+    // a missing 'linkpath' is still an error
+    CHECK(resolve_link_target(dir, buf, sizeof(buf), 1) == -1
+          && errno == ENOENT);
+
+    RemoveDirectoryA(j2);
+    RemoveDirectoryA(j1);
+    DeleteFileA(file);
+    RemoveDirectoryA(root);
+
+    printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures != 0;
 }
+#endif
@@ -26,6 +26,7 @@
 
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <time.h>
 
 /* Not designed for Unicode filesystems.
  */
@@ -38,19 +39,192 @@ extern "C" {
 #endif
 
 char* realpath(const char *path, char *resolved_path);
+
+/* As POSIX: the target is written without a NUL, cut short if it's longer
+   than 'bufsiz' bytes, and the number of bytes written is returned.
+*/
 ssize_t readlink(const char *path, char *buf, size_t bufsiz);
+
+/* The whole target, NUL-terminated, in memory from malloc(), sized from
+   the reparse point in a single read; no buffer-doubling loop.  Its
+   length, without the NUL, goes in '*len' if that's not null.  Returns
+   null, with errno set, on failure.
+*/
+char* readlink_alloc(const char *path, size_t *len);
+
 int lstat(const char *path, struct stat *buf);
+
+/* lstat() with a 64-bit st_size; lstat() truncates sizes over 2 GiB. */
+int lstat64(const char *path, struct stat64 *buf);
 int symlink(const char *oldpath, const char *newpath);
 int link(const char *oldpath, const char *newpath);
 
+/* Like symlink(), but atomically replaces an existing 'linkpath'.
+   Readers of 'linkpath' see either the old or the new link, never ENOENT.
+   An existing link to a directory (symbolic or junction) is repointed in
+   place and keeps its kind; its new target must be a directory too.
+*/
+int symlink_replace(const char *target, const char *linkpath);
+
+/* rename() with renameat2() flags.  RENAME_NOREPLACE fails with EEXIST,
+   atomically, if 'newpath' exists.  RENAME_EXCHANGE swaps the two names;
+   it is not atomic (see symlink.c).
+*/
+#define RENAME_NOREPLACE 1
+#define RENAME_EXCHANGE  2
+
+int rename2(const char *oldpath, const char *newpath, unsigned flags);
+
+/* readlink() that also says, in '*flags', whether the target is
+   relative to the link's directory (LINK_RELATIVE) or the link is a
+   junction (LINK_JUNCTION), whose targets are always absolute.
+*/
+#define LINK_RELATIVE   1
+#define LINK_JUNCTION   2
+
+ssize_t readlink_flags(const char *path, char *buf, size_t bufsiz,
+                       unsigned *flags);
+
+/* Where the link 'linkpath' leads: its target, joined to the link's
+   directory if it's relative, and normalized lexically (separators made
+   backslashes, '.' and '..' resolved without looking at the file
+   system), as Windows resolves relative links itself.  With 'follow', a
+   target that is a link is followed in turn, one reparse point read per
+   hop, up to 63 (then ELOOP), and a 'linkpath' that isn't a link
+   resolves to itself.  The target needn't exist: a dangling link, or a
+   chain ending in one, resolves to the missing path.  Returns the length
+   of the path, which is null terminated in 'buf', or -1 with errno set:
+   ERANGE if it doesn't fit, EINVAL if 'linkpath' isn't a link (without
+   'follow').
+*/
+ssize_t resolve_link_target(const char *linkpath, char *buf, size_t bufsiz,
+                            int follow);
 
 /* Returns:
    -1 : failed
     0 : not a sym link
     1 : is a sym link
+    2 : is a junction (directory mount point)
+   Junctions used to return 0 here, and lstat() reported them as plain
+   directories; lstat() now reports both symlinks and junctions as S_IFLNK
+   (without S_IFDIR), as Cygwin does.  lstat_tim() says which in st_link.
 */
+#define ISLINK_SYMLINK  1
+#define ISLINK_JUNCTION 2
+
 int isSymLink(const char *path);
 
+/* File identity, the same for every name (hard link) of a file.  'id' is
+   the 128-bit file ID on Windows 8 and later, otherwise the 64-bit file
+   index.  lstat() can only fit the low 16 bits of it into st_ino.
+*/
+struct file_id {
+    unsigned long long volume;      // volume serial number
+    unsigned char id[16];
+};
+
+/* file_id() and same_file() follow links, like stat().
+   same_file() returns 1 if 'a' and 'b' are the same file, 0 if not,
+   -1 on error.
+*/
+int file_id(const char *path, struct file_id *id);
+int same_file(const char *a, const char *b);
+
+/* Hard link enumeration.  Each absolute name of the file 'path' is
+   copied to 'buf', null terminated, with an extra null after the last.
+   Returns the number of names, or -1 with errno set: ERANGE if 'bufsiz'
+   is too small.  '*needed', if 'needed' isn't NULL, is set to the size
+   required.  With 'buf' NULL, just returns the link count, without
+   enumerating names unless '*needed' is wanted.
+*/
+int link_names(const char *path, char *buf, size_t bufsiz, size_t *needed);
+
+/* Timestamps at the 100 ns resolution of the filesystem, for lstat_tim().
+   As with st_ctime, st_ctim is the creation time.  st_link is what
+   isSymLink() would return for the path: 0, ISLINK_SYMLINK or
+   ISLINK_JUNCTION, so a caller seeing S_IFLNK needn't ask again.
+*/
+struct stat_tim {
+    struct timespec st_atim;
+    struct timespec st_mtim;
+    struct timespec st_ctim;
+    int st_link;
+};
+
+int lstat_tim(const char *path, struct stat *buf, struct stat_tim *tim);
+
+#ifndef AT_FDCWD
+#define AT_FDCWD            -100
+#define AT_SYMLINK_NOFOLLOW 0x100
+#endif
+#ifndef UTIME_NOW
+#define UTIME_NOW   ((1l << 30) - 1l)
+#define UTIME_OMIT  ((1l << 30) - 2l)
+#endif
+
+/* Only AT_FDCWD is supported for 'dirfd'. */
+int utimensat(int dirfd, const char *path, const struct timespec times[2],
+              int flags);
+
+/* Junctions are directory links that need no privilege to create.
+   'target' must be a local directory; it's made absolute.  junction_remove()
+   fails with EINVAL if 'linkpath' isn't a junction.
+*/
+int junction_create(const char *target, const char *linkpath);
+int junction_remove(const char *linkpath);
+
+/* Removes 'path' itself, not what it points to: a link to a directory,
+   symbolic or junction, is removed as a directory, anything else as a
+   file.
+*/
+int link_remove(const char *path);
+
+/* symlink() fallback policy, used when symbolic links can't be created
+   (no privilege, or a filesystem without reparse points).  Links to
+   directories may become junctions; links to files may become hard links
+   (same volume only), then copies.  The default is SYMLINK_FALLBACK_NONE,
+   under which symlink() fails with EPERM, without trying, once
+   symlink_probe() has found links can't be created.
+*/
+#define SYMLINK_FALLBACK_NONE      0
+#define SYMLINK_FALLBACK_JUNCTION  1
+#define SYMLINK_FALLBACK_HARDLINK  2
+#define SYMLINK_FALLBACK_COPY      4
+#define SYMLINK_FALLBACK_ALL       7
+
+void symlink_set_fallback(unsigned policy);
+
+/* Returns:
+    0 : this process can't create symbolic links
+    1 : it can (or the probe couldn't tell)
+   The probe runs once; the result is cached for the process lifetime.
+*/
+int symlink_probe(void);
+
+/* Bulk link creation.  Each entry is created with symlink() or link(),
+   in parallel on 'nthreads' threads (<= 0: one per processor, at most 64).
+   Returns 0 if every entry succeeded, otherwise -1 with errno set from the
+   first failing entry; each entry's 'error' holds its own errno (0 on
+   success, ECANCELED if skipped after a failure with LINK_BATCH_ROLLBACK,
+   or never attempted because LINK_BATCH_MKDIRS couldn't make another
+   entry's parent directories).
+*/
+#define LINK_TYPE_SYMLINK   0
+#define LINK_TYPE_HARDLINK  1
+
+struct link_entry {
+    int type;               // LINK_TYPE_SYMLINK or LINK_TYPE_HARDLINK
+    const char *target;     // oldpath
+    const char *linkpath;   // newpath
+    int error;
+};
+
+#define LINK_BATCH_MKDIRS   1   // create missing parent directories
+#define LINK_BATCH_ROLLBACK 2   // on failure, remove everything created
+
+int link_batch(struct link_entry *entries, size_t n, int nthreads,
+               unsigned flags);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,479 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _SYMLINK_HPP
+#define _SYMLINK_HPP
+
+/* C++17 wrappers for symlink.h, in the style of std::filesystem's
+   error_code overloads.
+
+   Paths are taken as std::string_view and returned in small_path, which
+   holds up to 260 characters (MAX_PATH) in place and only allocates,
+   from its std::pmr::memory_resource, for longer paths.  Arguments are
+   copied into a small_path to NUL-terminate them, so the common case
+   makes no allocation at all.
+
+   The header also builds on POSIX systems, where it wraps the native
+   functions, so the same code (and bench_symlink.cpp) runs on both.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#ifdef _WIN32
+#include "symlink.h"
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace mingw_compat {
+
+class small_path {
+public:
+    static constexpr std::size_t inline_capacity = 260;
+
+    small_path() noexcept : small_path(nullptr) {}
+
+    explicit small_path(std::pmr::memory_resource *mr) noexcept
+        : mr_(mr ? mr : std::pmr::get_default_resource())
+    {
+        buf_[0] = 0;
+    }
+
+    small_path(std::string_view s, std::pmr::memory_resource *mr = nullptr)
+        : small_path(mr)
+    {
+        assign(s);
+    }
+
+    small_path(const small_path &o) : small_path(o.mr_) { assign(o.view()); }
+
+    small_path(small_path &&o) noexcept : mr_(o.mr_) { take(o); }
+
+    small_path &operator=(const small_path &o)
+    {
+        if (this != &o) assign(o.view());
+        return *this;
+    }
+
+    // Like the pmr containers, the resource stays with the object; a
+    // path on the heap moves only when both use the same resource.
+    small_path &operator=(small_path &&o)
+    {
+        if (this == &o) return *this;
+        if (*mr_ == *o.mr_) {
+            release();
+            take(o);
+        } else {
+            assign(o.view());
+        }
+        return *this;
+    }
+
+    ~small_path() { release(); }
+
+    const char *c_str() const noexcept { return p_; }
+    char *data() noexcept { return p_; }
+    std::size_t size() const noexcept { return len_; }
+    std::size_t capacity() const noexcept { return cap_; }
+    bool empty() const noexcept { return !len_; }
+    bool is_inline() const noexcept { return p_ == buf_; }
+    std::pmr::memory_resource *resource() const noexcept { return mr_; }
+
+    std::string_view view() const noexcept { return {p_, len_}; }
+    operator std::string_view() const noexcept { return view(); }
+
+    void clear() noexcept { resize(0); }
+
+    void assign(std::string_view s)
+    {
+        reserve(s.size());
+        std::memmove(p_, s.data(), s.size());
+        resize(s.size());
+    }
+
+    // Room for 'n' characters and the terminator; keeps the contents.
+    void reserve(std::size_t n)
+    {
+        if (n <= cap_) return;
+
+        char *p = static_cast<char*>(mr_->allocate(n + 1, 1));
+        std::memcpy(p, p_, len_ + 1);
+        release();
+        p_ = p;
+        cap_ = n;
+    }
+
+    // Sets the length after writing into data(); 'n' <= capacity().
+    void resize(std::size_t n) noexcept
+    {
+        len_ = n;
+        p_[n] = 0;
+    }
+
+private:
+    void take(small_path &o) noexcept
+    {
+        if (o.is_inline()) {
+            p_ = buf_;
+            cap_ = inline_capacity;
+            std::memcpy(buf_, o.buf_, o.len_ + 1);
+        } else {
+            p_ = o.p_;
+            cap_ = o.cap_;
+            o.p_ = o.buf_;
+            o.cap_ = inline_capacity;
+        }
+        len_ = o.len_;
+        o.resize(0);
+    }
+
+    void release() noexcept
+    {
+        if (!is_inline()) mr_->deallocate(p_, cap_ + 1, 1);
+        p_ = buf_;
+        cap_ = inline_capacity;
+    }
+
+    std::pmr::memory_resource *mr_;
+    char *p_ = buf_;
+    std::size_t len_ = 0;
+    std::size_t cap_ = inline_capacity;
+    char buf_[inline_capacity + 1];
+};
+
+#ifdef _WIN32
+using stat_t = struct stat64;
+#else
+using stat_t = struct stat;
+#endif
+
+namespace detail {
+
+inline std::error_code last_error() noexcept
+{
+    return std::error_code(errno, std::generic_category());
+}
+
+struct free_deleter {
+    void operator()(char *p) const noexcept { std::free(p); }
+};
+
+inline int lstat(const char *path, stat_t *st) noexcept
+{
+#ifdef _WIN32
+    return ::lstat64(path, st);
+#else
+    return ::lstat(path, st);
+#endif
+}
+
+} // namespace detail
+
+/* Canonical absolute path of 'path', with links resolved. */
+inline small_path realpath(std::string_view path, std::error_code &ec,
+                           std::pmr::memory_resource *mr = nullptr)
+{
+    small_path arg(path);
+    small_path out(mr);
+    char buf[PATH_MAX];
+
+    ec.clear();
+    if (!::realpath(arg.c_str(), buf)) {
+        ec = detail::last_error();
+        return out;
+    }
+
+    std::size_t n = std::strlen(buf);
+#ifdef _WIN32
+    // the caller-buffer form cuts paths short at PATH_MAX-1
+    if (n == PATH_MAX-1) {
+        std::unique_ptr<char, detail::free_deleter>
+            full(::realpath(arg.c_str(), nullptr));
+        if (!full) {
+            ec = detail::last_error();
+            return out;
+        }
+        out.assign(full.get());
+        return out;
+    }
+#endif
+    out.assign({buf, n});
+    return out;
+}
+
+/* Target of the link 'path'. */
+inline small_path readlink(std::string_view path, std::error_code &ec,
+                           std::pmr::memory_resource *mr = nullptr)
+{
+    small_path arg(path);
+    small_path out(mr);
+
+    ec.clear();
+    for (;;) {
+        ssize_t n = ::readlink(arg.c_str(), out.data(), out.capacity() + 1);
+        if (n < 0) {
+            ec = detail::last_error();
+            out.clear();
+            return out;
+        }
+
+        // a full buffer may mean the target was cut short
+        if ((std::size_t)n <= out.capacity()) {
+            out.resize(n);
+            return out;
+        }
+#ifdef _WIN32
+        // one more call, sized from the reparse point: no doubling
+        std::size_t len;
+        std::unique_ptr<char, detail::free_deleter>
+            full(::readlink_alloc(arg.c_str(), &len));
+        if (!full) {
+            ec = detail::last_error();
+            out.clear();
+            return out;
+        }
+        out.assign({full.get(), len});
+        return out;
+#else
+        if (out.capacity() >= 32767*3) {    // longest UTF-8 target
+            ec = std::make_error_code(std::errc::filename_too_long);
+            out.clear();
+            return out;
+        }
+        out.reserve(out.capacity() < 32767 ? 32767 : 32767*3);
+#endif
+    }
+}
+
+/* Status of 'path' itself, not what it links to. */
+inline stat_t lstat(std::string_view path, std::error_code &ec)
+{
+    small_path arg(path);
+    stat_t st{};
+
+    ec.clear();
+    if (detail::lstat(arg.c_str(), &st)) ec = detail::last_error();
+    return st;
+}
+
+/* True if 'path' is a symbolic link (or, on Windows, a junction). */
+inline bool is_symlink(std::string_view path, std::error_code &ec)
+{
+    small_path arg(path);
+
+    ec.clear();
+#ifdef _WIN32
+    int s = ::isSymLink(arg.c_str());
+    if (s < 0) ec = detail::last_error();
+    return s > 0;
+#else
+    struct stat st;
+    if (::lstat(arg.c_str(), &st)) {
+        ec = detail::last_error();
+        return false;
+    }
+    return S_ISLNK(st.st_mode);
+#endif
+}
+
+inline void symlink(std::string_view target, std::string_view linkpath,
+                    std::error_code &ec)
+{
+    small_path t(target), l(linkpath);
+
+    ec.clear();
+    if (::symlink(t.c_str(), l.c_str())) ec = detail::last_error();
+}
+
+inline void link(std::string_view target, std::string_view linkpath,
+                 std::error_code &ec)
+{
+    small_path t(target), l(linkpath);
+
+    ec.clear();
+    if (::link(t.c_str(), l.c_str())) ec = detail::last_error();
+}
+
+} // namespace mingw_compat
+
+#ifdef UNIT_TEST
+// Linux: g++ -std=c++17 -DUNIT_TEST -g -Wall -x c++ symlink.hpp
+//            -o symlink_hpp && ./symlink_hpp [dir]
+// MinGW: gcc -c symlink.c reparse.c winerrno.c diag.c symstats.c fault.c
+//            metacache.c
+//        g++ -std=c++17 -DUNIT_TEST -g -Wall -x c++ symlink.hpp -x none
+//            *.o -o symlink_hpp && symlink_hpp [dir]
+//
+// Checks small_path in place and on the heap, moves between resources,
+// readlink() of targets around small_path's inline capacity, and that
+// errors reach the error_code.  Links are made in 'dir' (default: the
+// current one).
+
+#include <cstdio>
+#include <string>
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::printf("FAILED line %d: %s\n", __LINE__, \
+                                    #cond); failures++; } } while (0)
+
+// counts what it hands out; equal only to itself
+class counting_resource : public std::pmr::memory_resource {
+public:
+    int allocs = 0, live = 0;
+
+private:
+    void *do_allocate(std::size_t n, std::size_t align) override
+    {
+        allocs++;
+        live++;
+        return std::pmr::new_delete_resource()->allocate(n, align);
+    }
+
+    void do_deallocate(void *p, std::size_t n, std::size_t align) override
+    {
+        live--;
+        std::pmr::new_delete_resource()->deallocate(p, n, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &o) const
+        noexcept override
+    {
+        return this == &o;
+    }
+};
+
+static void testSmallPath()
+{
+    using mingw_compat::small_path;
+    counting_resource r1, r2;
+    const std::string fits(small_path::inline_capacity, 'f');
+    const std::string longer(small_path::inline_capacity + 40, 'l');
+
+    {
+        small_path a(fits, &r1);
+        CHECK(a.is_inline() && a.view() == fits && r1.allocs == 0);
+
+        small_path b(longer, &r1);
+        CHECK(!b.is_inline() && b.view() == longer && b.size() == 300);
+        CHECK(std::strlen(b.c_str()) == longer.size());
+        CHECK(r1.allocs == 1);
+
+        // same resource: the heap buffer moves
+        small_path c(std::move(b));
+        CHECK(!c.is_inline() && c.view() == longer && r1.allocs == 1);
+        CHECK(b.empty() && b.is_inline());
+
+        // different resources: copied into the target's own
+        small_path d(&r2);
+        d = std::move(c);
+        CHECK(d.resource() == &r2 && d.view() == longer);
+        CHECK(r2.allocs == 1 && r1.live == 1);
+
+        small_path e(&r1);
+        e = std::move(d);
+        CHECK(e.resource() == &r1 && e.view() == longer && r1.allocs == 2);
+
+        // back in place
+        e.assign(fits);
+        CHECK(e.view() == fits);
+    }
+    CHECK(r1.live == 0 && r2.live == 0);
+}
+
+static void testReadlink(const char *dir)
+{
+    const std::size_t cap = mingw_compat::small_path::inline_capacity;
+    std::string link = std::string(dir) + "/symlink_hpp_test_link";
+    std::error_code ec;
+
+    // one short, exactly full (the sentinel byte unused), one over
+    for (std::size_t n : { cap - 1, cap, cap + 1 }) {
+        std::string target(n, 't');
+        std::remove(link.c_str());
+        if (::symlink(target.c_str(), link.c_str())) {
+            std::printf("can't make a link to a %zu-character target: "
+                        "readlink() not tested\n", n);
+            return;
+        }
+        counting_resource r;
+        auto got = mingw_compat::readlink(link, ec, &r);
+        CHECK(!ec && got.view() == target);
+        CHECK(got.is_inline() == (n <= cap));
+        CHECK(r.allocs == (n <= cap ? 0 : 1));
+    }
+    std::remove(link.c_str());
+}
+
+static void testErrors(const char *dir)
+{
+    std::string missing = std::string(dir) + "/symlink_hpp_no_such_file";
+    std::string file = std::string(dir) + "/symlink_hpp_test_file";
+    std::error_code ec;
+    const auto enoent = std::make_error_code(std::errc::no_such_file_or_directory);
+
+    auto p = mingw_compat::realpath(missing, ec);
+    CHECK(ec == enoent && p.empty());
+    mingw_compat::lstat(missing, ec);
+    CHECK(ec == enoent);
+    mingw_compat::is_symlink(missing, ec);
+    CHECK(ec == enoent);
+    p = mingw_compat::readlink(missing, ec);
+    CHECK(ec == enoent && p.empty());
+
+    // not a link
+    std::FILE *fp = std::fopen(file.c_str(), "w");
+    if (fp) std::fclose(fp);
+    p = mingw_compat::readlink(file, ec);
+    CHECK(ec == std::make_error_code(std::errc::invalid_argument));
+
+    // and a success clears it
+    p = mingw_compat::realpath(file, ec);
+    CHECK(!ec && !p.empty());
+    std::remove(file.c_str());
+}
+
+int main(int ac, char **av)
+{
+    const char *dir = ac > 1 ? av[1] : ".";
+
+    testSmallPath();
+    testReadlink(dir);
+    testErrors(dir);
+
+    std::printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures != 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Each thread records into its own block, registered on a list the first
+   time it makes a call; only the owning thread writes to it.  When a
+   thread exits, its counts are folded into 'retired' and the block is
+   freed.  Reset records a baseline that snapshots subtract, so it never
+   has to write to another thread's block.
+ */
+#define _WIN32_WINNT 0x0600
+
+#include <stdlib.h>
+#include <errno.h>
+#include <windows.h>
+#include "symstats.h"
+
+struct statBlock {
+    struct statBlock *next;
+    struct symstats s;
+};
+
+static struct statBlock *blocks;
+static struct symstats retired;     // counts of threads that have exited
+static struct symstats baseline;    // totals at the last reset
+static SRWLOCK statLock = SRWLOCK_INIT;
+static DWORD flsIndex = FLS_OUT_OF_INDEXES;
+static unsigned long long ticksPerSec;
+
+static __thread struct statBlock *myBlock;
+
+static const char *opNames[SYMSTATS_NOPS] = {
+    [SYMSTATS_LSTAT]            = "lstat",
+    [SYMSTATS_READLINK]         = "readlink",
+    [SYMSTATS_REALPATH_ALLOC]   = "realpath (malloc)",
+    [SYMSTATS_REALPATH_BUF]     = "realpath (buffer)",
+    [SYMSTATS_SYMLINK]          = "symlink",
+    [SYMSTATS_SYMLINK_FALLBACK] = "symlink (fallback)",
+    [SYMSTATS_LINK]             = "link",
+};
+
+const char *symstats_name(int op)
+{
+    return (op >= 0 && op < SYMSTATS_NOPS) ? opNames[op] : "?";
+}
+
+// Buckets 0-3 are 64 ns wide.  After that, bucket 4*(e-1) + m holds
+// (4+m) << (e-2) up to, but not including, (5+m) << (e-2), in units of
+// 64 ns, where 2^e is the power of two below the latency.
+static int bucketOf(unsigned long long ns)
+{
+    unsigned long long v = ns >> 6;
+    if (v < 4) return v;
+
+    int e = 63 - __builtin_clzll(v);
+    int b = 4*(e - 1) + ((v >> (e - 2)) & 3);
+    return b < SYMSTATS_BUCKETS ? b : SYMSTATS_BUCKETS-1;
+}
+
+unsigned long long symstats_bucket_ns(int bucket)
+{
+    if (bucket < 4) return bucket * 64ULL;
+
+    int e = bucket/4 + 1;
+    return ((4ULL + bucket%4) << (e - 2)) * 64;
+}
+
+unsigned long long symstats_percentile(const struct symstats_op *op,
+                                       double pct)
+{
+    double want = op->calls * pct / 100;
+    unsigned long long seen = 0;
+
+    for (int b=0; b < SYMSTATS_BUCKETS; b++) {
+        seen += op->hist[b];
+        if (seen && seen >= want)
+            return b+1 < SYMSTATS_BUCKETS ? symstats_bucket_ns(b+1)
+                                          : symstats_bucket_ns(b);
+    }
+    return 0;
+}
+
+static void addStats(struct symstats *dst, const struct symstats *src,
+                     int sign)
+{
+    for (int i=0; i < SYMSTATS_NOPS; i++) {
+        struct symstats_op *d = &dst->op[i];
+        const struct symstats_op *s = &src->op[i];
+
+        d->calls += sign * s->calls;
+        d->errors += sign * s->errors;
+        d->fs_calls += sign * s->fs_calls;
+        d->total_ns += sign * s->total_ns;
+        for (int b=0; b < SYMSTATS_BUCKETS; b++)
+            d->hist[b] += sign * s->hist[b];
+    }
+}
+
+// all threads, since the process started; statLock must be held
+static void totals(struct symstats *s)
+{
+    *s = retired;
+    for (struct statBlock *b = blocks; b; b = b->next)
+        addStats(s, &b->s, 1);
+}
+
+void symstats_snapshot(struct symstats *s)
+{
+    AcquireSRWLockShared(&statLock);
+    totals(s);
+    addStats(s, &baseline, -1);
+    ReleaseSRWLockShared(&statLock);
+}
+
+void symstats_reset(void)
+{
+    // 'baseline' is written under the exclusive lock, so two resets
+    // can't interleave; snapshots only read it
+    AcquireSRWLockExclusive(&statLock);
+    totals(&baseline);
+    ReleaseSRWLockExclusive(&statLock);
+}
+
+static void WINAPI blockRetired(void *block)
+{
+    struct statBlock *b = block;
+    if (!b) return;
+
+    AcquireSRWLockExclusive(&statLock);
+    addStats(&retired, &b->s, 1);
+    for (struct statBlock **pb = &blocks; *pb; pb = &(*pb)->next) {
+        if (*pb == b) {
+            *pb = b->next;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&statLock);
+
+    free(b);
+}
+
+static struct statBlock *threadBlock(void)
+{
+    if (myBlock) return myBlock;
+
+    // first call in this thread; don't disturb the caller's error
+    int err = errno;
+    DWORD lastError = GetLastError();
+
+    struct statBlock *b = calloc(1, sizeof(*b));
+    if (b) {
+        AcquireSRWLockExclusive(&statLock);
+        if (!ticksPerSec) {
+            LARGE_INTEGER f;
+            QueryPerformanceFrequency(&f);
+            ticksPerSec = f.QuadPart;
+            flsIndex = FlsAlloc(blockRetired);
+        }
+        b->next = blocks;
+        blocks = b;
+        ReleaseSRWLockExclusive(&statLock);
+
+        if (flsIndex != FLS_OUT_OF_INDEXES)
+            FlsSetValue(flsIndex, b);
+        myBlock = b;
+    }
+
+    SetLastError(lastError);
+    errno = err;
+    return b;
+}
+
+unsigned long long symstats_begin(void)
+{
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+void symstats_end(int op, unsigned long long begin, unsigned fsCalls,
+                  bool failed)
+{
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+
+    struct statBlock *b = threadBlock();
+    if (!b) return;
+
+    unsigned long long ticks = t.QuadPart - begin;
+    unsigned long long ns = ticks / ticksPerSec * 1000000000
+        + ticks % ticksPerSec * 1000000000 / ticksPerSec;
+
+    struct symstats_op *o = &b->s.op[op];
+    o->calls++;
+    o->errors += failed;
+    o->fs_calls += fsCalls;
+    o->total_ns += ns;
+    o->hist[bucketOf(ns)]++;
+}
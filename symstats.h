@@ -0,0 +1,94 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _SYMSTATS_H
+#define _SYMSTATS_H
+
+#include <stdbool.h>
+
+/* Call counts and latencies for the symlink functions, always on.
+
+   Each thread counts into its own block, so recording a call is a few
+   increments and two QueryPerformanceCounter() reads.  A snapshot sums
+   the blocks of all threads, including those that have exited; it is
+   approximate while other threads are still making calls.
+ */
+
+// operations; realpath and symlink are split by the path taken
+#define SYMSTATS_LSTAT              0   // lstat, lstat_tim, lstat64
+#define SYMSTATS_READLINK           1
+#define SYMSTATS_REALPATH_ALLOC     2   // realpath(path, NULL)
+#define SYMSTATS_REALPATH_BUF       3   // realpath into the caller's buffer
+#define SYMSTATS_SYMLINK            4   // CreateSymbolicLink
+#define SYMSTATS_SYMLINK_FALLBACK   5   // junction, hard link or copy
+#define SYMSTATS_LINK               6
+#define SYMSTATS_NOPS               7
+
+/* Latency histogram: 64 ns buckets below 256 ns, then four buckets per
+   power of two; the last bucket holds everything over 8 minutes.
+*/
+#define SYMSTATS_BUCKETS            128
+
+struct symstats_op {
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long fs_calls;    // Win32 file system calls made
+    unsigned long long total_ns;
+    unsigned long long hist[SYMSTATS_BUCKETS];
+};
+
+struct symstats {
+    struct symstats_op op[SYMSTATS_NOPS];
+};
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Counts since the last symstats_reset(), over all threads. */
+void symstats_snapshot(struct symstats *s);
+
+void symstats_reset(void);
+
+/* Name of an operation, e.g. "realpath (malloc)". */
+const char *symstats_name(int op);
+
+/* Lowest latency, in ns, counted in histogram bucket 'bucket'. */
+unsigned long long symstats_bucket_ns(int bucket);
+
+/* Latency, in ns, below which 'pct' percent of the op's calls fall,
+   to the resolution of the histogram.
+*/
+unsigned long long symstats_percentile(const struct symstats_op *op,
+                                       double pct);
+
+/* For the library: the start of a call, and its end. */
+unsigned long long symstats_begin(void);
+void symstats_end(int op, unsigned long long begin, unsigned fsCalls,
+                  bool failed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1395 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/* Tree snapshots: scanning, the file format, and diffs.
+
+   File layout, integers little-endian:
+
+       "TREESNP1"
+       u64 entries, u64 names
+       u64 offset, u64 length      for each section below
+       sections, each 8-byte aligned:
+           names       the distinct names, concatenated
+           name index  u32 offset of each name in 'names', and the end
+           depth       varint per entry; 0 for the root's children
+           name        varint per entry, index into the name table
+           type        byte per entry
+           size        varint per entry
+           mtime       zigzag varint, difference from the previous entry
+           dev         zigzag varint, difference from the previous entry
+           id          zigzag varint of the low 8 bytes' difference from
+                       the previous entry's, varint of the high 8 bytes
+           target      varint length and bytes, per link
+
+   Only the primitives below differ between Windows and Linux, so it can
+   be tested on Linux.
+ */
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0600
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include "symlink.h"
+#include "winerrno.h"
+#define SEP         '\\'
+#else
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define SEP         '/'
+#endif
+
+#include "treesnap.h"
+
+#define MAGIC           "TREESNP1"
+
+enum {
+    S_NAMES, S_NAMEIDX, S_DEPTH, S_NAME, S_TYPE, S_SIZE, S_MTIME, S_DEV,
+    S_ID, S_TARGET, NSECTIONS
+};
+
+#define HEADER_SIZE     (8 + 16 + 16*NSECTIONS)
+
+/* Platform primitives */
+
+// a directory entry, before it's been looked at
+struct dirItem {
+    char *name;
+#ifdef _WIN32
+    WIN32_FIND_DATAA fd;
+#endif
+};
+
+static char *readTarget(const char *path)
+{
+    char *p;
+#ifdef _WIN32
+    // sized from the reparse point, however long
+    p = readlink_alloc(path, 0);
+    if (!p) p = strdup("");
+#else
+    char buf[4096];
+    ssize_t n = readlink(path, buf, sizeof(buf));
+    if (n < 0) n = 0;
+
+    p = malloc(n + 1);
+    if (p) {
+        memcpy(p, buf, n);
+        p[n] = 0;
+    }
+#endif
+    return p;
+}
+
+static void idFromInt(unsigned char id[16], unsigned long long v)
+{
+    memset(id, 0, 16);
+    for (int k=0; k < 8; k++) id[k] = v >> 8*k;
+}
+
+#ifdef _WIN32
+
+#define DELTA_EPOCH_IN_100NS    116444736000000000LL
+
+static int fail(void)
+{
+    win32_set_errno();
+    return -1;
+}
+
+static int listDir(const char *dir, struct dirItem **items, size_t *n)
+{
+    char pattern[MAX_PATH + 3];
+    struct dirItem *list = 0;
+    size_t count = 0, cap = 0;
+    WIN32_FIND_DATAA fd;
+
+    if (snprintf(pattern, sizeof(pattern), "%s\\*", dir)
+        >= (int)sizeof(pattern)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    HANDLE h = FindFirstFileA(pattern, &fd);
+    if (h == INVALID_HANDLE_VALUE) {
+        if (GetLastError() != ERROR_FILE_NOT_FOUND) return fail();
+        *items = 0;
+        *n = 0;
+        return 0;
+    }
+
+    do {
+        if (!strcmp(fd.cFileName, ".") || !strcmp(fd.cFileName, ".."))
+            continue;
+        if (count == cap) {
+            cap = cap ? cap*2 : 64;
+            struct dirItem *p = realloc(list, cap * sizeof(*p));
+            if (!p) {
+                free(list);
+                FindClose(h);
+                errno = ENOMEM;
+                return -1;
+            }
+            list = p;
+        }
+        list[count++].fd = fd;
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+
+    for (size_t i=0; i < count; i++) list[i].name = list[i].fd.cFileName;
+    *items = list;
+    *n = count;
+    return 0;
+}
+
+static void freeItems(struct dirItem *items, size_t n)
+{
+    free(items);
+}
+
+static int lookAt(const char *path, const struct dirItem *it,
+                  struct tree_entry *e)
+{
+    const WIN32_FIND_DATAA *fd = &it->fd;
+    bool link = (fd->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+        && (fd->dwReserved0 == IO_REPARSE_TAG_SYMLINK
+            || fd->dwReserved0 == IO_REPARSE_TAG_MOUNT_POINT);
+
+    e->type = link ? TREE_LINK
+        : (fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? TREE_DIR
+        : TREE_FILE;
+    e->size = (unsigned long long)fd->nFileSizeHigh << 32 | fd->nFileSizeLow;
+    e->mtime = (((long long)fd->ftLastWriteTime.dwHighDateTime << 32
+                 | fd->ftLastWriteTime.dwLowDateTime)
+                - DELTA_EPOCH_IN_100NS) * 100;
+    e->dev = 0;
+    memset(e->id, 0, sizeof(e->id));
+    e->target = 0;
+
+    // file_id() would follow a link, so links have no ID
+    struct file_id id;
+    if (link) {
+        if (!(e->target = readTarget(path))) return -1;
+    } else if (!file_id(path, &id)) {
+        e->dev = id.volume;
+        memcpy(e->id, id.id, sizeof(e->id));
+    }
+    return 0;
+}
+
+struct mapping {
+    HANDLE map;
+};
+
+static const unsigned char *mapFile(const char *path, size_t *size,
+                                    struct mapping *m)
+{
+    HANDLE h = CreateFileA(path, GENERIC_READ,
+                           FILE_SHARE_READ | FILE_SHARE_DELETE, 0,
+                           OPEN_EXISTING, 0, 0);
+    if (h == INVALID_HANDLE_VALUE) {
+        win32_set_errno();
+        return 0;
+    }
+
+    LARGE_INTEGER len = {0};
+    void *p = 0;
+    if (!GetFileSizeEx(h, &len)) {
+        win32_set_errno();
+    } else if (len.QuadPart < HEADER_SIZE) {
+        errno = EINVAL;
+    } else if (!(m->map = CreateFileMappingA(h, 0, PAGE_READONLY, 0, 0, 0))) {
+        win32_set_errno();
+    } else if (!(p = MapViewOfFile(m->map, FILE_MAP_READ, 0, 0, 0))) {
+        win32_set_errno();
+        CloseHandle(m->map);
+    }
+    CloseHandle(h);
+
+    *size = len.QuadPart;
+    return p;
+}
+
+static void unmapFile(const unsigned char *p, size_t size, struct mapping *m)
+{
+    UnmapViewOfFile(p);
+    CloseHandle(m->map);
+}
+
+static int replaceFile(const char *from, const char *to)
+{
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : fail();
+}
+
+#else   // Linux
+
+static int listDir(const char *dir, struct dirItem **items, size_t *n)
+{
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+
+    struct dirItem *list = 0;
+    size_t count = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (count == cap) {
+            cap = cap ? cap*2 : 64;
+            struct dirItem *p = realloc(list, cap * sizeof(*p));
+            if (!p) goto nomem;
+            list = p;
+        }
+        if (!(list[count].name = strdup(de->d_name))) goto nomem;
+        count++;
+    }
+    closedir(d);
+
+    *items = list;
+    *n = count;
+    return 0;
+
+ nomem:
+    while (count) free(list[--count].name);
+    free(list);
+    closedir(d);
+    errno = ENOMEM;
+    return -1;
+}
+
+static void freeItems(struct dirItem *items, size_t n)
+{
+    for (size_t i=0; i < n; i++) free(items[i].name);
+    free(items);
+}
+
+static int lookAt(const char *path, const struct dirItem *it,
+                  struct tree_entry *e)
+{
+    struct stat st;
+    (void)it;
+    if (lstat(path, &st)) return -1;
+
+    e->type = S_ISLNK(st.st_mode) ? TREE_LINK
+        : S_ISDIR(st.st_mode) ? TREE_DIR
+        : S_ISREG(st.st_mode) ? TREE_FILE : TREE_OTHER;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    e->dev = st.st_dev;
+    idFromInt(e->id, st.st_ino);
+    e->target = 0;
+    if (e->type == TREE_LINK && !(e->target = readTarget(path))) return -1;
+    return 0;
+}
+
+struct mapping {
+    int unused;
+};
+
+static const unsigned char *mapFile(const char *path, size_t *size,
+                                    struct mapping *m)
+{
+    (void)m;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st = {0};
+    void *p = 0;
+    if (fstat(fd, &st)) {
+        p = 0;
+    } else if (st.st_size < HEADER_SIZE) {
+        errno = EINVAL;
+    } else {
+        p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) p = 0;
+    }
+    close(fd);
+
+    *size = st.st_size;
+    return p;
+}
+
+static void unmapFile(const unsigned char *p, size_t size, struct mapping *m)
+{
+    (void)m;
+    munmap((void*)p, size);
+}
+
+static int replaceFile(const char *from, const char *to)
+{
+    return rename(from, to);
+}
+
+#endif
+
+/* Scanning */
+
+// Compares paths with the separator below every other character.
+static int comparePaths(const char *a, const char *b)
+{
+    for (;; a++, b++) {
+        int ca = *a == SEP ? 1 : *a ? (unsigned char)*a + 1 : 0;
+        int cb = *b == SEP ? 1 : *b ? (unsigned char)*b + 1 : 0;
+        if (ca != cb) return ca - cb;
+        if (!ca) return 0;
+    }
+}
+
+static int compareItems(const void *a, const void *b)
+{
+    return strcmp(((const struct dirItem*)a)->name,
+                  ((const struct dirItem*)b)->name);
+}
+
+struct walk {
+    char *path;             // the root, then the entry's relative path
+    size_t cap, rootLen;
+    tree_callback cb;
+    void *ctx;
+};
+
+static int walkDir(struct walk *w, size_t len)
+{
+    struct dirItem *items;
+    size_t n;
+    if (listDir(w->path, &items, &n)) return -1;
+    if (n) qsort(items, n, sizeof(*items), compareItems);
+
+    int s = 0;
+    for (size_t i=0; !s && i < n; i++) {
+        size_t nameLen = strlen(items[i].name);
+        if (len + nameLen + 2 > w->cap) {
+            size_t cap = (len + nameLen + 2) * 2;
+            char *p = realloc(w->path, cap);
+            if (!p) {
+                errno = ENOMEM;
+                s = -1;
+                break;
+            }
+            w->path = p;
+            w->cap = cap;
+        }
+        w->path[len] = SEP;
+        memcpy(w->path + len + 1, items[i].name, nameLen + 1);
+
+        struct tree_entry e;
+        if (lookAt(w->path, &items[i], &e)) {
+            w->path[len] = 0;
+            if (errno == ENOENT) continue;  // gone since the listing
+            s = -1;
+            break;
+        }
+        e.path = w->path + w->rootLen + 1;
+        s = w->cb(&e, w->ctx);
+        free((char*)e.target);
+
+        if (!s && e.type == TREE_DIR) s = walkDir(w, len + 1 + nameLen);
+        w->path[len] = 0;
+    }
+
+    freeItems(items, n);
+    return s;
+}
+
+int tree_scan(const char *root, tree_callback cb, void *ctx)
+{
+    struct walk w = { .cb = cb, .ctx = ctx };
+
+    w.rootLen = strlen(root);
+    while (w.rootLen > 1 && root[w.rootLen-1] == SEP) w.rootLen--;
+    w.cap = w.rootLen + 256;
+    if (!(w.path = malloc(w.cap))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(w.path, root, w.rootLen);
+    w.path[w.rootLen] = 0;
+
+    int s = walkDir(&w, w.rootLen);
+    int err = errno;
+    free(w.path);
+    errno = err;
+    return s;
+}
+
+/* Encoding */
+
+struct buf {
+    unsigned char *p;
+    size_t n, cap;
+    bool failed;
+};
+
+static void put(struct buf *b, const void *p, size_t n)
+{
+    if (b->n + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->n + n) cap *= 2;
+        unsigned char *q = realloc(b->p, cap);
+        if (!q) {
+            b->failed = true;
+            return;
+        }
+        b->p = q;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->n, p, n);
+    b->n += n;
+}
+
+static void putByte(struct buf *b, unsigned char c)
+{
+    if (b->n < b->cap) b->p[b->n++] = c;
+    else put(b, &c, 1);
+}
+
+static void putVarint(struct buf *b, uint64_t v)
+{
+    unsigned char tmp[10];
+    int n = 0;
+    do {
+        tmp[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    put(b, tmp, n);
+}
+
+static void putLE(unsigned char *p, uint64_t v, int n)
+{
+    for (int k=0; k < n; k++) p[k] = v >> 8*k;
+}
+
+static uint64_t getLE(const unsigned char *p, int n)
+{
+    uint64_t v = 0;
+    for (int k=0; k < n; k++) v |= (uint64_t)p[k] << 8*k;
+    return v;
+}
+
+static bool getVarint(const unsigned char **p, const unsigned char *end,
+                      uint64_t *v)
+{
+    uint64_t x = 0;
+    for (int shift=0; *p < end && shift < 64; shift += 7) {
+        unsigned char c = *(*p)++;
+        x |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = x;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Writing */
+
+struct tree_snap_writer {
+    char *path;
+    struct buf col[NSECTIONS];
+    uint64_t count;
+
+    // the name table: an open-addressed hash of name index + 1
+    uint32_t *slots;
+    size_t nslots, nnames;
+
+    // the previous entry
+    char *prev;
+    size_t prevCap, prevDepth;
+    long long mtime;
+    unsigned long long dev;
+    uint64_t id;
+};
+
+static uint32_t hashName(const char *s, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i=0; i < n; i++) h = (h ^ (unsigned char)s[i]) * 16777619;
+    return h;
+}
+
+static const char *nameAt(const struct tree_snap_writer *w, size_t i,
+                          size_t *len)
+{
+    const unsigned char *idx = w->col[S_NAMEIDX].p;
+    uint32_t off = getLE(idx + 4*i, 4);
+    *len = getLE(idx + 4*i + 4, 4) - off;
+    return (const char*)w->col[S_NAMES].p + off;
+}
+
+static bool growNames(struct tree_snap_writer *w)
+{
+    size_t nslots = w->nslots ? w->nslots*2 : 1024;
+    uint32_t *slots = calloc(nslots, sizeof(*slots));
+    if (!slots) return false;
+
+    for (size_t i=0; i < w->nnames; i++) {
+        size_t len;
+        const char *name = nameAt(w, i, &len);
+        size_t k = hashName(name, len) & (nslots - 1);
+        while (slots[k]) k = (k + 1) & (nslots - 1);
+        slots[k] = i + 1;
+    }
+    free(w->slots);
+    w->slots = slots;
+    w->nslots = nslots;
+    return true;
+}
+
+static bool internName(struct tree_snap_writer *w, const char *name,
+                       size_t len, uint32_t *index)
+{
+    if (2*(w->nnames + 1) > w->nslots && !growNames(w)) return false;
+
+    size_t k = hashName(name, len) & (w->nslots - 1);
+    for (; w->slots[k]; k = (k + 1) & (w->nslots - 1)) {
+        size_t n;
+        const char *p = nameAt(w, w->slots[k] - 1, &n);
+        if (n == len && !memcmp(p, name, len)) {
+            *index = w->slots[k] - 1;
+            return true;
+        }
+    }
+
+    unsigned char end[4];
+    put(&w->col[S_NAMES], name, len);
+    putLE(end, w->col[S_NAMES].n, 4);
+    put(&w->col[S_NAMEIDX], end, 4);
+    if (w->col[S_NAMES].failed || w->col[S_NAMEIDX].failed) return false;
+
+    *index = w->nnames++;
+    w->slots[k] = *index + 1;
+    return true;
+}
+
+struct tree_snap_writer *tree_snap_create(const char *path)
+{
+    struct tree_snap_writer *w = calloc(1, sizeof(*w));
+    unsigned char zero[4] = {0};
+
+    if (!w || !(w->path = strdup(path))) {
+        free(w);
+        errno = ENOMEM;
+        return 0;
+    }
+    put(&w->col[S_NAMEIDX], zero, 4);   // where the first name starts
+    return w;
+}
+
+int tree_snap_add(struct tree_snap_writer *w, const struct tree_entry *e)
+{
+    const char *name = strrchr(e->path, SEP);
+    size_t depth = 0;
+    for (const char *p = e->path; *p; p++) depth += *p == SEP;
+    name = name ? name + 1 : e->path;
+
+    // in path order, and with the directory before what's in it
+    if (w->count && (comparePaths(w->prev, e->path) >= 0
+                     || depth > w->prevDepth + 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!w->count && depth) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t len = strlen(e->path) + 1;
+    if (len > w->prevCap) {
+        char *p = realloc(w->prev, len * 2);
+        if (!p) {
+            errno = ENOMEM;
+            return -1;
+        }
+        w->prev = p;
+        w->prevCap = len * 2;
+    }
+    memcpy(w->prev, e->path, len);
+    w->prevDepth = depth;
+
+    uint32_t index;
+    if (!internName(w, name, strlen(name), &index)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t lo = getLE(e->id, 8), hi = getLE(e->id + 8, 8);
+    putVarint(&w->col[S_DEPTH], depth);
+    putVarint(&w->col[S_NAME], index);
+    putByte(&w->col[S_TYPE], e->type);
+    putVarint(&w->col[S_SIZE], e->size);
+    putVarint(&w->col[S_MTIME], zigzag(e->mtime - w->mtime));
+    putVarint(&w->col[S_DEV], zigzag(e->dev - w->dev));
+    putVarint(&w->col[S_ID], zigzag(lo - w->id));
+    putVarint(&w->col[S_ID], hi);
+    if (e->type == TREE_LINK) {
+        size_t n = e->target ? strlen(e->target) : 0;
+        putVarint(&w->col[S_TARGET], n);
+        put(&w->col[S_TARGET], e->target, n);
+    }
+    w->mtime = e->mtime;
+    w->dev = e->dev;
+    w->id = lo;
+    w->count++;
+
+    for (int i=0; i < NSECTIONS; i++) {
+        if (w->col[i].failed) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void tree_snap_abort(struct tree_snap_writer *w)
+{
+    if (!w) return;
+    for (int i=0; i < NSECTIONS; i++) free(w->col[i].p);
+    free(w->slots);
+    free(w->prev);
+    free(w->path);
+    free(w);
+}
+
+int tree_snap_finish(struct tree_snap_writer *w)
+{
+    unsigned char header[HEADER_SIZE];
+    static const unsigned char pad[8];
+    uint64_t off = HEADER_SIZE;
+
+    memcpy(header, MAGIC, 8);
+    putLE(header + 8, w->count, 8);
+    putLE(header + 16, w->nnames, 8);
+    for (int i=0; i < NSECTIONS; i++) {
+        putLE(header + 24 + 16*i, off, 8);
+        putLE(header + 32 + 16*i, w->col[i].n, 8);
+        off = (off + w->col[i].n + 7) & ~7ULL;
+    }
+
+    size_t len = strlen(w->path);
+    char *tmp = malloc(len + 5);
+    if (!tmp) {
+        tree_snap_abort(w);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(tmp, w->path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    FILE *fp = fopen(tmp, "wb");
+    int s = -1;
+    if (fp) {
+        off = HEADER_SIZE;
+        bool ok = fwrite(header, HEADER_SIZE, 1, fp) == 1;
+        for (int i=0; ok && i < NSECTIONS; i++) {
+            size_t n = w->col[i].n;
+            ok = (!n || fwrite(w->col[i].p, n, 1, fp) == 1)
+                && (!(n & 7) || fwrite(pad, 8 - (n & 7), 1, fp) == 1);
+        }
+        if (!ok) errno = EIO;
+        if (fclose(fp)) ok = false;
+        s = ok ? replaceFile(tmp, w->path) : -1;
+        if (s) {
+            int err = errno;
+            remove(tmp);
+            errno = err;
+        }
+    }
+
+    int err = errno;
+    free(tmp);
+    tree_snap_abort(w);
+    errno = err;
+    return s;
+}
+
+static int addScanned(const struct tree_entry *e, void *ctx)
+{
+    return tree_snap_add(ctx, e);
+}
+
+int tree_snap_save(const char *root, const char *path)
+{
+    struct tree_snap_writer *w = tree_snap_create(path);
+    if (!w) return -1;
+
+    if (tree_scan(root, addScanned, w)) {
+        int err = errno;
+        tree_snap_abort(w);
+        errno = err;
+        return -1;
+    }
+    return tree_snap_finish(w);
+}
+
+/* Reading */
+
+struct tree_snap {
+    const unsigned char *base;
+    size_t size;
+    struct mapping m;
+    uint64_t count, names;
+    const unsigned char *sec[NSECTIONS];
+    size_t len[NSECTIONS];
+};
+
+struct tree_snap *tree_snap_open(const char *path)
+{
+    struct tree_snap *s = calloc(1, sizeof(*s));
+    if (!s) {
+        errno = ENOMEM;
+        return 0;
+    }
+    if (!(s->base = mapFile(path, &s->size, &s->m))) {
+        int err = errno;
+        free(s);
+        errno = err;
+        return 0;
+    }
+
+    bool ok = !memcmp(s->base, MAGIC, 8);
+    s->count = getLE(s->base + 8, 8);
+    s->names = getLE(s->base + 16, 8);
+    for (int i=0; ok && i < NSECTIONS; i++) {
+        uint64_t off = getLE(s->base + 24 + 16*i, 8);
+        uint64_t len = getLE(s->base + 32 + 16*i, 8);
+        ok = off <= s->size && len <= s->size - off;
+        if (ok) {       // only then is 'off' a place in the file
+            s->sec[i] = s->base + off;
+            s->len[i] = len;
+        }
+    }
+    if (ok) ok = s->names < s->size
+        && s->len[S_NAMEIDX] == 4*(s->names + 1)
+        && getLE(s->sec[S_NAMEIDX] + 4*s->names, 4) <= s->len[S_NAMES]
+        && s->len[S_TYPE] == s->count;
+
+    if (!ok) {
+        tree_snap_close(s);
+        errno = EINVAL;
+        return 0;
+    }
+    return s;
+}
+
+void tree_snap_close(struct tree_snap *s)
+{
+    if (!s) return;
+    unmapFile(s->base, s->size, &s->m);
+    free(s);
+}
+
+size_t tree_snap_count(const struct tree_snap *s)
+{
+    return s->count;
+}
+
+// reads the entries of a snapshot one at a time
+struct cursor {
+    const struct tree_snap *s;
+    const unsigned char *p[NSECTIONS];
+    uint64_t left;
+    long long mtime;
+    unsigned long long dev;
+    uint64_t id;
+    char *path;
+    size_t cap;
+    size_t *ends;           // end of the path of the last entry at each depth
+    size_t depth, depthCap; // depth of the last entry, plus one
+    char *target;
+    size_t targetCap;
+    struct tree_entry e;
+};
+
+static void cursorInit(struct cursor *c, const struct tree_snap *s)
+{
+    memset(c, 0, sizeof(*c));
+    c->s = s;
+    c->left = s->count;
+    for (int i=0; i < NSECTIONS; i++) c->p[i] = s->sec[i];
+}
+
+static void cursorFree(struct cursor *c)
+{
+    free(c->path);
+    free(c->ends);
+    free(c->target);
+}
+
+static bool reserve(char **p, size_t *cap, size_t n)
+{
+    if (n <= *cap) return true;
+    char *q = realloc(*p, n * 2);
+    if (!q) return false;
+    *p = q;
+    *cap = n * 2;
+    return true;
+}
+
+static bool cursorField(struct cursor *c, int col, uint64_t *v)
+{
+    return getVarint(&c->p[col], c->s->sec[col] + c->s->len[col], v);
+}
+
+/* Returns 1 with the next entry in c->e, 0 at the end, or -1 with errno
+   set if the snapshot is damaged (or memory is short).
+*/
+static int cursorNext(struct cursor *c)
+{
+    const struct tree_snap *s = c->s;
+    uint64_t depth, index, size, mtime, dev, lo, hi;
+
+    if (!c->left) return 0;
+    if (!cursorField(c, S_DEPTH, &depth) || !cursorField(c, S_NAME, &index)
+        || !cursorField(c, S_SIZE, &size) || !cursorField(c, S_MTIME, &mtime)
+        || !cursorField(c, S_DEV, &dev) || !cursorField(c, S_ID, &lo)
+        || !cursorField(c, S_ID, &hi)
+        || depth > c->depth || index >= s->names)
+        goto damaged;
+
+    const unsigned char *idx = s->sec[S_NAMEIDX] + 4*index;
+    uint64_t from = getLE(idx, 4), to = getLE(idx + 4, 4);
+    if (from > to || to > s->len[S_NAMES]) goto damaged;
+
+    // the parent's path is still in the buffer
+    size_t start = depth ? c->ends[depth-1] + 1 : 0;
+    if (!reserve(&c->path, &c->cap, start + (to - from) + 1)) goto nomem;
+    if (depth == c->depthCap) {
+        size_t n = c->depthCap ? c->depthCap*2 : 32;
+        size_t *p = realloc(c->ends, n * sizeof(*p));
+        if (!p) goto nomem;
+        c->ends = p;
+        c->depthCap = n;
+    }
+    if (depth) c->path[start-1] = SEP;
+    memcpy(c->path + start, s->sec[S_NAMES] + from, to - from);
+    c->path[start + (to - from)] = 0;
+    c->ends[depth] = start + (to - from);
+    c->depth = depth + 1;
+
+    c->e.path = c->path;
+    c->e.type = *c->p[S_TYPE]++;
+    c->e.size = size;
+    c->e.mtime = c->mtime += unzigzag(mtime);
+    c->e.dev = c->dev += unzigzag(dev);
+    c->id += unzigzag(lo);
+    putLE(c->e.id, c->id, 8);
+    putLE(c->e.id + 8, hi, 8);
+    c->e.target = 0;
+
+    if (c->e.type == TREE_LINK) {
+        const unsigned char *end = s->sec[S_TARGET] + s->len[S_TARGET];
+        uint64_t n;
+        if (!getVarint(&c->p[S_TARGET], end, &n)
+            || n > (uint64_t)(end - c->p[S_TARGET]))
+            goto damaged;
+        if (!reserve(&c->target, &c->targetCap, n + 1)) goto nomem;
+        memcpy(c->target, c->p[S_TARGET], n);
+        c->target[n] = 0;
+        c->p[S_TARGET] += n;
+        c->e.target = c->target;
+    }
+
+    c->left--;
+    return 1;
+
+ damaged:
+    errno = EINVAL;
+    return -1;
+ nomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+int tree_snap_foreach(const struct tree_snap *s, tree_callback cb,
+                      void *ctx)
+{
+    struct cursor c;
+    int r;
+
+    cursorInit(&c, s);
+    while ((r = cursorNext(&c)) > 0)
+        if ((r = cb(&c.e, ctx))) break;
+    cursorFree(&c);
+    return r;
+}
+
+/* Diffs */
+
+static unsigned changes(const struct tree_entry *a, const struct tree_entry *b)
+{
+    unsigned m = 0;
+    if (a->type != b->type) m |= TREE_CHANGED_TYPE;
+    if (a->size != b->size) m |= TREE_CHANGED_SIZE;
+    if (a->mtime != b->mtime) m |= TREE_CHANGED_MTIME;
+    if (a->dev != b->dev || memcmp(a->id, b->id, sizeof(a->id)))
+        m |= TREE_CHANGED_ID;
+    if ((a->target || b->target)
+        && (!a->target || !b->target || strcmp(a->target, b->target)))
+        m |= TREE_CHANGED_TARGET;
+    return m;
+}
+
+int tree_diff(const struct tree_snap *old, const struct tree_snap *cur,
+              tree_diff_callback cb, void *ctx)
+{
+    struct cursor a, b;
+    cursorInit(&a, old);
+    cursorInit(&b, cur);
+
+    int ha = cursorNext(&a), hb = cursorNext(&b), s = 0;
+    while (!s && ha >= 0 && hb >= 0 && (ha || hb)) {
+        int c = !ha ? 1 : !hb ? -1 : comparePaths(a.e.path, b.e.path);
+        if (c < 0) {
+            s = cb(&a.e, 0, 0, ctx);
+            ha = cursorNext(&a);
+        } else if (c > 0) {
+            s = cb(0, &b.e, 0, ctx);
+            hb = cursorNext(&b);
+        } else {
+            unsigned m = changes(&a.e, &b.e);
+            if (m) s = cb(&a.e, &b.e, m, ctx);
+            ha = cursorNext(&a);
+            hb = cursorNext(&b);
+        }
+    }
+    if (!s && (ha < 0 || hb < 0)) s = -1;
+
+    int err = errno;
+    cursorFree(&a);
+    cursorFree(&b);
+    errno = err;
+    return s;
+}
+
+struct scanDiff {
+    struct cursor old;
+    int have;               // cursorNext()'s last result
+    struct tree_snap_writer *w;
+    tree_diff_callback cb;
+    void *ctx;
+};
+
+static int diffScanned(const struct tree_entry *e, void *ctx)
+{
+    struct scanDiff *d = ctx;
+    int s;
+
+    if (d->w && tree_snap_add(d->w, e)) return -1;
+
+    int c = 1;
+    while (d->have > 0 && (c = comparePaths(d->old.e.path, e->path)) < 0) {
+        if ((s = d->cb(&d->old.e, 0, 0, d->ctx))) return s;
+        d->have = cursorNext(&d->old);
+    }
+    if (d->have < 0) return -1;
+
+    if (d->have && !c) {
+        unsigned m = changes(&d->old.e, e);
+        if (m && (s = d->cb(&d->old.e, e, m, d->ctx))) return s;
+        d->have = cursorNext(&d->old);
+        return 0;
+    }
+    return d->cb(0, e, 0, d->ctx);
+}
+
+int tree_diff_scan(const struct tree_snap *old, const char *root,
+                   struct tree_snap_writer *w, tree_diff_callback cb,
+                   void *ctx)
+{
+    struct scanDiff d = { .w = w, .cb = cb, .ctx = ctx };
+    cursorInit(&d.old, old);
+    d.have = cursorNext(&d.old);
+
+    int s = d.have < 0 ? -1 : tree_scan(root, diffScanned, &d);
+    while (!s && d.have > 0) {
+        s = cb(&d.old.e, 0, 0, ctx);
+        d.have = cursorNext(&d.old);
+    }
+    if (!s && d.have < 0) s = -1;
+
+    int err = errno;
+    cursorFree(&d.old);
+    errno = err;
+    return s;
+}
+
+#ifdef UNIT_TEST
+// Linux:   gcc -DUNIT_TEST -g -Wall treesnap.c -o treesnap
+// Windows: gcc -DUNIT_TEST -g -Wall treesnap.c symlink.c reparse.c
+//              winerrno.c diag.c symstats.c fault.c metacache.c -o treesnap
+//
+// treesnap [dir]             runs the tests in 'dir' (default: the current
+//                            one)
+// treesnap -b root snapshot  times scanning 'root' into 'snapshot',
+//                            reading it back, and diffing against a scan
+
+#include <time.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define makeDir(p)  _mkdir(p)
+
+static double now(void)
+{
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return t.QuadPart / (double)f.QuadPart;
+}
+#else
+#define makeDir(p)  mkdir(p, 0777)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("FAILED line %d: %s\n", __LINE__, #cond); \
+                        failures++; } } while (0)
+
+// entries copied out of a walk
+struct list {
+    struct tree_entry e[64];
+    char text[64][512];
+    int n;
+};
+
+static int collect(const struct tree_entry *e, void *ctx)
+{
+    struct list *l = ctx;
+    if (l->n == 64) return 0;
+    l->e[l->n] = *e;
+    snprintf(l->text[l->n], sizeof(l->text[0]), "%s\t%s", e->path,
+             e->target ? e->target : "");
+    l->e[l->n].path = l->text[l->n];
+    l->n++;
+    return 0;
+}
+
+static bool sameEntries(const struct list *a, const struct list *b)
+{
+    if (a->n != b->n) return false;
+    for (int i=0; i < a->n; i++) {
+        const struct tree_entry *x = &a->e[i], *y = &b->e[i];
+        if (strcmp(a->text[i], b->text[i]) || x->type != y->type
+            || x->size != y->size || x->mtime != y->mtime || x->dev != y->dev
+            || memcmp(x->id, y->id, sizeof(x->id)))
+            return false;
+    }
+    return true;
+}
+
+static int collectDiff(const struct tree_entry *old,
+                       const struct tree_entry *cur, unsigned changed,
+                       void *ctx)
+{
+    struct list *l = ctx;
+
+    // directories change times when what's in them changes
+    if (old && cur && cur->type == TREE_DIR
+        && !(changed & ~(TREE_CHANGED_SIZE | TREE_CHANGED_MTIME)))
+        return 0;
+    if (l->n < 64)
+        snprintf(l->text[l->n++], sizeof(l->text[0]), "%s %s %x",
+                 !old ? "added" : !cur ? "removed" : "changed",
+                 cur ? cur->path : old->path, changed);
+    return 0;
+}
+
+static int countDiff(const struct tree_entry *old,
+                     const struct tree_entry *cur, unsigned changed,
+                     void *ctx)
+{
+    (void)old, (void)cur, (void)changed;
+    ++*(size_t*)ctx;
+    return 0;
+}
+
+static int countEntry(const struct tree_entry *e, void *ctx)
+{
+    (void)e;
+    ++*(size_t*)ctx;
+    return 0;
+}
+
+static int removeEntry(const struct tree_entry *e, void *ctx)
+{
+    struct list *l = ctx;
+    collect(e, l);
+    return 0;
+}
+
+static void removeTree(const char *root)
+{
+    struct list l = {0};
+    char p[4096];
+
+    tree_scan(root, removeEntry, &l);
+    for (int i=l.n; i--; ) {
+        snprintf(p, sizeof(p), "%s%c%s", root, SEP, l.e[i].path);
+        *strchr(p, '\t') = 0;
+        if (l.e[i].type == TREE_DIR) rmdir(p);
+        else remove(p);
+    }
+    rmdir(root);
+}
+
+static void writeFile(const char *root, const char *rel, const char *data)
+{
+    char p[4096];
+    snprintf(p, sizeof(p), "%s%c%s", root, SEP, rel);
+    for (char *q = p + strlen(root) + 1; *q; q++)
+        if (*q == '/') *q = SEP;
+
+    FILE *fp = fopen(p, "wb");
+    if (!fp) { perror(p); exit(1); }
+    fputs(data, fp);
+    fclose(fp);
+}
+
+static void makeSub(const char *root, const char *rel)
+{
+    char p[4096];
+    snprintf(p, sizeof(p), "%s%c%s", root, SEP, rel);
+    CHECK(!makeDir(p));
+}
+
+static int bench(const char *root, const char *snap)
+{
+    double t = now();
+    if (tree_snap_save(root, snap)) {
+        perror(root);
+        return 1;
+    }
+    double scanned = now() - t;
+
+    t = now();
+    struct tree_snap *s = tree_snap_open(snap);
+    if (!s) {
+        perror(snap);
+        return 1;
+    }
+    size_t n = 0;
+    CHECK(!tree_snap_foreach(s, countEntry, &n));
+    double read = now() - t;
+
+    t = now();
+    size_t diffs = 0;
+    CHECK(!tree_diff_scan(s, root, 0, countDiff, &diffs));
+    double diffed = now() - t;
+
+    FILE *fp = fopen(snap, "rb");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+
+    printf("%zu entries, %ld bytes (%.1f per entry)\n"
+           "scan and save %.3f s; open and read %.4f s (%.1f M entries/s); "
+           "diff against a scan %.3f s, %zu differences\n",
+           n, size, n ? (double)size/n : 0, scanned, read,
+           read ? n/read/1e6 : 0, diffed, diffs);
+    tree_snap_close(s);
+    return failures != 0;
+}
+
+int main(int ac, char**av)
+{
+    if (ac == 4 && !strcmp(av[1], "-b"))
+        return bench(av[2], av[3]);
+
+    const char *dir = ac > 1 ? av[1] : ".";
+    // room in 'p' and 'q' for a name under 'root'
+    char root[2048], snap[2048], snap2[2048], p[4096], q[4096];
+    snprintf(root, sizeof(root), "%s%ctreesnap_test", dir, SEP);
+    snprintf(snap, sizeof(snap), "%s%ctreesnap_test.1", dir, SEP);
+    snprintf(snap2, sizeof(snap2), "%s%ctreesnap_test.2", dir, SEP);
+    removeTree(root);
+    remove(snap);
+    remove(snap2);
+
+    // 'a' sorts before "a-b" and "a.c", and everything in it with it;
+    // "README" appears three times but is stored once
+    CHECK(!makeDir(root));
+    makeSub(root, "a");
+    makeSub(root, "a/sub");
+    makeSub(root, "b");
+    writeFile(root, "a/x", "x");
+    writeFile(root, "a/README", "1");
+    writeFile(root, "a/sub/README", "22");
+    writeFile(root, "b/README", "333");
+    writeFile(root, "a-b", "a-b");
+    writeFile(root, "a.c", "a.c");
+    snprintf(p, sizeof(p), "%s%cl", root, SEP);
+    CHECK(!symlink("a.c", p));
+
+    struct list scanned = {0}, read = {0};
+    CHECK(!tree_scan(root, collect, &scanned));
+    CHECK(scanned.n == 10);
+    const char *order[] = {
+        "a", "a/README", "a/sub", "a/sub/README", "a/x", "a-b", "a.c",
+        "b", "b/README", "l"
+    };
+    for (int i=0; i < 10 && i < scanned.n; i++) {
+        snprintf(q, sizeof(q), "%s\t", order[i]);
+        for (char *r = q; *r; r++) if (*r == '/') *r = SEP;
+        if (i == 9) strcat(q, "a.c");
+        CHECK(!strcmp(scanned.text[i], q));
+    }
+
+    CHECK(!tree_snap_save(root, snap));
+    struct tree_snap *s = tree_snap_open(snap);
+    CHECK(s);
+    if (!s) return 1;
+    CHECK(tree_snap_count(s) == 10);
+    CHECK(!tree_snap_foreach(s, collect, &read));
+    CHECK(sameEntries(&scanned, &read));
+
+    FILE *fp = fopen(snap, "rb");
+    fseek(fp, 0, SEEK_END);
+    printf("%ld bytes for %d entries\n", ftell(fp), read.n);
+    fclose(fp);
+
+    // nothing changed
+    struct list diff = {0};
+    CHECK(!tree_diff_scan(s, root, 0, collectDiff, &diff));
+    CHECK(diff.n == 0);
+
+    // modify a/x, remove b/README, add a/y, rename a.c, repoint l
+    writeFile(root, "a/x", "longer");
+    snprintf(p, sizeof(p), "%s%cb%cREADME", root, SEP, SEP);
+    CHECK(!remove(p));
+    writeFile(root, "a/y", "y");
+    snprintf(p, sizeof(p), "%s%ca.c", root, SEP);
+    snprintf(q, sizeof(q), "%s%cc", root, SEP);
+    CHECK(!rename(p, q));
+    snprintf(p, sizeof(p), "%s%cl", root, SEP);
+    CHECK(!remove(p));
+    CHECK(!symlink("c", p));
+
+    struct tree_snap_writer *w = tree_snap_create(snap2);
+    CHECK(w);
+    CHECK(!tree_diff_scan(s, root, w, collectDiff, &diff));
+    CHECK(!tree_snap_finish(w));
+    for (int i=0; i < diff.n; i++) printf("%s\n", diff.text[i]);
+
+    char ax[64], ay[64], br[64], l[64];
+    snprintf(ax, sizeof(ax), "changed a%cx %x", SEP,
+             TREE_CHANGED_SIZE | TREE_CHANGED_MTIME);
+    snprintf(ay, sizeof(ay), "added a%cy 0", SEP);
+    snprintf(br, sizeof(br), "removed b%cREADME 0", SEP);
+    CHECK(diff.n == 6);
+    CHECK(diff.n > 0 && !strncmp(diff.text[0], ax, strlen(ax) - 1));
+    CHECK(diff.n > 1 && !strcmp(diff.text[1], ay));
+    CHECK(diff.n > 2 && !strcmp(diff.text[2], "removed a.c 0"));
+    CHECK(diff.n > 3 && !strcmp(diff.text[3], br));
+    CHECK(diff.n > 4 && !strcmp(diff.text[4], "added c 0"));
+    snprintf(l, sizeof(l), "changed l");
+    CHECK(diff.n > 5 && !strncmp(diff.text[5], l, strlen(l)));
+
+    // two snapshots give the same diff as a snapshot and a scan
+    struct tree_snap *s2 = tree_snap_open(snap2);
+    CHECK(s2);
+    if (!s2) return 1;
+    struct list diff2 = {0};
+    CHECK(!tree_diff(s, s2, collectDiff, &diff2));
+    CHECK(diff2.n == diff.n);
+    for (int i=0; i < diff.n && i < diff2.n; i++)
+        CHECK(!strcmp(diff.text[i], diff2.text[i]));
+    tree_snap_close(s2);
+    tree_snap_close(s);
+
+    // damage: truncated, and not a snapshot
+    fp = fopen(snap2, "rb");
+    static unsigned char data[1 << 16];
+    size_t n = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
+    fp = fopen(snap, "wb");
+    fwrite(data, 1, n - 10, fp);
+    fclose(fp);
+    s = tree_snap_open(snap);
+    CHECK(!s && errno == EINVAL);
+
+    // a column cut short, with the header intact
+    memcpy(data + 8 + 16 + 16*S_SIZE + 8, "\0\0\0\0\0\0\0\0", 8);
+    fp = fopen(snap, "wb");
+    fwrite(data, 1, n, fp);
+    fclose(fp);
+    s = tree_snap_open(snap);
+    CHECK(s);
+    if (s) {
+        struct list junk = {0};
+        CHECK(tree_snap_foreach(s, collect, &junk) == -1 && errno == EINVAL);
+        tree_snap_close(s);
+    }
+
+    // a section placed far past the end
+    memcpy(data + 8 + 16, "\xff\xff\xff\xff\xff\xff\xff\xff", 8);
+    fp = fopen(snap, "wb");
+    fwrite(data, 1, n, fp);
+    fclose(fp);
+    s = tree_snap_open(snap);
+    CHECK(!s && errno == EINVAL);
+
+    writeFile(dir, "treesnap_test.1", "not a snapshot, but long enough to "
+              "have a header's worth of bytes in it. ................"
+              "..........................................................."
+              "...........................................................");
+    s = tree_snap_open(snap);
+    CHECK(!s && errno == EINVAL);
+
+    removeTree(root);
+    remove(snap);
+    remove(snap2);
+
+    printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures != 0;
+}
+#endif
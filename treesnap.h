@@ -0,0 +1,128 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _TREESNAP_H
+#define _TREESNAP_H
+
+/* Snapshots of a directory tree's metadata (what lstat() and readlink()
+   say about each entry) in a compact file that is read in place through
+   a memory mapping, and diffs of a snapshot against a live scan or
+   another snapshot in one streaming pass.
+
+   Entries are kept in path order, comparing paths with the separator
+   below every other character, so each directory is followed by
+   everything under it.  Each field is a column of its own: depth, name
+   (an index into a table holding each distinct name once), type, size,
+   time, volume, file ID and link target, as varints, with times, volumes
+   and IDs as differences from the previous entry.  An entry typically
+   takes 20-30 bytes, names included.
+ */
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+// entry types
+#define TREE_FILE       1
+#define TREE_DIR        2
+#define TREE_LINK       3   // symbolic link or junction; not followed
+#define TREE_OTHER      4
+
+struct tree_entry {
+    const char *path;               // relative to the root
+    int type;
+    unsigned long long size;
+    long long mtime;                // ns since the Unix epoch
+    unsigned long long dev;         // volume serial number, or st_dev
+    unsigned char id[16];           // file ID or inode; zero if not known
+    const char *target;             // TREE_LINK only, else NULL
+};
+
+/* Called for each entry in path order; '*e' is valid only during the
+   call.  A nonzero return stops the walk, which returns that value.
+*/
+typedef int (*tree_callback)(const struct tree_entry *e, void *ctx);
+
+/* Scans the tree under 'root', not including 'root' itself.  Returns 0,
+   the callback's nonzero value, or -1 with errno set.
+*/
+int tree_scan(const char *root, tree_callback cb, void *ctx);
+
+/* Writing.  Entries are added in path order, as tree_scan() gives them.
+   tree_snap_finish() writes the file, replacing any old one atomically,
+   and frees the writer; tree_snap_abort() frees it without writing.
+*/
+struct tree_snap_writer;
+
+struct tree_snap_writer *tree_snap_create(const char *path);
+int tree_snap_add(struct tree_snap_writer *w, const struct tree_entry *e);
+int tree_snap_finish(struct tree_snap_writer *w);
+void tree_snap_abort(struct tree_snap_writer *w);
+
+/* Scans 'root' into a new snapshot at 'path'. */
+int tree_snap_save(const char *root, const char *path);
+
+/* Reading.  tree_snap_open() maps the file and checks its header; a file
+   that isn't a snapshot fails with EINVAL, as does a walk that finds it
+   damaged.
+*/
+struct tree_snap;
+
+struct tree_snap *tree_snap_open(const char *path);
+void tree_snap_close(struct tree_snap *s);
+size_t tree_snap_count(const struct tree_snap *s);
+int tree_snap_foreach(const struct tree_snap *s, tree_callback cb,
+                      void *ctx);
+
+/* Diffs.  The callback gets each entry only in 'old' (cur NULL), only in
+   the new tree (old NULL), or in both but different, with 'changed'
+   saying how.  Renames show up as a removal and an addition with the
+   same 'dev' and 'id'.
+*/
+#define TREE_CHANGED_TYPE       0x01
+#define TREE_CHANGED_SIZE       0x02
+#define TREE_CHANGED_MTIME      0x04
+#define TREE_CHANGED_ID         0x08    // replaced by another file
+#define TREE_CHANGED_TARGET     0x10
+
+typedef int (*tree_diff_callback)(const struct tree_entry *old,
+                                  const struct tree_entry *cur,
+                                  unsigned changed, void *ctx);
+
+int tree_diff(const struct tree_snap *old, const struct tree_snap *cur,
+              tree_diff_callback cb, void *ctx);
+
+/* Diffs 'old' against a scan of 'root', also adding the scanned entries
+   to 'w' if it isn't NULL, to save the new state in the same pass.
+*/
+int tree_diff_scan(const struct tree_snap *old, const char *root,
+                   struct tree_snap_writer *w, tree_diff_callback cb,
+                   void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
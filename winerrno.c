@@ -0,0 +1,146 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <windows.h>
+#include "winerrno.h"
+
+// Indexed by error code, so lookup takes constant time.  Codes not listed
+// map to EIO.  Follows the C runtime's _dosmaperr() where that has an entry.
+static const unsigned char errnoTable[] = {
+    [ERROR_INVALID_FUNCTION]        = EINVAL,
+    [ERROR_FILE_NOT_FOUND]          = ENOENT,
+    [ERROR_PATH_NOT_FOUND]          = ENOENT,
+    [ERROR_TOO_MANY_OPEN_FILES]     = EMFILE,
+    [ERROR_ACCESS_DENIED]           = EACCES,
+    [ERROR_INVALID_HANDLE]          = EBADF,
+    [ERROR_ARENA_TRASHED]           = ENOMEM,
+    [ERROR_NOT_ENOUGH_MEMORY]       = ENOMEM,
+    [ERROR_INVALID_BLOCK]           = ENOMEM,
+    [ERROR_BAD_ENVIRONMENT]         = E2BIG,
+    [ERROR_BAD_FORMAT]              = ENOEXEC,
+    [ERROR_INVALID_ACCESS]          = EINVAL,
+    [ERROR_INVALID_DATA]            = EINVAL,
+    [ERROR_OUTOFMEMORY]             = ENOMEM,
+    [ERROR_INVALID_DRIVE]           = ENOENT,
+    [ERROR_CURRENT_DIRECTORY]       = EACCES,
+    [ERROR_NOT_SAME_DEVICE]         = EXDEV,
+    [ERROR_NO_MORE_FILES]           = ENOENT,
+    [ERROR_WRITE_PROTECT]           = EROFS,
+    [ERROR_BAD_UNIT]                = ENODEV,
+    [ERROR_NOT_READY]               = EAGAIN,
+    [ERROR_SHARING_VIOLATION]       = EACCES,
+    [ERROR_LOCK_VIOLATION]          = EACCES,
+    [ERROR_HANDLE_DISK_FULL]        = ENOSPC,
+    [ERROR_NOT_SUPPORTED]           = ENOTSUP,
+    [ERROR_BAD_NETPATH]             = ENOENT,
+    [ERROR_NETWORK_ACCESS_DENIED]   = EACCES,
+    [ERROR_BAD_NET_NAME]            = ENOENT,
+    [ERROR_FILE_EXISTS]             = EEXIST,
+    [ERROR_CANNOT_MAKE]             = EACCES,
+    [ERROR_INVALID_PARAMETER]       = EINVAL,
+    [ERROR_NO_PROC_SLOTS]           = EAGAIN,
+    [ERROR_BROKEN_PIPE]             = EPIPE,
+    [ERROR_DISK_FULL]               = ENOSPC,
+    [ERROR_INVALID_TARGET_HANDLE]   = EBADF,
+    [ERROR_CALL_NOT_IMPLEMENTED]    = ENOSYS,
+    [ERROR_SEM_TIMEOUT]             = ETIMEDOUT,
+    [ERROR_INSUFFICIENT_BUFFER]     = ERANGE,
+    [ERROR_INVALID_NAME]            = ENOENT,
+    [ERROR_WAIT_NO_CHILDREN]        = ECHILD,
+    [ERROR_CHILD_NOT_COMPLETE]      = ECHILD,
+    [ERROR_DIRECT_ACCESS_HANDLE]    = EBADF,
+    [ERROR_NEGATIVE_SEEK]           = EINVAL,
+    [ERROR_SEEK_ON_DEVICE]          = EACCES,
+    [ERROR_DIR_NOT_EMPTY]           = ENOTEMPTY,
+    [ERROR_NOT_LOCKED]              = EACCES,
+    [ERROR_BAD_PATHNAME]            = ENOENT,
+    [ERROR_MAX_THRDS_REACHED]       = EAGAIN,
+    [ERROR_LOCK_FAILED]             = EACCES,
+    [ERROR_BUSY]                    = EBUSY,
+    [ERROR_ALREADY_EXISTS]          = EEXIST,
+    [ERROR_BAD_EXE_FORMAT]          = ENOEXEC,
+    [ERROR_FILENAME_EXCED_RANGE]    = ENAMETOOLONG,
+    [ERROR_NESTING_NOT_ALLOWED]     = EAGAIN,
+    [ERROR_FILE_TOO_LARGE]          = EFBIG,
+    [ERROR_NO_DATA]                 = EPIPE,
+    [ERROR_DIRECTORY]               = ENOTDIR,
+    [ERROR_OPERATION_ABORTED]       = EINTR,
+    [ERROR_NOACCESS]                = EFAULT,
+    [ERROR_NO_UNICODE_TRANSLATION]  = EILSEQ,
+    [ERROR_TOO_MANY_LINKS]          = EMLINK,
+    [ERROR_DEVICE_NOT_CONNECTED]    = ENXIO,
+    [ERROR_DISK_QUOTA_EXCEEDED]     = ENOSPC,
+    [ERROR_PRIVILEGE_NOT_HELD]      = EPERM,
+    [ERROR_NOT_ENOUGH_QUOTA]        = ENOMEM,
+    [ERROR_CANT_ACCESS_FILE]        = EACCES,
+    [ERROR_CANT_RESOLVE_FILENAME]   = ELOOP,
+    [ERROR_NOT_A_REPARSE_POINT]     = EINVAL,
+    [ERROR_INVALID_REPARSE_DATA]    = EINVAL,
+    [ERROR_REPARSE_TAG_INVALID]     = EINVAL,
+};
+
+static __thread unsigned long lastError;
+
+int win32_to_errno(unsigned long err)
+{
+    if (err < sizeof(errnoTable) && errnoTable[err])
+        return errnoTable[err];
+    return EIO;
+}
+
+unsigned long win32_record_error(void)
+{
+    return lastError = GetLastError();
+}
+
+void win32_set_errno(void)
+{
+    errno = win32_to_errno(win32_record_error());
+}
+
+unsigned long win32_last_error(void)
+{
+    return lastError;
+}
+
+const char *win32_strerror(unsigned long err, char *buf, size_t len)
+{
+    if (!len) return buf;
+
+    DWORD n = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM
+                             | FORMAT_MESSAGE_IGNORE_INSERTS,
+                             0, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+                             buf, len, 0);
+    if (!n) {
+        snprintf(buf, len, "error %lu", err);
+        return buf;
+    }
+
+    // drop the trailing ".\r\n"
+    while (n && (buf[n-1] == '\n' || buf[n-1] == '\r' || buf[n-1] == '.'))
+        buf[--n] = 0;
+    return buf;
+}
@@ -0,0 +1,58 @@
+/*
+  Released under MIT License
+
+  Copyright (c) 2021 Glenn Burkhardt.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef _WINERRNO_H
+#define _WINERRNO_H
+
+#include <stddef.h>
+
+/* Win32 error codes to errno values, shared by the library.  Mapping is
+   a table lookup; nothing is formatted or printed on the error path.
+ */
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* errno value for a Win32 error code; EIO for codes not in the table. */
+int win32_to_errno(unsigned long err);
+
+/* Records GetLastError() for win32_last_error() and returns it. */
+unsigned long win32_record_error(void);
+
+/* Records GetLastError() and sets errno from it. */
+void win32_set_errno(void);
+
+/* The last Win32 error recorded by a library call in this thread. */
+unsigned long win32_last_error(void);
+
+/* Message text for a Win32 error code, formatted into 'buf' only when
+   called.  Returns 'buf'.
+*/
+const char *win32_strerror(unsigned long err, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif